@@ -0,0 +1,563 @@
+#include <algorithm>
+
+#include "batch.h"
+#include "vole.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define VOLE_BATCH_X86 1
+#endif
+
+using namespace vole;
+
+namespace {
+/// Lanes in an AVX2 vector. Rows are padded to a multiple of it, so the
+/// kernels never handle a partial vector.
+const size_t VECTOR = 32;
+/// Fewest lanes worth a lock step.
+const size_t MIN_GROUP = 4;
+/// Instructions a lane runs by itself before lock step is tried again.
+const uint64_t SCALAR_SLICE = 1024;
+
+enum class AluOp { ADD, OR, AND, XOR };
+
+/// Kernels over rows of `n` lanes. Masks hold 0xFF for selected lanes and
+/// 0x00 for the others.
+struct Kernels {
+	/// Select the active lanes at `at` whose instruction is `high`, `low` into
+	/// `mask` and list them in `group`. Returns how many there are.
+	size_t (*select)(uint8_t *mask, uint32_t *group, const uint8_t *active, const uint8_t *pc, const uint8_t *high,
+					 const uint8_t *low, uint8_t at, uint8_t h, uint8_t l, size_t n);
+	/// Lowest PC among the active lanes (0xFF when there are none).
+	uint8_t (*lowest)(const uint8_t *pc, const uint8_t *active, size_t n);
+	/// `dst = mask ? src : dst`
+	void (*blend)(uint8_t *dst, const uint8_t *src, const uint8_t *mask, size_t n);
+	/// `dst = mask ? value : dst`
+	void (*fill)(uint8_t *dst, uint8_t value, const uint8_t *mask, size_t n);
+	/// `dst = mask ? s op t : dst`
+	void (*alu)(AluOp op, uint8_t *dst, const uint8_t *s, const uint8_t *t, const uint8_t *mask, size_t n);
+	/// `dst = mask ? dst rotated right by `by` : dst`, for `by` in 1 to 7.
+	void (*rotate)(uint8_t *dst, int by, const uint8_t *mask, size_t n);
+	/// `out = mask && a == b`
+	void (*equal)(uint8_t *out, const uint8_t *a, const uint8_t *b, const uint8_t *mask, size_t n);
+	/// `dst = mask ? dst + 1 : dst`
+	void (*tick)(uint8_t *dst, const uint8_t *mask, size_t n);
+};
+
+size_t SelectScalar(uint8_t *mask, uint32_t *group, const uint8_t *active, const uint8_t *pc, const uint8_t *high,
+					const uint8_t *low, uint8_t at, uint8_t h, uint8_t l, size_t n) {
+	size_t count = 0;
+	for (size_t i = 0; i < n; i++) {
+		bool selected = active[i] && pc[i] == at && high[i] == h && low[i] == l;
+		mask[i] = selected ? 0xFF : 0x00;
+		if (selected) {
+			group[count++] = i;
+		}
+	}
+	return count;
+}
+
+uint8_t LowestScalar(const uint8_t *pc, const uint8_t *active, size_t n) {
+	uint8_t lowest = 0xFF;
+	for (size_t i = 0; i < n; i++) {
+		lowest = std::min<uint8_t>(lowest, pc[i] | ~active[i]);
+	}
+	return lowest;
+}
+
+void BlendScalar(uint8_t *dst, const uint8_t *src, const uint8_t *mask, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		dst[i] = (src[i] & mask[i]) | (dst[i] & ~mask[i]);
+	}
+}
+
+void FillScalar(uint8_t *dst, uint8_t value, const uint8_t *mask, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		dst[i] = (value & mask[i]) | (dst[i] & ~mask[i]);
+	}
+}
+
+void AluScalar(AluOp op, uint8_t *dst, const uint8_t *s, const uint8_t *t, const uint8_t *mask, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		uint8_t value = op == AluOp::ADD  ? s[i] + t[i]
+						: op == AluOp::OR ? s[i] | t[i]
+						: op == AluOp::AND ? s[i] & t[i]
+										   : s[i] ^ t[i];
+		dst[i] = (value & mask[i]) | (dst[i] & ~mask[i]);
+	}
+}
+
+void RotateScalar(uint8_t *dst, int by, const uint8_t *mask, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		uint8_t value = (dst[i] >> by) | (dst[i] << (8 - by));
+		dst[i] = (value & mask[i]) | (dst[i] & ~mask[i]);
+	}
+}
+
+void EqualScalar(uint8_t *out, const uint8_t *a, const uint8_t *b, const uint8_t *mask, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = a[i] == b[i] ? mask[i] : 0x00;
+	}
+}
+
+void TickScalar(uint8_t *dst, const uint8_t *mask, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		dst[i] -= mask[i];
+	}
+}
+
+#ifdef VOLE_BATCH_X86
+__attribute__((target("sse4.1"))) size_t SelectSse4(uint8_t *mask, uint32_t *group, const uint8_t *active,
+													 const uint8_t *pc, const uint8_t *high, const uint8_t *low,
+													 uint8_t at, uint8_t h, uint8_t l, size_t n) {
+	const __m128i vat = _mm_set1_epi8(at), vh = _mm_set1_epi8(h), vl = _mm_set1_epi8(l);
+	size_t count = 0;
+	for (size_t i = 0; i < n; i += 16) {
+		__m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(active + i));
+		m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pc + i)), vat));
+		m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(high + i)), vh));
+		m = _mm_and_si128(m, _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(low + i)), vl));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(mask + i), m);
+		for (unsigned bits = _mm_movemask_epi8(m); bits != 0; bits &= bits - 1) {
+			group[count++] = i + CountTrailingZeros(bits);
+		}
+	}
+	return count;
+}
+
+__attribute__((target("sse4.1"))) uint8_t LowestSse4(const uint8_t *pc, const uint8_t *active, size_t n) {
+	__m128i lowest = _mm_set1_epi8(-1);
+	for (size_t i = 0; i < n; i += 16) {
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(active + i));
+		__m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pc + i));
+		lowest = _mm_min_epu8(lowest, _mm_or_si128(p, _mm_andnot_si128(a, _mm_set1_epi8(-1))));
+	}
+	// Spread the minimum over 16-bit lanes, where SSE4.1 has a horizontal min.
+	__m128i words = _mm_min_epu8(lowest, _mm_srli_epi16(lowest, 8));
+	words = _mm_and_si128(words, _mm_set1_epi16(0xFF));
+	return _mm_cvtsi128_si32(_mm_minpos_epu16(words)) & 0xFF;
+}
+
+__attribute__((target("sse4.1"))) void BlendSse4(uint8_t *dst, const uint8_t *src, const uint8_t *mask, size_t n) {
+	for (size_t i = 0; i < n; i += 16) {
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+		__m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+		__m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_blendv_epi8(d, s, m));
+	}
+}
+
+__attribute__((target("sse4.1"))) void FillSse4(uint8_t *dst, uint8_t value, const uint8_t *mask, size_t n) {
+	const __m128i v = _mm_set1_epi8(value);
+	for (size_t i = 0; i < n; i += 16) {
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+		__m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_blendv_epi8(d, v, m));
+	}
+}
+
+__attribute__((target("sse4.1"))) void AluSse4(AluOp op, uint8_t *dst, const uint8_t *s, const uint8_t *t,
+											   const uint8_t *mask, size_t n) {
+	for (size_t i = 0; i < n; i += 16) {
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(t + i));
+		__m128i value = op == AluOp::ADD  ? _mm_add_epi8(a, b)
+						: op == AluOp::OR ? _mm_or_si128(a, b)
+						: op == AluOp::AND ? _mm_and_si128(a, b)
+										   : _mm_xor_si128(a, b);
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+		__m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_blendv_epi8(d, value, m));
+	}
+}
+
+// Bytes have no shift instructions: shift 16-bit lanes, then clear the bits
+// that crossed in from the neighbouring byte.
+__attribute__((target("sse4.1"))) void RotateSse4(uint8_t *dst, int by, const uint8_t *mask, size_t n) {
+	const __m128i right = _mm_cvtsi32_si128(by), left = _mm_cvtsi32_si128(8 - by);
+	const __m128i low = _mm_set1_epi8(0xFF >> by), high = _mm_set1_epi8(static_cast<uint8_t>(0xFF << (8 - by)));
+	for (size_t i = 0; i < n; i += 16) {
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+		__m128i value = _mm_or_si128(_mm_and_si128(_mm_srl_epi16(d, right), low),
+									 _mm_and_si128(_mm_sll_epi16(d, left), high));
+		__m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_blendv_epi8(d, value, m));
+	}
+}
+
+__attribute__((target("sse4.1"))) void EqualSse4(uint8_t *out, const uint8_t *a, const uint8_t *b,
+												 const uint8_t *mask, size_t n) {
+	for (size_t i = 0; i < n; i += 16) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+		__m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+		__m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_and_si128(m, _mm_cmpeq_epi8(x, y)));
+	}
+}
+
+__attribute__((target("sse4.1"))) void TickSse4(uint8_t *dst, const uint8_t *mask, size_t n) {
+	for (size_t i = 0; i < n; i += 16) {
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + i));
+		__m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mask + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_sub_epi8(d, m));
+	}
+}
+
+__attribute__((target("avx2"))) size_t SelectAvx2(uint8_t *mask, uint32_t *group, const uint8_t *active,
+												  const uint8_t *pc, const uint8_t *high, const uint8_t *low,
+												  uint8_t at, uint8_t h, uint8_t l, size_t n) {
+	const __m256i vat = _mm256_set1_epi8(at), vh = _mm256_set1_epi8(h), vl = _mm256_set1_epi8(l);
+	size_t count = 0;
+	for (size_t i = 0; i < n; i += 32) {
+		__m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(active + i));
+		m = _mm256_and_si256(m, _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(pc + i)), vat));
+		m = _mm256_and_si256(m, _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(high + i)), vh));
+		m = _mm256_and_si256(m, _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(low + i)), vl));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(mask + i), m);
+		for (unsigned bits = _mm256_movemask_epi8(m); bits != 0; bits &= bits - 1) {
+			group[count++] = i + CountTrailingZeros(bits);
+		}
+	}
+	return count;
+}
+
+__attribute__((target("avx2"))) uint8_t LowestAvx2(const uint8_t *pc, const uint8_t *active, size_t n) {
+	__m256i lowest = _mm256_set1_epi8(-1);
+	for (size_t i = 0; i < n; i += 32) {
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(active + i));
+		__m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(pc + i));
+		lowest = _mm256_min_epu8(lowest, _mm256_or_si256(p, _mm256_andnot_si256(a, _mm256_set1_epi8(-1))));
+	}
+	__m128i half = _mm_min_epu8(_mm256_castsi256_si128(lowest), _mm256_extracti128_si256(lowest, 1));
+	__m128i words = _mm_min_epu8(half, _mm_srli_epi16(half, 8));
+	words = _mm_and_si128(words, _mm_set1_epi16(0xFF));
+	return _mm_cvtsi128_si32(_mm_minpos_epu16(words)) & 0xFF;
+}
+
+__attribute__((target("avx2"))) void BlendAvx2(uint8_t *dst, const uint8_t *src, const uint8_t *mask, size_t n) {
+	for (size_t i = 0; i < n; i += 32) {
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+		__m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+		__m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(mask + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_blendv_epi8(d, s, m));
+	}
+}
+
+__attribute__((target("avx2"))) void FillAvx2(uint8_t *dst, uint8_t value, const uint8_t *mask, size_t n) {
+	const __m256i v = _mm256_set1_epi8(value);
+	for (size_t i = 0; i < n; i += 32) {
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+		__m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(mask + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_blendv_epi8(d, v, m));
+	}
+}
+
+__attribute__((target("avx2"))) void AluAvx2(AluOp op, uint8_t *dst, const uint8_t *s, const uint8_t *t,
+											 const uint8_t *mask, size_t n) {
+	for (size_t i = 0; i < n; i += 32) {
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(t + i));
+		__m256i value = op == AluOp::ADD  ? _mm256_add_epi8(a, b)
+						: op == AluOp::OR ? _mm256_or_si256(a, b)
+						: op == AluOp::AND ? _mm256_and_si256(a, b)
+										   : _mm256_xor_si256(a, b);
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+		__m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(mask + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_blendv_epi8(d, value, m));
+	}
+}
+
+__attribute__((target("avx2"))) void RotateAvx2(uint8_t *dst, int by, const uint8_t *mask, size_t n) {
+	const __m128i right = _mm_cvtsi32_si128(by), left = _mm_cvtsi32_si128(8 - by);
+	const __m256i low = _mm256_set1_epi8(0xFF >> by), high = _mm256_set1_epi8(static_cast<uint8_t>(0xFF << (8 - by)));
+	for (size_t i = 0; i < n; i += 32) {
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+		__m256i value = _mm256_or_si256(_mm256_and_si256(_mm256_srl_epi16(d, right), low),
+										_mm256_and_si256(_mm256_sll_epi16(d, left), high));
+		__m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(mask + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_blendv_epi8(d, value, m));
+	}
+}
+
+__attribute__((target("avx2"))) void EqualAvx2(uint8_t *out, const uint8_t *a, const uint8_t *b, const uint8_t *mask,
+											   size_t n) {
+	for (size_t i = 0; i < n; i += 32) {
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+		__m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+		__m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(mask + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_and_si256(m, _mm256_cmpeq_epi8(x, y)));
+	}
+}
+
+__attribute__((target("avx2"))) void TickAvx2(uint8_t *dst, const uint8_t *mask, size_t n) {
+	for (size_t i = 0; i < n; i += 32) {
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+		__m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(mask + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_sub_epi8(d, m));
+	}
+}
+#endif
+
+Kernels Detect() {
+#ifdef VOLE_BATCH_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return {SelectAvx2, LowestAvx2, BlendAvx2, FillAvx2, AluAvx2, RotateAvx2, EqualAvx2, TickAvx2};
+	}
+	if (__builtin_cpu_supports("sse4.1")) {
+		return {SelectSse4, LowestSse4, BlendSse4, FillSse4, AluSse4, RotateSse4, EqualSse4, TickSse4};
+	}
+#endif
+	return {SelectScalar, LowestScalar, BlendScalar, FillScalar, AluScalar, RotateScalar, EqualScalar, TickScalar};
+}
+
+const Kernels &Best() {
+	static const Kernels kernels = Detect();
+	return kernels;
+}
+} // namespace
+
+void MachineBatch::LaneScreen::clear() {
+	if (target != nullptr) {
+		target->clear();
+	}
+}
+
+void MachineBatch::LaneScreen::write(uint8_t c) {
+	if (target != nullptr) {
+		target->Put(c);
+	}
+}
+
+MachineBatch::MachineBatch(size_t lanes)
+	: m_Lanes(lanes), m_Stride((lanes + VECTOR - 1) / VECTOR * VECTOR), m_Memory(Memory::SIZE * m_Stride),
+	  m_Registers(16 * m_Stride), m_PC(m_Stride), m_Active(m_Stride), m_Mask(m_Stride), m_Taken(m_Stride),
+	  m_Group(m_Stride), m_Ticks(m_Stride), m_Budget(lanes), m_Results(lanes, {StopReason::BUDGET_EXHAUSTED, 0}),
+	  m_Screens(lanes), m_Running(0), m_Window(0), m_Scalar(&m_Screen) {}
+
+size_t MachineBatch::Lanes() const { return m_Lanes; }
+
+void MachineBatch::Load(size_t lane, const Machine &from) {
+	for (size_t cell = 0; cell < Memory::SIZE; cell++) {
+		SetCell(lane, cell, from.mem[cell]);
+	}
+	for (uint8_t r = 0; r < 16; r++) {
+		SetRegister(lane, r, from.reg[r]);
+	}
+	SetPC(lane, from.reg.pc);
+}
+
+void MachineBatch::Save(size_t lane, Machine &to) const {
+	for (size_t cell = 0; cell < Memory::SIZE; cell++) {
+		to.mem.Write(cell, Cell(lane, cell));
+	}
+	for (uint8_t r = 0; r < 16; r++) {
+		to.reg.Write(r, Register(lane, r));
+	}
+	to.reg.pc = PC(lane);
+}
+
+uint8_t MachineBatch::Cell(size_t lane, uint8_t at) const { return m_Memory[at * m_Stride + lane]; }
+
+void MachineBatch::SetCell(size_t lane, uint8_t at, uint8_t value) { m_Memory[at * m_Stride + lane] = value; }
+
+uint8_t MachineBatch::Register(size_t lane, uint8_t r) const { return m_Registers[r * m_Stride + lane]; }
+
+void MachineBatch::SetRegister(size_t lane, uint8_t r, uint8_t value) { m_Registers[r * m_Stride + lane] = value; }
+
+uint8_t MachineBatch::PC(size_t lane) const { return m_PC[lane]; }
+
+void MachineBatch::SetPC(size_t lane, uint8_t pc) { m_PC[lane] = pc; }
+
+void MachineBatch::SetScreen(size_t lane, Screen *screen) { m_Screens[lane] = screen; }
+
+const RunResult &MachineBatch::Result(size_t lane) const { return m_Results[lane]; }
+
+uint8_t *MachineBatch::Row(uint8_t cell) { return &m_Memory[cell * m_Stride]; }
+
+uint8_t *MachineBatch::RegisterRow(uint8_t r) { return &m_Registers[r * m_Stride]; }
+
+void MachineBatch::RunFor(uint64_t maxInstructions) {
+	const Kernels &k = Best();
+	m_Running = 0;
+	for (size_t lane = 0; lane < m_Lanes; lane++) {
+		m_Results[lane] = {StopReason::BUDGET_EXHAUSTED, 0};
+		m_Budget[lane] = maxInstructions;
+		m_Active[lane] = 0xFF;
+		m_Running++;
+	}
+	Settle();
+
+	while (m_Running != 0) {
+		if (m_Window == 0) {
+			Settle();
+			continue;
+		}
+		// Lanes behind the others go first, which lets those that skipped
+		// ahead over a forward branch be caught up with.
+		uint8_t at = k.lowest(m_PC.data(), m_Active.data(), m_Stride);
+		size_t leader = 0;
+		while (m_Active[leader] == 0 || m_PC[leader] != at) {
+			leader++;
+		}
+		uint8_t *high = Row(at), *low = Row(at + 1);
+		size_t count = k.select(m_Mask.data(), m_Group.data(), m_Active.data(), m_PC.data(), high, low, at,
+								high[leader], low[leader], m_Stride);
+		if (count < MIN_GROUP || count * 4 < m_Running) {
+			// Too divergent: a lock step would advance few lanes for the cost
+			// of all of them.
+			Settle();
+			for (size_t lane = 0; lane < m_Lanes; lane++) {
+				if (m_Active[lane] != 0) {
+					RunScalar(lane, std::min(m_Budget[lane], SCALAR_SLICE));
+				}
+			}
+			Settle();
+			continue;
+		}
+		StepGroup(at, Instruction(high[leader], low[leader]), count);
+		m_Window--;
+	}
+	for (Screen *screen : m_Screens) {
+		if (screen != nullptr) {
+			screen->Stopped();
+		}
+	}
+}
+
+void MachineBatch::StepGroup(uint8_t at, const Instruction &ins, size_t count) {
+	const Kernels &k = Best();
+	const uint8_t *mask = m_Mask.data();
+	const size_t n = m_Stride;
+
+	k.fill(m_PC.data(), at + 2, mask, n);
+	k.tick(m_Ticks.data(), mask, n);
+	switch (ins.opcode) {
+	case 0x1:
+		k.blend(RegisterRow(ins.operand1), Row(ins.operandXY), mask, n);
+		break;
+	case 0x2:
+		k.fill(RegisterRow(ins.operand1), ins.operandXY, mask, n);
+		break;
+	case 0x3:
+		k.blend(Row(ins.operandXY), RegisterRow(ins.operand1), mask, n);
+		if (ins.operandXY == 0x00) {
+			for (size_t i = 0; i < count; i++) {
+				Screen *screen = m_Screens[m_Group[i]];
+				uint8_t val = Row(0x00)[m_Group[i]];
+				if (screen == nullptr) {
+					continue;
+				} else if (val != 0) {
+					screen->Put(val);
+				} else {
+					screen->clear();
+				}
+			}
+		}
+		break;
+	case 0x4:
+		k.blend(RegisterRow(ins.operand3), RegisterRow(ins.operand2), mask, n);
+		break;
+	case 0x5:
+		k.alu(AluOp::ADD, RegisterRow(ins.operand1), RegisterRow(ins.operand2), RegisterRow(ins.operand3), mask, n);
+		break;
+	case 0x6:
+		for (size_t i = 0; i < count; i++) {
+			uint32_t lane = m_Group[i];
+			RegisterRow(ins.operand1)[lane] =
+				Float::Add(RegisterRow(ins.operand2)[lane], RegisterRow(ins.operand3)[lane]);
+		}
+		break;
+	case 0x7:
+		k.alu(AluOp::OR, RegisterRow(ins.operand1), RegisterRow(ins.operand2), RegisterRow(ins.operand3), mask, n);
+		break;
+	case 0x8:
+		k.alu(AluOp::AND, RegisterRow(ins.operand1), RegisterRow(ins.operand2), RegisterRow(ins.operand3), mask, n);
+		break;
+	case 0x9:
+		k.alu(AluOp::XOR, RegisterRow(ins.operand1), RegisterRow(ins.operand2), RegisterRow(ins.operand3), mask, n);
+		break;
+	case 0xA:
+		if (ins.operand3 % 8 != 0) {
+			k.rotate(RegisterRow(ins.operand1), ins.operand3 % 8, mask, n);
+		}
+		break;
+	case 0xB:
+		// Same target as Jump::Apply: an odd address jumps to the word before.
+		k.equal(m_Taken.data(), RegisterRow(ins.operand1), RegisterRow(0), mask, n);
+		k.fill(m_PC.data(), ins.operandXY & ~1, m_Taken.data(), n);
+		break;
+	case 0xC:
+	case 0xD:
+	case 0xE:
+	case 0xF:
+		for (size_t i = 0; i < count; i++) {
+			uint32_t lane = m_Group[i];
+			m_Results[lane].retired += m_Ticks[lane];
+			m_Budget[lane] -= m_Ticks[lane];
+			m_Ticks[lane] = 0;
+			Stop(lane, ins.opcode == 0xC ? StopReason::HALTED : StopReason::UNUSED_OPCODE);
+		}
+		break;
+	}
+}
+
+void MachineBatch::RunScalar(size_t lane, uint64_t slice) {
+	std::array<uint8_t, Memory::SIZE> &cells = *m_Scalar.mem.Array();
+	for (size_t cell = 0; cell < Memory::SIZE; cell++) {
+		cells[cell] = Cell(lane, cell);
+	}
+	for (uint8_t r = 0; r < 16; r++) {
+		m_Scalar.reg.Write(r, Register(lane, r));
+	}
+	m_Scalar.reg.pc = PC(lane);
+	m_Screen.target = m_Screens[lane];
+	m_Scalar.mem.ClearDirty();
+	m_Scalar.reg.ClearDirty();
+
+	RunResult result = m_Scalar.RunFor(slice);
+
+	// Copy back only what the slice wrote.
+	const CellMask &dirty = m_Scalar.mem.Dirty();
+	for (size_t word = 0; word < dirty.size(); word++) {
+		for (uint64_t bits = dirty[word]; bits != 0; bits &= bits - 1) {
+			size_t cell = word * 64 + CountTrailingZeros(bits);
+			SetCell(lane, cell, m_Scalar.mem.Read(cell));
+		}
+	}
+	for (uint16_t bits = m_Scalar.reg.Dirty(); bits != 0; bits &= bits - 1) {
+		uint8_t r = CountTrailingZeros(bits);
+		SetRegister(lane, r, m_Scalar.reg.Read(r));
+	}
+	SetPC(lane, m_Scalar.reg.pc);
+
+	m_Results[lane].retired += result.retired;
+	m_Budget[lane] -= result.retired;
+	if (result.reason != StopReason::BUDGET_EXHAUSTED || m_Budget[lane] == 0) {
+		Stop(lane, result.reason);
+	}
+}
+
+void MachineBatch::Settle() {
+	// Ticks are bytes.
+	uint64_t window = 0xFF;
+	for (size_t lane = 0; lane < m_Lanes; lane++) {
+		m_Results[lane].retired += m_Ticks[lane];
+		m_Budget[lane] -= m_Ticks[lane];
+		m_Ticks[lane] = 0;
+		if (m_Active[lane] == 0) {
+			continue;
+		} else if (m_Budget[lane] == 0) {
+			Stop(lane, StopReason::BUDGET_EXHAUSTED);
+		} else {
+			window = std::min(window, m_Budget[lane]);
+		}
+	}
+	m_Window = window;
+}
+
+void MachineBatch::Stop(size_t lane, StopReason reason) {
+	m_Results[lane].reason = reason;
+	m_Active[lane] = 0x00;
+	m_Running--;
+}
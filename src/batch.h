@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "vole.h"
+
+namespace vole {
+/// @brief Many independent machines with the default instruction set, run in
+/// lock step.
+///
+/// Memory, registers and program counters are stored structure-of-arrays: a
+/// cell or register of every lane is one contiguous row. Each step takes the
+/// lowest PC among the running lanes and executes the instruction there for
+/// every lane at that PC holding the same instruction word. Moves and the
+/// ALU op-codes (5, 7, 8, 9 and A) are blended into whole rows with AVX2 or
+/// SSE4.1 when the host has them. Lanes a Jump sent elsewhere are masked out
+/// and join again once their PCs meet.
+///
+/// When fewer than a quarter of the running lanes share an instruction, each
+/// running lane runs a slice on its own `Machine` instead.
+class MachineBatch {
+public:
+	explicit MachineBatch(size_t lanes);
+	MachineBatch(const MachineBatch &) = delete;
+	MachineBatch &operator=(const MachineBatch &) = delete;
+
+	size_t Lanes() const;
+
+	/// @brief Copy the memory, registers and PC of `from` into `lane`.
+	void Load(size_t lane, const Machine &from);
+	/// @brief Copy the memory, registers and PC of `lane` into `to`.
+	void Save(size_t lane, Machine &to) const;
+
+	uint8_t Cell(size_t lane, uint8_t at) const;
+	void SetCell(size_t lane, uint8_t at, uint8_t value);
+	uint8_t Register(size_t lane, uint8_t r) const;
+	void SetRegister(size_t lane, uint8_t r, uint8_t value);
+	uint8_t PC(size_t lane) const;
+	void SetPC(size_t lane, uint8_t pc);
+
+	/// @brief Screen `lane` writes cell 00 to. Writes are dropped while it is
+	/// `nullptr`, the default.
+	void SetScreen(size_t lane, Screen *);
+
+	/// @brief Run every lane until it halts or ran `maxInstructions`, same as
+	/// calling `Machine::RunFor()` on each of them.
+	void RunFor(uint64_t maxInstructions);
+
+	/// @brief Outcome of `lane` in the last RunFor().
+	const RunResult &Result(size_t lane) const;
+
+private:
+	/// Gives the scalar machine the screen of the lane it is running.
+	class LaneScreen : public Screen {
+	public:
+		Screen *target = nullptr;
+		void clear() override;
+		void write(uint8_t) override;
+	};
+
+	size_t m_Lanes;
+	/// Row length: the lane count rounded up to a whole AVX2 vector. Lanes
+	/// past `m_Lanes` never run.
+	size_t m_Stride;
+	/// Cell `c` of lane `l` at `c * m_Stride + l`.
+	std::vector<uint8_t> m_Memory;
+	/// Register `r` of lane `l` at `r * m_Stride + l`.
+	std::vector<uint8_t> m_Registers;
+	std::vector<uint8_t> m_PC;
+	/// 0xFF for lanes still running in RunFor(), 0x00 otherwise.
+	std::vector<uint8_t> m_Active;
+	/// 0xFF for lanes in the group being executed.
+	std::vector<uint8_t> m_Mask;
+	/// Scratch mask for Jump: lanes of the group taking the branch.
+	std::vector<uint8_t> m_Taken;
+	/// Lanes in the group being executed.
+	std::vector<uint32_t> m_Group;
+	/// Instructions each lane ran since the last Settle(), not yet counted in
+	/// `m_Budget` and `m_Results`.
+	std::vector<uint8_t> m_Ticks;
+	std::vector<uint64_t> m_Budget;
+	std::vector<RunResult> m_Results;
+	std::vector<Screen *> m_Screens;
+	size_t m_Running;
+	/// Lock steps left before Settle() has to run: no running lane can use
+	/// up its budget or overflow its ticks within them.
+	uint64_t m_Window;
+	LaneScreen m_Screen;
+	Machine m_Scalar;
+
+	uint8_t *Row(uint8_t cell);
+	uint8_t *RegisterRow(uint8_t r);
+	/// Execute one instruction for the lanes in `m_Mask` and `m_Group`.
+	void StepGroup(uint8_t at, const Instruction &, size_t count);
+	/// Run `lane` by itself for at most `slice` instructions.
+	void RunScalar(size_t lane, uint64_t slice);
+	/// Move `m_Ticks` into the budgets and results, stop the lanes out of
+	/// budget and start a new window.
+	void Settle();
+	void Stop(size_t lane, StopReason reason);
+};
+} // namespace vole
@@ -0,0 +1,557 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "dump.h"
+#include "jit.h"
+#include "loader.h"
+#include "screen.h"
+#include "vole.h"
+
+namespace fs = std::filesystem;
+
+typedef std::chrono::steady_clock Clock;
+
+/// How a benchmark executes instructions.
+enum class Engine { STEP, RUN, JIT };
+
+const char *describe(Engine engine) {
+	switch (engine) {
+	case Engine::STEP:
+		return "step";
+	case Engine::RUN:
+		return "run";
+	case Engine::JIT:
+		return "jit";
+	}
+	return "";
+}
+
+struct Options {
+	std::vector<Engine> engines = {Engine::STEP, Engine::RUN, Engine::JIT};
+	std::string filter;
+	/// Shortest a measurement runs for.
+	std::chrono::milliseconds minTime{200};
+	/// Measurements per benchmark, of which the fastest counts.
+	int repetitions = 3;
+	std::string examples = "examples";
+};
+
+struct Result {
+	std::string name;
+	/// Engine executing, empty for benchmarks that execute nothing.
+	std::string engine;
+	/// What an operation is: `instruction`, `decode`, `humanize` or `load`.
+	std::string unit;
+	uint64_t ops;
+	double seconds;
+};
+
+void usage() {
+	std::cerr << "usage: vole-bench [OPTION]...\n"
+			  << "Time the simulator's opcodes, programs, decoding, disassembly, loading and state\n"
+			  << "dumps, one JSON document.\n"
+			  << "\n"
+			  << "  --engine E        step, run, jit or all (default all): how instructions execute,\n"
+			  << "                    Machine::Step(), Machine::RunFor() or Jit::RunFor()\n"
+			  << "  --filter TEXT     only benchmarks whose name contains TEXT\n"
+			  << "  --min-time MS     shortest a measurement runs for (default 200)\n"
+			  << "  --repetitions N   measurements per benchmark, the fastest counts (default 3)\n"
+			  << "  --examples DIR    .vole and .voleb programs to time as a whole (default examples)\n"
+			  << "  --output FILE     write results to FILE instead of standard output\n"
+			  << "  --list            list the benchmarks instead of running them\n";
+}
+
+/// Keeps the results of decoding benchmarks alive.
+volatile uint64_t sink;
+
+/// Draws nothing: counts the points of `examples/draw.vole`.
+class Plot : public vole::ControlUnit {
+public:
+	using vole::ControlUnit::ControlUnit;
+	vole::ShouldHalt Execute() override {
+		sink = sink + mac->mem.Read(operandXY) + mac->mem.Read(operandXY + 1);
+		return vole::ShouldHalt::NO;
+	}
+	std::string Humanize() override { return "Plot the point in cell " + std::to_string(operandXY); }
+};
+
+/// Call `batch`, which does some operations and tells how many, until
+/// `minTime` passed, `repetitions` times.
+/// @return The fastest measurement.
+Result measure(const Options &options, const std::function<uint64_t()> &batch) {
+	Result best = {"", "", "", 0, 0};
+	for (int i = 0; i < options.repetitions; i++) {
+		uint64_t ops = 0;
+		Clock::time_point start = Clock::now(), now;
+		do {
+			ops += batch();
+			now = Clock::now();
+		} while (now - start < options.minTime);
+		double seconds = std::chrono::duration<double>(now - start).count();
+		if (best.ops == 0 || seconds / ops < best.seconds / best.ops) {
+			best.ops = ops;
+			best.seconds = seconds;
+		}
+	}
+	return best;
+}
+
+/// Execute at most `budget` instructions, stopping when the machine halts.
+vole::RunResult execute(Engine engine, vole::Machine &mac, vole::Jit &jit, uint64_t budget) {
+	switch (engine) {
+	case Engine::STEP:
+		for (uint64_t retired = 1; retired <= budget; retired++) {
+			if (mac.Step() == vole::ShouldHalt::YES) {
+				return {vole::StopReason::HALTED, retired};
+			}
+		}
+		return {vole::StopReason::BUDGET_EXHAUSTED, budget};
+	case Engine::RUN:
+		return mac.RunFor(budget);
+	case Engine::JIT:
+		return jit.RunFor(budget);
+	}
+	return {vole::StopReason::HALTED, 0};
+}
+
+/// A program timed on every engine.
+struct Program {
+	std::string name;
+	std::array<uint8_t, vole::Memory::SIZE> image;
+	/// Registers and PC it starts with.
+	std::array<uint8_t, 16> reg;
+	uint8_t pc;
+	/// Programs that halt are run again from the start until the batch has
+	/// executed this many instructions.
+	uint64_t batch;
+	/// Whether it writes nothing, so starting again only resets the PC
+	/// instead of restoring the whole state.
+	bool readOnly;
+};
+
+/// A loop of `count` copies of `high low` jumping back to 00 with an
+/// unconditional Jump, R1 = 01 and the other registers 00.
+Program opcodeLoop(const std::string &name, uint8_t high, uint8_t low, size_t count = 100) {
+	Program program = {"opcode/" + name, {}, {}, 0, 1 << 20, false};
+	for (size_t i = 0; i < count; i++) {
+		program.image[2 * i] = high;
+		program.image[2 * i + 1] = low;
+	}
+	program.image[2 * count] = 0xB0;
+	program.image[2 * count + 1] = 0x00;
+	program.reg[1] = 0x01;
+	return program;
+}
+
+std::vector<Program> programs(const Options &options) {
+	std::vector<Program> all = {
+		opcodeLoop("Nothing", 0x00, 0x00),
+		opcodeLoop("Load1", 0x12, 0xF0),
+		opcodeLoop("Load2", 0x22, 0x5A),
+		opcodeLoop("Store", 0x31, 0xF0),
+		// The screen cell: NullScreen drops the byte.
+		opcodeLoop("StoreScreen", 0x31, 0x00),
+		opcodeLoop("Move", 0x40, 0x12),
+		opcodeLoop("Add1", 0x52, 0x21),
+		opcodeLoop("Add2", 0x62, 0x21),
+		opcodeLoop("Or", 0x72, 0x21),
+		opcodeLoop("And", 0x82, 0x21),
+		opcodeLoop("Xor", 0x92, 0x21),
+		opcodeLoop("Rotate", 0xA2, 0x03),
+		// R1 is never R0.
+		opcodeLoop("JumpNotTaken", 0xB1, 0x00),
+	};
+
+	// Every Jump taken, each to the next word.
+	Program taken = opcodeLoop("JumpTaken", 0, 0);
+	for (size_t i = 0; i < 100; i++) {
+		taken.image[2 * i] = 0xB0;
+		taken.image[2 * i + 1] = 2 * i + 2;
+	}
+	all.push_back(taken);
+
+	Program halt = {"opcode/Halt", {0xC0, 0x00}, {}, 0, 1 << 12, true};
+	all.push_back(halt);
+
+	// R1 = 1, R3 counts 256 outer turns of an inner loop of 256.
+	all.push_back({"kernel/nested-loops",
+				   {0x21, 0x01, 0x23, 0x00, 0x22, 0x00, 0x52, 0x21, 0xB2, 0x0C, 0xB0, 0x06, 0x53, 0x31, 0xB3, 0x12,
+					0xB0, 0x04, 0xC0, 0x00},
+				   {},
+				   0,
+				   1 << 20,
+				   false});
+	// Fibonacci numbers modulo 256, forever: R1, R2 = R2, R1 + R2.
+	all.push_back({"kernel/fibonacci",
+				   {0x21, 0x00, 0x22, 0x01, 0x53, 0x12, 0x40, 0x21, 0x40, 0x32, 0x31, 0x80, 0xB0, 0x04},
+				   {},
+				   0,
+				   1 << 20,
+				   false});
+	// Float sums of a table of 8 cells at 80, forever.
+	Program floats = {"kernel/float-sum",
+					  {0x20, 0x00, 0x11, 0x80, 0x12, 0x81, 0x61, 0x12, 0x12, 0x82, 0x61, 0x12, 0x12, 0x83, 0x61, 0x12,
+					   0x12, 0x84, 0x61, 0x12, 0x12, 0x85, 0x61, 0x12, 0x12, 0x86, 0x61, 0x12, 0x12, 0x87, 0x61, 0x12,
+					   0x31, 0x90, 0xB0, 0x02},
+					  {},
+					  0,
+					  1 << 20,
+					  false};
+	for (size_t i = 0; i < 8; i++) {
+		floats.image[0x80 + i] = 0x40 + 3 * i;
+	}
+	all.push_back(floats);
+	// Rewrites the operand of its own Load at 02 every turn, so decoded and
+	// translated code keeps being invalidated.
+	all.push_back({"kernel/self-modifying",
+				   {0x21, 0x01, 0x22, 0x00, 0x52, 0x21, 0x32, 0x03, 0xB0, 0x02},
+				   {},
+				   0,
+				   1 << 20,
+				   false});
+	// Prints forever: a Store to the screen cell, which is also the loop's
+	// first byte and keeps the value it had, then the same loop at 10.
+	all.push_back({"kernel/print-loop", {0x21, 0x41, 0x31, 0x00, 0xB0, 0x00}, {}, 0, 1 << 20, false});
+	Program print = {"kernel/print-loop-10", {}, {}, 0x10, 1 << 20, false};
+	const uint8_t printLoop[] = {0x21, 0x41, 0x31, 0x00, 0xB0, 0x10};
+	std::copy(std::begin(printLoop), std::end(printLoop), print.image.begin() + 0x10);
+	all.push_back(print);
+
+	std::error_code ec;
+	std::vector<fs::path> examples;
+	for (const fs::directory_entry &entry : fs::directory_iterator(options.examples, ec)) {
+		if (entry.path().extension() == ".vole" || entry.path().extension() == ".voleb") {
+			examples.push_back(entry.path());
+		}
+	}
+	std::sort(examples.begin(), examples.end());
+	for (const fs::path &path : examples) {
+		vole::Machine loader(nullptr);
+		if (loader.LoadProgram(path.string()) != vole::error::LoadProgramError::NOT_AN_ERROR) {
+			std::cerr << "vole-bench: " << path.string() << ": not a program, skipped.\n";
+			continue;
+		}
+		vole::Machine::State start = loader.Snapshot();
+		all.push_back({"program/" + path.stem().string(), start.mem, start.reg, start.pc, 1 << 16, false});
+	}
+	return all;
+}
+
+Result runProgram(const Options &options, const Program &program, Engine engine) {
+	std::array<vole::ControlUnitBuilder, 16> builders = vole::DefaultControlUnitFactory;
+	builders[0xD] = [](vole::Machine *mac, uint8_t at) { return new Plot(mac, at); };
+	vole::NullScreen screen;
+	vole::Machine mac(&screen, vole::ControlUnitFactory(builders));
+	vole::Machine::State start = {program.image, program.reg, program.pc};
+	mac.Restore(start);
+	vole::Jit jit(mac);
+
+	Result result = measure(options, [&] {
+		uint64_t ops = 0;
+		while (ops < program.batch) {
+			vole::RunResult run = execute(engine, mac, jit, program.batch - ops);
+			ops += run.retired;
+			if (run.reason == vole::StopReason::BUDGET_EXHAUSTED) {
+				continue;
+			}
+			// From the start again.
+			if (program.readOnly) {
+				mac.reg.pc = start.pc;
+			} else {
+				mac.Restore(start);
+			}
+		}
+		return ops;
+	});
+	result.name = program.name;
+	result.engine = describe(engine);
+	result.unit = "instruction";
+	return result;
+}
+
+/// A memory image of random instruction words with every opcode.
+std::array<uint8_t, vole::Memory::SIZE> randomImage() {
+	std::array<uint8_t, vole::Memory::SIZE> image;
+	std::mt19937 random(1);
+	for (uint8_t &cell : image) {
+		cell = random();
+	}
+	return image;
+}
+
+/// `image` as a program file, one word per line.
+std::string hexText(const std::array<uint8_t, vole::Memory::SIZE> &image) {
+	std::string text;
+	char word[8];
+	for (size_t slot = 0; slot < vole::Disassembler::SLOTS; slot++) {
+		std::snprintf(word, sizeof word, "%02X%02X\n", image[2 * slot], image[2 * slot + 1]);
+		text += word;
+	}
+	return text;
+}
+
+std::vector<std::pair<std::string, std::function<Result(const Options &)>>> decodeBenchmarks() {
+	const std::array<uint8_t, vole::Memory::SIZE> image = randomImage();
+	return {
+		{"decode/instruction",
+		 [image](const Options &options) {
+			 Result result = measure(options, [&] {
+				 uint64_t sum = 0;
+				 for (size_t slot = 0; slot < vole::Disassembler::SLOTS; slot++) {
+					 vole::Instruction ins(image[2 * slot], image[2 * slot + 1]);
+					 sum += ins.opcode + ins.operand1 + ins.operandXY;
+				 }
+				 sink = sink + sum;
+				 return vole::Disassembler::SLOTS;
+			 });
+			 result.unit = "decode";
+			 return result;
+		 }},
+		{"decode/disassembler",
+		 [image](const Options &options) {
+			 vole::Disassembly out[vole::Disassembler::SLOTS];
+			 Result result = measure(options, [&] {
+				 vole::Disassembler::DecodeAll(image.data(), out);
+				 sink = sink + static_cast<uint64_t>(out[sink % vole::Disassembler::SLOTS].mnemonic);
+				 return vole::Disassembler::SLOTS;
+			 });
+			 result.unit = "decode";
+			 return result;
+		 }},
+		{"decode/control-unit",
+		 [image](const Options &options) {
+			 vole::Machine mac(nullptr);
+			 mac.mem.Write(0, image.data(), image.size());
+			 Result result = measure(options, [&] {
+				 for (size_t slot = 0; slot < vole::Disassembler::SLOTS; slot++) {
+					 std::unique_ptr<vole::ControlUnit> cu(vole::ControlUnit::Decode(&mac, 2 * slot));
+					 sink = sink + reinterpret_cast<uintptr_t>(cu.get());
+				 }
+				 return vole::Disassembler::SLOTS;
+			 });
+			 result.unit = "decode";
+			 return result;
+		 }},
+		{"humanize/control-unit",
+		 [image](const Options &options) {
+			 vole::Machine mac(nullptr);
+			 mac.mem.Write(0, image.data(), image.size());
+			 Result result = measure(options, [&] {
+				 for (size_t slot = 0; slot < vole::Disassembler::SLOTS; slot++) {
+					 std::unique_ptr<vole::ControlUnit> cu(vole::ControlUnit::Decode(&mac, 2 * slot));
+					 sink = sink + cu->Humanize().size();
+				 }
+				 return vole::Disassembler::SLOTS;
+			 });
+			 result.unit = "humanize";
+			 return result;
+		 }},
+		{"humanize/disassembler",
+		 [image](const Options &options) {
+			 vole::Disassembly out[vole::Disassembler::SLOTS];
+			 vole::Disassembler::DecodeAll(image.data(), out);
+			 Result result = measure(options, [&] {
+				 char instruction[32], note[80];
+				 for (size_t slot = 0; slot < vole::Disassembler::SLOTS; slot++) {
+					 sink = sink + vole::Disassembler::FormatInstruction(out[slot], instruction, sizeof instruction) +
+							vole::Disassembler::FormatNote(out[slot], note, sizeof note);
+				 }
+				 return vole::Disassembler::SLOTS;
+			 });
+			 result.unit = "humanize";
+			 return result;
+		 }},
+		{"load/hex",
+		 [image](const Options &options) {
+			 std::string text = hexText(image);
+			 vole::Machine mac(nullptr);
+			 Result result = measure(options, [&] {
+				 sink = sink + static_cast<uint64_t>(mac.LoadProgram(text.data(), text.size()));
+				 return 1;
+			 });
+			 result.unit = "load";
+			 return result;
+		 }},
+		{"load/stream",
+		 [image](const Options &options) {
+			 std::string text = hexText(image);
+			 vole::Machine mac(nullptr);
+			 Result result = measure(options, [&] {
+				 std::istringstream stream(text);
+				 sink = sink + static_cast<uint64_t>(mac.LoadProgram(stream));
+				 return 1;
+			 });
+			 result.unit = "load";
+			 return result;
+		 }},
+		{"load/image",
+		 [image](const Options &options) {
+			 vole::ProgramImage program;
+			 for (size_t cell = 0; cell < vole::Memory::SIZE; cell++) {
+				 program.Set(cell, image[cell]);
+			 }
+			 std::vector<uint8_t> bytes = vole::image::Encode(program);
+			 vole::Machine mac(nullptr);
+			 Result result = measure(options, [&] {
+				 sink = sink + static_cast<uint64_t>(mac.LoadImage(bytes.data(), bytes.size()));
+				 return 1;
+			 });
+			 result.unit = "load";
+			 return result;
+		 }},
+		{"dump/hex",
+		 [image](const Options &options) {
+			 vole::Machine::State state = {image, {}, 0};
+			 char buffer[vole::dump::MAX_SIZE];
+			 Result result = measure(options, [&] {
+				 sink = sink + (vole::dump::State(state, vole::dump::Format::HEX, buffer) - buffer);
+				 return 1;
+			 });
+			 result.unit = "dump";
+			 return result;
+		 }},
+		{"dump/json",
+		 [image](const Options &options) {
+			 vole::Machine::State state = {image, {}, 0};
+			 char buffer[vole::dump::MAX_SIZE];
+			 Result result = measure(options, [&] {
+				 sink = sink + (vole::dump::State(state, vole::dump::Format::JSON, buffer) - buffer);
+				 return 1;
+			 });
+			 result.unit = "dump";
+			 return result;
+		 }},
+		{"dump/memory-table",
+		 [image](const Options &options) {
+			 char buffer[vole::dump::TABLE_SIZE];
+			 Result result = measure(options, [&] {
+				 sink = sink + (vole::dump::MemoryTable(image.data(), buffer) - buffer);
+				 return 1;
+			 });
+			 result.unit = "dump";
+			 return result;
+		 }},
+	};
+}
+
+void jsonResult(std::ostream &out, const Result &result) {
+	char numbers[160];
+	std::snprintf(numbers, sizeof numbers,
+				  "\"ops\":%llu,\"seconds\":%.6f,\"ops_per_second\":%.1f,\"ns_per_op\":%.3f",
+				  static_cast<unsigned long long>(result.ops), result.seconds, result.ops / result.seconds,
+				  result.seconds * 1e9 / result.ops);
+	out << "{\"name\":\"" << result.name << "\",";
+	if (!result.engine.empty()) {
+		out << "\"engine\":\"" << result.engine << "\",";
+	}
+	out << "\"unit\":\"" << result.unit << "\"," << numbers << "}";
+}
+
+int main(int argc, char *argv[]) {
+	Options options;
+	std::string outputPath;
+	bool list = false;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		try {
+			if (arg == "--engine" && hasValue) {
+				std::string engine = argv[++i];
+				if (engine == "step") {
+					options.engines = {Engine::STEP};
+				} else if (engine == "run") {
+					options.engines = {Engine::RUN};
+				} else if (engine == "jit") {
+					options.engines = {Engine::JIT};
+				} else if (engine != "all") {
+					usage();
+					return 2;
+				}
+			} else if (arg == "--filter" && hasValue) {
+				options.filter = argv[++i];
+			} else if (arg == "--min-time" && hasValue) {
+				options.minTime = std::chrono::milliseconds(std::stoul(argv[++i]));
+			} else if (arg == "--repetitions" && hasValue) {
+				options.repetitions = std::max(1, std::stoi(argv[++i]));
+			} else if (arg == "--examples" && hasValue) {
+				options.examples = argv[++i];
+			} else if (arg == "--output" && hasValue) {
+				outputPath = argv[++i];
+			} else if (arg == "--list") {
+				list = true;
+			} else if (arg == "--help" || arg == "-h") {
+				usage();
+				return 0;
+			} else {
+				usage();
+				return 2;
+			}
+		} catch (const std::logic_error &) { // std::stoul() and friends.
+			std::cerr << "vole-bench: " << arg << ": not a number: " << argv[i] << "\n";
+			return 2;
+		}
+	}
+
+	std::ofstream file;
+	if (!outputPath.empty()) {
+		file.open(outputPath);
+		if (!file.is_open()) {
+			std::cerr << "vole-bench: " << outputPath << ": cannot open for writing.\n";
+			return 1;
+		}
+	}
+	std::ostream &out = outputPath.empty() ? std::cout : file;
+	auto selected = [&](const std::string &name) { return name.find(options.filter) != std::string::npos; };
+
+	if (list) {
+		for (const Program &program : programs(options)) {
+			if (selected(program.name)) {
+				out << program.name << "\n";
+			}
+		}
+		for (const auto &benchmark : decodeBenchmarks()) {
+			if (selected(benchmark.first)) {
+				out << benchmark.first << "\n";
+			}
+		}
+		return 0;
+	}
+
+	out << "{\"jit_supported\":" << (vole::Jit::Supported() ? "true" : "false") << ",\"min_time_ms\":"
+		<< options.minTime.count() << ",\"repetitions\":" << options.repetitions << ",\"benchmarks\":[";
+	bool first = true;
+	auto report = [&](const Result &result) {
+		out << (first ? "\n" : ",\n");
+		jsonResult(out, result);
+		out.flush();
+		first = false;
+	};
+	for (const Program &program : programs(options)) {
+		if (!selected(program.name)) {
+			continue;
+		}
+		for (Engine engine : options.engines) {
+			report(runProgram(options, program, engine));
+		}
+	}
+	for (const auto &benchmark : decodeBenchmarks()) {
+		if (selected(benchmark.first)) {
+			Result result = benchmark.second(options);
+			result.name = benchmark.first;
+			report(result);
+		}
+	}
+	out << "\n]}\n";
+	return 0;
+}
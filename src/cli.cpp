@@ -1,9 +1,20 @@
+#include <algorithm>
+#include <cctype>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <limits>
+#include <memory>
 #include <sstream>
+#include <stdexcept>
 
+#include "dump.h"
 #include "error.h"
+#include "history.h"
+#include "jit.h"
+#include "profile.h"
+#include "screen.h"
+#include "trace.h"
 #include "vole.h"
 
 #define OS_HEX1 std::hex << std::uppercase
@@ -11,12 +22,12 @@
 
 enum class base { dec, hex };
 
-class CommandLineScreen : public vole::Screen {
-	void clear() { std::cout << u8"\033[2J\033[1;1H"; }
+class CommandLineScreen : public vole::StreamScreen {
+public:
+	CommandLineScreen() : vole::StreamScreen(std::cout) {}
 
-	void write(uint8_t c) { std::cout << (char)c; }
-
-	~CommandLineScreen() = default;
+protected:
+	void Cleared() override { std::cout << u8"\033[2J\033[1;1H" << std::flush; }
 };
 
 template <typename T>
@@ -42,18 +53,42 @@ T inNumber(std::istream &in, base b = base::dec, T min = std::numeric_limits<T>:
 	return i;
 }
 
-void regShow(vole::Registers &reg) {
-	for (int i = 0; i < 16; i += 1) {
-		if (i != 0 && i % 4 == 0) {
-			std::cout << "\n";
-		}
-		std::cout << "R" << std::dec << i << (i < 10 ? ":  " : ": ") << std::hex << std::uppercase << std::setfill('0')
-				  << std::setw(2) << (int)reg[i];
-		if (i == 15)
-			std::cout << "\n";
-		else
-			std::cout << ", ";
+/// Parse a count of instructions, at least 1. std::stoull() would take `-1`
+/// as the largest count.
+/// @throw std::logic_error If it is not one.
+uint64_t parseSteps(const std::string &text) {
+	size_t start = text.find_first_not_of(" \t\n\v\f\r");
+	if (start == std::string::npos || text[start] == '-' || text[start] == '+') {
+		throw std::invalid_argument(text);
+	}
+	uint64_t steps = std::stoull(text);
+	if (steps == 0) {
+		throw std::out_of_range(text);
 	}
+	return steps;
+}
+
+/// Read the count of instructions `run` and `back` may be given into `count`,
+/// which keeps its value when there is none.
+/// @return `false`, saying why, if the count is not a positive number.
+bool inSteps(std::istream &in, uint64_t &count) {
+	std::string word;
+	if (!(in >> word)) {
+		return true;
+	}
+	try {
+		count = parseSteps(word);
+	} catch (const std::logic_error &) {
+		std::cerr << "> error: option " << word << " not a positive number.\n";
+		return false;
+	}
+	return true;
+}
+
+void regShow(const vole::Machine &mac) {
+	char table[vole::dump::TABLE_SIZE];
+	char *end = vole::dump::RegisterTable(mac.Snapshot().reg.data(), table);
+	std::cout.write(table, end - table);
 }
 
 void regGet(std::istream &in, const vole::Registers &reg) {
@@ -67,15 +102,26 @@ void regSet(std::istream &in, vole::Registers &reg) {
 	reg[i] = val;
 }
 
-void memShow(vole::Memory &mem) {
-	std::cout << "   │ 00 01 02 03 04 05 06 07 08 09 0A 0B 0C 0D 0E 0F\n"
-			  << "───┼────────────────────────────────────────────────";
-	for (int i = 0; i < 256; i += 1) {
-		if (i % 16 == 0)
-			std::cout << "\n" << OS_HEX2 << i / 16 << " │ ";
-		std::cout << OS_HEX2 << (int)mem[i] << " ";
+void memShow(const vole::Machine &mac) {
+	char table[vole::dump::TABLE_SIZE];
+	char *end = vole::dump::MemoryTable(mac.Snapshot().mem.data(), table);
+	std::cout.write(table, end - table);
+}
+
+void memDisassemble(const vole::Machine &mac) {
+	vole::Disassembly program[vole::Disassembler::SLOTS];
+	mac.DisassembleAll(program);
+	for (size_t slot = 0; slot < vole::Disassembler::SLOTS; slot++) {
+		uint8_t high = mac.mem.Read(2 * slot), low = mac.mem.Read(2 * slot + 1);
+		if (high == 0 && low == 0) {
+			continue;
+		}
+		char instruction[32], note[80];
+		vole::Disassembler::FormatInstruction(program[slot], instruction, sizeof instruction);
+		vole::Disassembler::FormatNote(program[slot], note, sizeof note);
+		std::cout << OS_HEX2 << 2 * slot << ": " << OS_HEX2 << (int)high << OS_HEX2 << (int)low << "  " << std::left
+				  << std::setfill(' ') << std::setw(18) << instruction << std::right << note << "\n";
 	}
-	std::cout << "\n";
 }
 
 void memGet(std::istream &in, const vole::Memory &mem) {
@@ -86,107 +132,607 @@ void memGet(std::istream &in, const vole::Memory &mem) {
 void memSet(std::istream &in, vole::Memory &mem) {
 	int i = inNumber(in, base::hex, 0, 0xFF);
 	int val = inNumber(in, base::hex, 0, 0xFF);
-	mem[i] = val;
+	mem.Write(i, val);
+}
+
+/// Instructions `run` executes when not given a count, so an endless loop
+/// gives the prompt back.
+const uint64_t DEFAULT_RUN_BUDGET = 100000000;
+
+void runReport(const vole::Machine &mac, const vole::RunResult &result) {
+	switch (result.reason) {
+	case vole::StopReason::HALTED:
+		return;
+	case vole::StopReason::BUDGET_EXHAUSTED:
+		std::cerr << ">> Stopped after " << std::dec << result.retired << " instructions without halting.\n";
+		return;
+	case vole::StopReason::BREAKPOINT:
+		std::cerr << ">> Stopped at a breakpoint after " << std::dec << result.retired << " instructions.\n";
+		return;
+	case vole::StopReason::UNUSED_OPCODE:
+		std::cerr << ">> Halted on an unused op-code after " << std::dec << result.retired << " instructions.\n";
+		return;
+	case vole::StopReason::LOOP_DETECTED:
+		std::cerr << ">> Stopped in an endless loop after " << std::dec << result.retired
+				  << " instructions. It is entered at " << OS_HEX2 << (int)mac.DetectedLoop().entry << " and repeats every "
+				  << std::dec << mac.DetectedLoop().period << " instructions.\n";
+		return;
+	}
+}
+
+/// Exit statuses of `vole-sim run` and `vole-sim script`: why the program
+/// stopped, or that it could not be run.
+const int STATUS_HALTED = 0;
+const int STATUS_FAILED = 1;
+const int STATUS_USAGE = 2;
+const int STATUS_BUDGET_EXHAUSTED = 3;
+const int STATUS_UNUSED_OPCODE = 4;
+const int STATUS_LOOP_DETECTED = 5;
+const int STATUS_BREAKPOINT = 6;
+
+int exitStatus(vole::StopReason reason) {
+	switch (reason) {
+	case vole::StopReason::HALTED:
+		break;
+	case vole::StopReason::BUDGET_EXHAUSTED:
+		return STATUS_BUDGET_EXHAUSTED;
+	case vole::StopReason::BREAKPOINT:
+		return STATUS_BREAKPOINT;
+	case vole::StopReason::UNUSED_OPCODE:
+		return STATUS_UNUSED_OPCODE;
+	case vole::StopReason::LOOP_DETECTED:
+		return STATUS_LOOP_DETECTED;
+	}
+	return STATUS_HALTED;
+}
+
+/// How `--dump-state` and `dump` write the machine.
+enum class StateFormat {
+	NONE,
+	/// One object: `status` and `steps` of the run if there was one, `pc`,
+	/// `registers` and `memory` as hexadecimal strings, and `screen` if the
+	/// output was captured. The same fields as vole-batch.
+	JSON,
+	/// One line, as vole-trace dumps states: `pc=08 reg=<32 digits>
+	/// mem=<512 digits>`.
+	HEX,
+	/// The PC, registers and memory as they are, 273 bytes and no newline.
+	RAW,
+};
+
+bool parseStateFormat(const std::string &name, StateFormat &format) {
+	if (name == "none") {
+		format = StateFormat::NONE;
+	} else if (name == "json") {
+		format = StateFormat::JSON;
+	} else if (name == "hex") {
+		format = StateFormat::HEX;
+	} else if (name == "raw") {
+		format = StateFormat::RAW;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/// Write the state of `mac` to standard output in `format`, with the
+/// result of the run that led to it and the screen output if given.
+void dumpState(const vole::Machine &mac, StateFormat format, const vole::RunResult *result = nullptr,
+			   const std::string *screen = nullptr) {
+	vole::Machine::State state = mac.Snapshot();
+	char buffer[vole::dump::MAX_SIZE];
+	char *end = buffer;
+	switch (format) {
+	case StateFormat::NONE:
+		return;
+	case StateFormat::RAW:
+		end = vole::dump::State(state, vole::dump::Format::RAW, buffer);
+		break;
+	case StateFormat::HEX:
+		end = vole::dump::State(state, vole::dump::Format::HEX, buffer);
+		*end++ = '\n';
+		break;
+	case StateFormat::JSON: {
+		// The status and screen go around the state, the state in the middle
+		// is formatted in place.
+		std::string line = "{";
+		if (result != nullptr) {
+			line += "\"status\":\"";
+			line += vole::dump::Describe(result->reason);
+			line += "\",\"steps\":" + std::to_string(result->retired) + ",";
+		}
+		line.append(buffer, vole::dump::JsonMembers(state, buffer));
+		if (screen != nullptr) {
+			line += ",\"screen\":";
+			vole::dump::JsonString(line, *screen);
+		}
+		line += "}\n";
+		std::cout.write(line.data(), line.size()).flush();
+		return;
+	}
+	}
+	std::cout.write(buffer, end - buffer).flush();
+}
+
+/// Load `path` into `mac`, saying why not on standard error.
+bool load(vole::Machine &mac, const std::string &path) {
+	vole::error::Location where = {};
+	vole::error::LoadProgramError err = mac.LoadProgram(path, 0, &where);
+	if (err == vole::error::LoadProgramError::NOT_AN_ERROR) {
+		return true;
+	}
+	std::cerr << "Error: " << path << ":";
+	if (err == vole::error::LoadProgramError::FILE_OPEN_FAILED) {
+		// Nothing to point at.
+	} else if (where.line != 0) {
+		std::cerr << std::dec << where.line << ":" << where.column << ":";
+	} else {
+		std::cerr << " byte " << std::dec << where.offset << ":";
+	}
+	std::cerr << " " << vole::dump::Describe(err) << ".\n";
+	return false;
+}
+
+/// What the commands work on.
+struct Session {
+	vole::Screen *scr;
+	vole::Machine mac;
+	vole::Jit jit;
+	std::unique_ptr<vole::History> history;
+	std::unique_ptr<vole::Profiler> profiler;
+	/// Exit status of the last `run`.
+	int status;
+
+	explicit Session(vole::Screen *scr) : scr(scr), mac(scr), jit(mac), status(STATUS_HALTED) {}
+
+	/// What was recorded does not lead to a machine changed by hand.
+	void Edited() {
+		if (history) {
+			history->Clear();
+		}
+	}
+};
+
+/// USAGE is a command given an argument it does not take.
+enum class Outcome { DONE, FAILED, USAGE, EXIT };
+
+/// Execute the command `cmd`, saying why on standard error if it failed.
+Outcome execute(Session &session, const std::string &cmd) {
+	vole::Machine &mac = session.mac;
+	std::unique_ptr<vole::History> &history = session.history;
+	std::unique_ptr<vole::Profiler> &profiler = session.profiler;
+	std::istringstream argstr(cmd);
+	std::string arg;
+
+	try {
+		argstr >> arg;
+		if (arg == "load") {
+			argstr >> arg;
+			bool loaded = load(mac, arg);
+			session.Edited();
+			if (!loaded) {
+				return Outcome::FAILED;
+			}
+		} else if (arg == "save") {
+			argstr >> arg;
+			if (!mac.SaveImage(arg)) {
+				std::cerr << "Error: " << arg << ": Cannot write the image.\n";
+				return Outcome::FAILED;
+			}
+		} else if (arg == "run") {
+			uint64_t budget = DEFAULT_RUN_BUDGET;
+			if (!inSteps(argstr, budget)) {
+				return Outcome::USAGE;
+			}
+			vole::RunResult result = session.jit.RunFor(budget);
+			session.status = exitStatus(result.reason);
+			runReport(mac, result);
+		} else if (arg == "step") {
+			mac.Step();
+			session.scr->Stopped();
+		} else if (arg == "back") {
+			uint64_t count = 1;
+			if (!inSteps(argstr, count)) {
+				return Outcome::USAGE;
+			}
+			if (!history) {
+				std::cerr << ">> Not recording, see history.\n";
+				return Outcome::FAILED;
+			} else if (count > history->Now() - history->Oldest()) {
+				std::cerr << ">> Only " << std::dec << history->Now() - history->Oldest()
+						  << " instructions can be undone.\n";
+				return Outcome::FAILED;
+			} else {
+				history->Seek(history->Now() - count);
+			}
+		} else if (arg == "history") {
+			argstr >> arg;
+			if (arg == "on") {
+				if (!history) {
+					history.reset(new vole::History(mac));
+				}
+			} else if (arg == "off") {
+				history.reset();
+			} else {
+				std::cerr << ">> Unknown.\n";
+				return Outcome::FAILED;
+			}
+		} else if (arg == "loops") {
+			argstr >> arg;
+			if (arg == "on") {
+				mac.DetectLoops(true);
+			} else if (arg == "off") {
+				mac.DetectLoops(false);
+			} else {
+				std::cerr << ">> Unknown.\n";
+				return Outcome::FAILED;
+			}
+		} else if (arg == "profile") {
+			argstr >> arg;
+			if (arg == "on") {
+				if (!profiler) {
+					profiler.reset(new vole::Profiler(mac));
+				}
+			} else if (arg == "off") {
+				profiler.reset();
+			} else if (!profiler) {
+				std::cerr << ">> Not profiling, see profile on.\n";
+				return Outcome::FAILED;
+			} else if (arg == "show") {
+				size_t top = 10;
+				if (!(argstr >> std::ws).eof()) {
+					top = inNumber<size_t>(argstr, base::dec, 1, std::numeric_limits<size_t>::max());
+				}
+				profiler->Report(std::cout, top);
+			} else if (arg == "folded") {
+				argstr >> arg;
+				std::ofstream out(arg);
+				profiler->WriteFolded(out);
+				if (!out) {
+					std::cerr << "Error: " << arg << ": Cannot write the profile.\n";
+					return Outcome::FAILED;
+				}
+			} else if (arg == "clear") {
+				profiler->Clear();
+			} else {
+				std::cerr << ">> Unknown.\n";
+				return Outcome::FAILED;
+			}
+		} else if (arg == "reg") {
+			argstr >> arg;
+			if (arg == "show") {
+				regShow(mac);
+			} else if (arg == "get") {
+				regGet(argstr, mac.reg);
+			} else if (arg == "set") {
+				regSet(argstr, mac.reg);
+				session.Edited();
+			} else {
+				std::cerr << ">> Unknown.\n";
+				return Outcome::FAILED;
+			}
+		} else if (arg == "mem") {
+			argstr >> arg;
+			if (arg == "show") {
+				memShow(mac);
+			} else if (arg == "dis") {
+				memDisassemble(mac);
+			} else if (arg == "get") {
+				memGet(argstr, mac.mem);
+			} else if (arg == "set") {
+				memSet(argstr, mac.mem);
+				session.Edited();
+			} else {
+				std::cerr << ">> Unknown.\n";
+				return Outcome::FAILED;
+			}
+		} else if (arg == "pc") {
+			argstr >> arg;
+			if (arg == "get") {
+				std::cout << "PC: " << OS_HEX2 << (int)mac.reg.pc << "\n";
+			} else if (arg == "set") {
+				int newPC = inNumber(argstr, base::hex, 0, 0xFF);
+				mac.reg.pc = newPC;
+				session.Edited();
+			} else {
+				std::cerr << ">> Unknown.\n";
+				return Outcome::FAILED;
+			}
+		} else if (arg == "dump") {
+			StateFormat format;
+			argstr >> arg;
+			if (!parseStateFormat(arg, format)) {
+				std::cerr << ">> Unknown format, see json, hex or raw.\n";
+				return Outcome::FAILED;
+			}
+			std::cout << std::flush;
+			dumpState(mac, format);
+		} else if (arg == "reset") {
+			argstr >> arg;
+			if (arg == "cpu") {
+				mac.reg.Reset();
+			} else if (arg == "ram") {
+				mac.mem.Reset();
+			} else {
+				std::cerr << ">> Unknown.\n";
+				return Outcome::FAILED;
+			}
+			session.Edited();
+		} else if (arg == "exit") {
+			return Outcome::EXIT;
+		} else if (arg != "") {
+			std::cerr << ">> Unknown.\n";
+			return Outcome::FAILED;
+		}
+	} catch (const std::logic_error &) {
+		return Outcome::FAILED;
+	}
+	return Outcome::DONE;
+}
+
+void usage(const char *name) {
+	std::cerr << "usage: " << name << " [--trace FILE]\n"
+			  << "       " << name << " run PROGRAM [--max-steps N] [--regs LIST] [--dump-state FORMAT]\n"
+			  << "                    [--detect-loops] [--trace FILE]\n"
+			  << "       " << name << " script FILE [--trace FILE]\n"
+			  << "Without a mode, read commands from the terminal (type them to see the list).\n"
+			  << "\n"
+			  << "  run               load PROGRAM, run it until it halts and exit\n"
+			  << "  script            execute the commands in FILE (- for standard input) without\n"
+			  << "                    prompting and exit at the first that fails; `#` starts a\n"
+			  << "                    comment line. Records no history unless `history on`\n"
+			  << "  --max-steps N     stop after N instructions (default " << DEFAULT_RUN_BUDGET << ")\n"
+			  << "  --regs LIST       registers to start with, e.g. R1=05,R2=0A,PC=10\n"
+			  << "  --dump-state F    write the final state to standard output as json (one\n"
+			  << "                    object, with the screen output), hex (one line after the\n"
+			  << "                    screen output) or raw (PC, registers and memory as 273\n"
+			  << "                    bytes after the screen output); none by default\n"
+			  << "  --detect-loops    stop as soon as the machine repeats a state\n"
+			  << "  --trace FILE      record every executed instruction to FILE (see vole-trace)\n"
+			  << "\n"
+			  << "Exit status: 0 halted, 1 failed (a program or command), 2 usage, 3 out of steps,\n"
+			  << "4 unused op-code, 5 endless loop, 6 breakpoint. A script exits with the status of\n"
+			  << "its last run.\n";
+}
+
+/// Parse a `--regs` list, `R<r>=<value>` or `PC=<value>` in hexadecimal,
+/// separated by commas or spaces, into `mac`.
+bool setRegisters(vole::Machine &mac, const std::string &list) {
+	std::string assignments = list;
+	std::replace(assignments.begin(), assignments.end(), ',', ' ');
+	std::istringstream words(assignments);
+	std::string word;
+	while (words >> word) {
+		size_t eq = word.find('=');
+		std::string target = word.substr(0, eq);
+		std::string value = eq == std::string::npos ? "" : word.substr(eq + 1);
+		std::transform(target.begin(), target.end(), target.begin(), ::toupper);
+		bool isRegister = target.size() == 2 && target[0] == 'R' && std::isxdigit(static_cast<unsigned char>(target[1]));
+		if ((!isRegister && target != "PC") || value.empty() || value.size() > 2 ||
+			value.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+			std::cerr << "vole-sim: --regs: bad register `" << word << "`.\n";
+			return false;
+		}
+		uint8_t byte = std::stoul(value, nullptr, 16);
+		if (isRegister) {
+			mac.reg.Write(std::stoul(target.substr(1), nullptr, 16), byte);
+		} else {
+			mac.reg.pc = byte;
+		}
+	}
+	return true;
+}
+
+/// Open a trace of `mac` to `path`, or say why not.
+bool startTrace(const std::string &path, vole::Machine &mac, const std::string &name,
+				std::unique_ptr<vole::TraceFile> &file, std::unique_ptr<vole::Tracer> &tracer) {
+	file.reset(new vole::TraceFile(path));
+	if (!file->IsOpen()) {
+		std::cerr << "Error: " << path << ": Cannot write the trace.\n";
+		return false;
+	}
+	tracer.reset(new vole::Tracer(mac, *file, name));
+	return true;
+}
+
+int runMode(const char *name, int argc, char *argv[]) {
+	std::string programPath, regs, tracePath;
+	uint64_t maxSteps = DEFAULT_RUN_BUDGET;
+	StateFormat format = StateFormat::NONE;
+	bool detectLoops = false;
+	for (int i = 0; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		try {
+			if (arg == "--max-steps" && hasValue) {
+				maxSteps = parseSteps(argv[++i]);
+			} else if (arg == "--regs" && hasValue) {
+				regs += std::string(argv[++i]) + " ";
+			} else if (arg == "--dump-state" && hasValue) {
+				if (!parseStateFormat(argv[++i], format)) {
+					usage(name);
+					return STATUS_USAGE;
+				}
+			} else if (arg == "--detect-loops") {
+				detectLoops = true;
+			} else if (arg == "--trace" && hasValue) {
+				tracePath = argv[++i];
+			} else if (arg.size() > 1 && arg[0] == '-') {
+				usage(name);
+				return STATUS_USAGE;
+			} else if (programPath.empty()) {
+				programPath = arg;
+			} else {
+				usage(name);
+				return STATUS_USAGE;
+			}
+		} catch (const std::logic_error &) { // parseSteps().
+			std::cerr << "vole-sim: " << arg << ": not a positive number: " << argv[i] << "\n";
+			return STATUS_USAGE;
+		}
+	}
+	if (programPath.empty()) {
+		usage(name);
+		return STATUS_USAGE;
+	}
+
+	// Captured, so it can go in the JSON object or before the hex line.
+	vole::MemoryScreen screen;
+	vole::Machine mac(&screen);
+	if (!load(mac, programPath) || !setRegisters(mac, regs)) {
+		return STATUS_FAILED;
+	}
+	mac.DetectLoops(detectLoops);
+	std::unique_ptr<vole::TraceFile> traceFile;
+	std::unique_ptr<vole::Tracer> tracer;
+	if (!tracePath.empty() && !startTrace(tracePath, mac, programPath, traceFile, tracer)) {
+		return STATUS_FAILED;
+	}
+	vole::Jit jit(mac);
+	vole::RunResult result = jit.RunFor(maxSteps);
+	tracer.reset();
+
+	const std::string &text = screen.Text();
+	if (format != StateFormat::JSON) {
+		std::cout << text;
+		if (format == StateFormat::HEX && !text.empty() && text.back() != '\n') {
+			std::cout << "\n";
+		}
+	}
+	dumpState(mac, format, &result, &text);
+	return exitStatus(result.reason);
+}
+
+int scriptMode(const char *name, int argc, char *argv[]) {
+	std::string scriptPath, tracePath;
+	for (int i = 0; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--trace" && i + 1 < argc) {
+			tracePath = argv[++i];
+		} else if (scriptPath.empty() && (arg == "-" || arg[0] != '-')) {
+			scriptPath = arg;
+		} else {
+			usage(name);
+			return STATUS_USAGE;
+		}
+	}
+	if (scriptPath.empty()) {
+		usage(name);
+		return STATUS_USAGE;
+	}
+	std::ifstream file;
+	if (scriptPath != "-") {
+		file.open(scriptPath);
+		if (!file.is_open()) {
+			std::cerr << "vole-sim: " << scriptPath << ": cannot open script.\n";
+			return STATUS_FAILED;
+		}
+	}
+	std::istream &in = scriptPath == "-" ? std::cin : file;
+
+	vole::StreamScreen screen(std::cout);
+	Session session(&screen);
+	std::unique_ptr<vole::TraceFile> traceFile;
+	std::unique_ptr<vole::Tracer> tracer;
+	if (!tracePath.empty() && !startTrace(tracePath, session.mac, scriptPath, traceFile, tracer)) {
+		return STATUS_FAILED;
+	}
+	std::string cmd;
+	for (size_t number = 1; std::getline(in, cmd); number++) {
+		size_t first = cmd.find_first_not_of(" \t\r");
+		if (first == std::string::npos || cmd[first] == '#') {
+			continue;
+		}
+		Outcome outcome = execute(session, cmd);
+		if (outcome == Outcome::FAILED || outcome == Outcome::USAGE) {
+			std::cerr << "vole-sim: " << scriptPath << ":" << number << ": `" << cmd.substr(first) << "` failed.\n";
+			return outcome == Outcome::USAGE ? STATUS_USAGE : STATUS_FAILED;
+		}
+		if (outcome == Outcome::EXIT) {
+			break;
+		}
+	}
+	return session.status;
 }
 
 #define CYAN u8"\033[36m"
 #define RESET u8"\033[0m"
 
-int main() {
+int main(int argc, char *argv[]) {
+	std::string mode = argc > 1 ? argv[1] : "";
+	if (mode == "run") {
+		return runMode(argv[0], argc - 2, argv + 2);
+	} else if (mode == "script") {
+		return scriptMode(argv[0], argc - 2, argv + 2);
+	}
+
+	std::string tracePath;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--trace" && i + 1 < argc) {
+			tracePath = argv[++i];
+		} else {
+			usage(argv[0]);
+			return arg == "--help" || arg == "-h" ? 0 : STATUS_USAGE;
+		}
+	}
+
 	std::cout << ">> Welcome to the Vole Machine Simulator & GUI\n"
 			  << ">>\n"
 			  << ">> Commands\n"
 			  << ">> ========\n"
 			  << ">>\n"
-			  << ">> - " CYAN "load" RESET " FILE: Load program from FILE and put it in memory.\n"
-			  << ">> - " CYAN "run" RESET ": Run indefinitely.\n"
+			  << ">> - " CYAN "load" RESET " FILE: Load program from FILE (hexadecimal or .voleb image) and put it in memory.\n"
+			  << ">> - " CYAN "save" RESET " FILE: Save memory, registers and the program counter to FILE as a .voleb image.\n"
+			  << ">> - " CYAN "run" RESET " [N]: Run until halted, or for at most N instructions (default 100000000).\n"
 			  << ">> - " CYAN "step" RESET ": Only execute the next instruction.\n"
+			  << ">> - " CYAN "back" RESET " [N]: Undo the last N executed instructions (default 1).\n"
+			  << ">> - " CYAN "history" RESET " on|off: Record executed instructions so they can be undone (on by default).\n"
+			  << ">> - " CYAN "loops" RESET " on|off: Stop runs caught in an endless loop.\n"
+			  << ">> - " CYAN "profile" RESET " on|off: Count executed instructions per PC, opcode and jump.\n"
+			  << ">> - " CYAN "profile" RESET " show [N]: Report opcodes, the N hottest blocks (default 10), loops and jumps.\n"
+			  << ">> - " CYAN "profile" RESET " folded FILE: Write the blocks to FILE as folded stacks for flame graphs.\n"
+			  << ">> - " CYAN "profile" RESET " clear: Forget the counts.\n"
 			  << ">> - " CYAN "reg" RESET " show: Show all registers and their values.\n"
 			  << ">> - " CYAN "reg" RESET " get X: Get the value stored at register X.\n"
 			  << ">> - " CYAN "reg" RESET " set X Y: Set register X to the value Y.\n"
 			  << ">> - " CYAN "mem" RESET " show: Show all memory cells and their values.\n"
+			  << ">> - " CYAN "mem" RESET " dis: Disassemble the instructions in memory.\n"
 			  << ">> - " CYAN "mem" RESET " get X: Get the value stored at memory cell X.\n"
 			  << ">> - " CYAN "mem" RESET " set X Y: Set memory cell X to the value Y.\n"
 			  << ">> - " CYAN "pc" RESET " get: Get the value of the program counter.\n"
 			  << ">> - " CYAN "pc" RESET " set X: Set the program counter to the value X.\n"
+			  << ">> - " CYAN "dump" RESET " json|hex|raw: Write the program counter, registers and memory at once.\n"
 			  << ">> - " CYAN "reset" RESET " cpu: Reset all registers to zero.\n"
 			  << ">> - " CYAN "reset" RESET " ram: Reset all memory cells to zero.\n"
 			  << ">> - " CYAN "exit" RESET ": Exit the machine simulator.\n";
 
 	vole::Screen *scr = new CommandLineScreen;
-	vole::Machine mac(scr);
+	std::unique_ptr<Session> session(new Session(scr));
+	// Runs take the interpreter's slower path while recording.
+	session->history.reset(new vole::History(session->mac));
+	std::unique_ptr<vole::TraceFile> traceFile;
+	std::unique_ptr<vole::Tracer> tracer;
+	if (!tracePath.empty() && !startTrace(tracePath, session->mac, "vole-sim", traceFile, tracer)) {
+		return STATUS_FAILED;
+	}
 
-	do {
+	for (;;) {
 		std::cerr << "> ";
-		std::string cmd, arg;
+		std::string cmd;
 		std::getline(std::cin, cmd);
 		if (std::cin.eof()) {
 			std::cerr << "End of input.\n";
 			break;
 		}
-		std::istringstream argstr(cmd);
-
-		try {
-			argstr >> arg;
-			if (arg == "load") {
-				argstr >> arg;
-				vole::error::LoadProgramError err = mac.LoadProgram(arg);
-				if (err != vole::error::LoadProgramError::NOT_AN_ERROR) {
-					std::cerr << "Error: " << arg << ": Loading program failed.\n";
-					continue;
-				}
-			} else if (arg == "run") {
-				mac.Run();
-			} else if (arg == "step") {
-				mac.Step();
-			} else if (arg == "reg") {
-				argstr >> arg;
-				if (arg == "show") {
-					regShow(mac.reg);
-				} else if (arg == "get") {
-					regGet(argstr, mac.reg);
-				} else if (arg == "set") {
-					regSet(argstr, mac.reg);
-				} else {
-					std::cerr << ">> Unknown.\n";
-				}
-			} else if (arg == "mem") {
-				argstr >> arg;
-				if (arg == "show") {
-					memShow(mac.mem);
-				} else if (arg == "get") {
-					memGet(argstr, mac.mem);
-				} else if (arg == "set") {
-					memSet(argstr, mac.mem);
-				} else {
-					std::cerr << ">> Unknown.\n";
-				}
-			} else if (arg == "pc") {
-				argstr >> arg;
-				if (arg == "get") {
-					std::cout << "PC: " << OS_HEX2 << (int)mac.reg.pc << "\n";
-				} else if (arg == "set") {
-					int newPC = inNumber(argstr, base::hex, 0, 0xFF);
-					mac.reg.pc = newPC;
-				}
-			} else if (arg == "reset") {
-				argstr >> arg;
-				if (arg == "cpu") {
-					mac.reg.Reset();
-				} else if (arg == "ram") {
-					mac.mem.Reset();
-				}
-			} else if (arg == "exit") {
-				break;
-			} else if (arg != "") {
-				std::cerr << ">> Unknown.\n";
-			}
-		} catch (const std::logic_error &) {
-			continue;
+		if (execute(*session, cmd) == Outcome::EXIT) {
+			break;
 		}
-	} while (1);
+	}
 
 	std::cerr << ">> I think therefore I am!\n";
 	std::cerr << ">> Moriturus te saluto.!\n";
+	tracer.reset();
+	session.reset();
 	delete scr;
 }
@@ -0,0 +1,174 @@
+#include <cstring>
+
+#include "dump.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define VOLE_HEX_SSE2
+#endif
+
+using namespace vole;
+
+namespace {
+const char DIGITS[] = "0123456789ABCDEF";
+/// JSON escapes are written in lowercase.
+const char JSON_DIGITS[] = "0123456789abcdef";
+
+char *copy(const char *text, char *out) {
+	size_t size = std::strlen(text);
+	std::memcpy(out, text, size);
+	return out + size;
+}
+
+#ifdef VOLE_HEX_SSE2
+/// Digits of 16 bytes: split into nibbles, high one first, then turn each
+/// into '0' + n, and 7 more past 9 to land on 'A'.
+char *hex16(const uint8_t *bytes, char *out) {
+	const __m128i nibble = _mm_set1_epi8(0x0F);
+	__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes));
+	__m128i high = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+	__m128i low = _mm_and_si128(v, nibble);
+	__m128i halves[2] = {_mm_unpacklo_epi8(high, low), _mm_unpackhi_epi8(high, low)};
+	for (__m128i n : halves) {
+		__m128i letters = _mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8(7));
+		__m128i digits = _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), letters);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(out), digits);
+		out += 16;
+	}
+	return out;
+}
+#endif
+} // namespace
+
+char *dump::Hex(const uint8_t *bytes, size_t count, char *out) {
+	size_t i = 0;
+#ifdef VOLE_HEX_SSE2
+	for (; i + 16 <= count; i += 16) {
+		out = hex16(bytes + i, out);
+	}
+#endif
+	for (; i < count; i++) {
+		*out++ = DIGITS[bytes[i] >> 4];
+		*out++ = DIGITS[bytes[i] & 0xF];
+	}
+	return out;
+}
+
+char *dump::JsonMembers(const Machine::State &state, char *out) {
+	out = copy("\"pc\":\"", out);
+	out = Hex(&state.pc, 1, out);
+	out = copy("\",\"registers\":\"", out);
+	out = Hex(state.reg.data(), state.reg.size(), out);
+	out = copy("\",\"memory\":\"", out);
+	out = Hex(state.mem.data(), state.mem.size(), out);
+	*out++ = '"';
+	return out;
+}
+
+char *dump::State(const Machine::State &state, Format format, char *out) {
+	switch (format) {
+	case Format::RAW:
+		*out++ = state.pc;
+		std::memcpy(out, state.reg.data(), state.reg.size());
+		out += state.reg.size();
+		std::memcpy(out, state.mem.data(), state.mem.size());
+		return out + state.mem.size();
+	case Format::JSON:
+		*out++ = '{';
+		out = JsonMembers(state, out);
+		*out++ = '}';
+		return out;
+	case Format::HEX:
+		out = copy("pc=", out);
+		out = Hex(&state.pc, 1, out);
+		out = copy(" reg=", out);
+		out = Hex(state.reg.data(), state.reg.size(), out);
+		out = copy(" mem=", out);
+		return Hex(state.mem.data(), state.mem.size(), out);
+	}
+	return out;
+}
+
+char *dump::RegisterTable(const uint8_t *reg, char *out) {
+	for (int r = 0; r < 16; r++) {
+		*out++ = 'R';
+		if (r >= 10) {
+			*out++ = '1';
+		}
+		*out++ = '0' + r % 10;
+		out = copy(r < 10 ? ":  " : ": ", out);
+		out = Hex(&reg[r], 1, out);
+		out = copy(r == 15 ? "\n" : r % 4 == 3 ? ", \n" : ", ", out);
+	}
+	return out;
+}
+
+const char *dump::Describe(StopReason reason) {
+	switch (reason) {
+	case StopReason::HALTED:
+		return "halted";
+	case StopReason::BUDGET_EXHAUSTED:
+		return "budget_exhausted";
+	case StopReason::BREAKPOINT:
+		return "breakpoint";
+	case StopReason::UNUSED_OPCODE:
+		return "unused_opcode";
+	case StopReason::LOOP_DETECTED:
+		return "loop_detected";
+	}
+	return "";
+}
+
+const char *dump::Describe(error::LoadProgramError err) {
+	switch (err) {
+	case error::LoadProgramError::NOT_AN_ERROR:
+		break;
+	case error::LoadProgramError::FILE_OPEN_FAILED:
+		return "cannot open program";
+	case error::LoadProgramError::STREAM_READ_FAILED:
+		return "not a program";
+	case error::LoadProgramError::TOO_MUCH_INSTRUCTIONS:
+		return "program does not fit in memory";
+	case error::LoadProgramError::BAD_IMAGE:
+		return "bad program image";
+	}
+	return "";
+}
+
+void dump::JsonString(std::string &out, const std::string &text) {
+	out += '"';
+	for (unsigned char c : text) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (c < 0x20 || c >= 0x7F) {
+			out += "\\u00";
+			out += JSON_DIGITS[c >> 4];
+			out += JSON_DIGITS[c & 0xF];
+		} else {
+			out += c;
+		}
+	}
+	out += '"';
+}
+
+char *dump::MemoryTable(const uint8_t *mem, char *out) {
+	out = copy("   │ 00 01 02 03 04 05 06 07 08 09 0A 0B 0C 0D 0E 0F\n"
+			   "───┼────────────────────────────────────────────────",
+			   out);
+	for (int row = 0; row < 16; row++) {
+		char digits[32];
+		Hex(mem + 16 * row, 16, digits);
+		*out++ = '\n';
+		*out++ = '0';
+		*out++ = DIGITS[row];
+		out = copy(" │ ", out);
+		for (int cell = 0; cell < 16; cell++) {
+			*out++ = digits[2 * cell];
+			*out++ = digits[2 * cell + 1];
+			*out++ = ' ';
+		}
+	}
+	*out++ = '\n';
+	return out;
+}
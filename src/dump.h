@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "vole.h"
+
+namespace vole {
+/// Machine states written out for tools and people. Everything is formatted
+/// into a buffer the caller gives, sized by the constants below, so a state
+/// goes out with a single write however it is laid out.
+namespace dump {
+enum class Format {
+	/// The PC, the 16 registers and the 256 cells as they are, RAW_SIZE
+	/// bytes.
+	RAW,
+	/// `{"pc":"08","registers":"<32 digits>","memory":"<512 digits>"}`
+	JSON,
+	/// `pc=08 reg=<32 digits> mem=<512 digits>`, as vole-trace prints states.
+	HEX,
+};
+
+const size_t RAW_SIZE = 1 + 16 + Memory::SIZE;
+/// Room State() needs in any format.
+const size_t MAX_SIZE = 640;
+/// Room RegisterTable() and MemoryTable() need.
+const size_t TABLE_SIZE = 1280;
+
+/// @brief Write `count` bytes as uppercase hexadecimal digits, two per byte,
+/// to `out`.
+/// @return Past the last digit.
+char *Hex(const uint8_t *bytes, size_t count, char *out);
+/// @brief Write `state` in `format` to `out`, no newline after.
+/// @return Past the last byte written.
+char *State(const Machine::State &state, Format format, char *out);
+/// @brief Write the JSON members of `state`, `"pc":..,"registers":..,
+/// "memory":..` without braces, for objects that say more.
+char *JsonMembers(const Machine::State &state, char *out);
+/// @brief Write the registers four to a line, `R0:  00, R1:  18, ...`.
+char *RegisterTable(const uint8_t *reg, char *out);
+/// @brief Write memory as a table of 16 rows of 16 cells under a header of
+/// column numbers.
+char *MemoryTable(const uint8_t *mem, char *out);
+
+/// @brief `reason` as the `status` of a run in JSON, e.g. `budget_exhausted`.
+const char *Describe(StopReason reason);
+/// @brief Why a program did not load, e.g. `not a program`.
+const char *Describe(error::LoadProgramError err);
+/// @brief Append `text` to `out` as a JSON string. Bytes outside printable
+/// ASCII are escaped, so the output stays valid UTF-8 whatever a program
+/// prints.
+void JsonString(std::string &out, const std::string &text);
+} // namespace dump
+} // namespace vole
@@ -0,0 +1,229 @@
+#include <algorithm>
+
+#include "engine.h"
+
+using namespace vole;
+
+constexpr std::chrono::milliseconds Engine::TIME_SLICE;
+constexpr std::chrono::milliseconds Engine::MEASURE_PERIOD;
+constexpr std::chrono::milliseconds Engine::IDLE_WAIT;
+constexpr std::chrono::milliseconds Engine::MAX_BACKLOG;
+
+Engine::Engine(Machine &mac)
+	: m_Machine(mac), m_History(mac), m_Profiler(mac), m_Running(false), m_Speed(DEFAULT_SPEED), m_Retired(0),
+	  m_Owed(0), m_LastTick(Clock::now()), m_MeasureStart(m_LastTick), m_MeasureRetired(0), m_Ips(0) {
+	for (size_t cell = 0; cell < Memory::SIZE; cell++) {
+		m_State.mem[cell] = mac.mem.Read(cell);
+		m_State.generation[cell] = mac.mem.CellGeneration(cell);
+	}
+	for (uint8_t r = 0; r < 16; r++) {
+		m_State.reg[r] = mac.reg.Read(r);
+	}
+	m_State.changed = {};
+	m_State.changedRegisters = 0;
+	mac.mem.ClearDirty();
+	mac.reg.ClearDirty();
+	Publish();
+#if VOLE_ENGINE_THREADED
+	m_Quit = false;
+	m_Thread = std::thread([this] {
+		while (!m_Quit.load(std::memory_order_acquire)) {
+			std::this_thread::sleep_for(Tick());
+		}
+	});
+#endif
+}
+
+Engine::~Engine() {
+#if VOLE_ENGINE_THREADED
+	m_Quit.store(true, std::memory_order_release);
+	m_Thread.join();
+#endif
+}
+
+void Engine::Read(EngineState &state) const { m_Published.Load(state); }
+
+bool Engine::SetCell(uint8_t at, uint8_t value) { return Send({Command::Type::SET_CELL, at, value, 0}); }
+
+bool Engine::SetRegister(uint8_t r, uint8_t value) { return Send({Command::Type::SET_REGISTER, r, value, 0}); }
+
+bool Engine::SetPC(uint8_t value) { return Send({Command::Type::SET_PC, 0, value, 0}); }
+
+bool Engine::ResetMemory() { return Send({Command::Type::RESET_MEMORY, 0, 0, 0}); }
+
+bool Engine::ResetRegisters() { return Send({Command::Type::RESET_REGISTERS, 0, 0, 0}); }
+
+bool Engine::Run() { return Send({Command::Type::RUN, 0, 0, 0}); }
+
+bool Engine::Pause() { return Send({Command::Type::PAUSE, 0, 0, 0}); }
+
+bool Engine::Step() { return Send({Command::Type::STEP, 0, 0, 0}); }
+
+bool Engine::StepBack() { return Send({Command::Type::STEP_BACK, 0, 0, 0}); }
+
+bool Engine::ClearProfile() { return Send({Command::Type::CLEAR_PROFILE, 0, 0, 0}); }
+
+bool Engine::SetSpeed(uint32_t ips) { return Send({Command::Type::SET_SPEED, 0, 0, ips}); }
+
+void Engine::Pump() {
+#if !VOLE_ENGINE_THREADED
+	Tick();
+#endif
+}
+
+bool Engine::Send(const Command &command) { return m_Commands.Push(command); }
+
+void Engine::Apply(const Command &command) {
+	switch (command.type) {
+	case Command::Type::SET_CELL:
+		m_Machine.mem.Write(command.at, command.value);
+		m_History.Clear();
+		break;
+	case Command::Type::SET_REGISTER:
+		m_Machine.reg.Write(command.at & 0xF, command.value);
+		m_History.Clear();
+		break;
+	case Command::Type::SET_PC:
+		m_Machine.reg.pc = command.value;
+		m_History.Clear();
+		break;
+	case Command::Type::RESET_MEMORY:
+		m_Machine.mem.Reset();
+		m_History.Clear();
+		break;
+	case Command::Type::RESET_REGISTERS:
+		m_Machine.reg.Reset();
+		m_History.Clear();
+		break;
+	case Command::Type::RUN:
+		if (!m_Running) {
+			// The first instruction of a run is due at once.
+			m_Running = true;
+			m_Owed = 1;
+			m_LastTick = Clock::now();
+		}
+		break;
+	case Command::Type::PAUSE:
+		m_Running = false;
+		break;
+	case Command::Type::STEP:
+		if (!m_Running) {
+			m_Machine.Step();
+			m_Retired++;
+		}
+		break;
+	case Command::Type::STEP_BACK:
+		if (!m_Running) {
+			m_History.StepBack();
+		}
+		break;
+	case Command::Type::CLEAR_PROFILE:
+		m_Profiler.Clear();
+		break;
+	case Command::Type::SET_SPEED:
+		m_Speed = command.speed;
+		m_Owed = std::min(m_Owed, 1.0);
+		break;
+	}
+}
+
+Engine::Clock::duration Engine::Tick() {
+	bool changed = false;
+	Command command;
+	while (m_Commands.Pop(command)) {
+		Apply(command);
+		changed = true;
+	}
+
+	Clock::time_point now = Clock::now();
+	Clock::duration wait = IDLE_WAIT;
+	if (m_Running) {
+		RunSlice(now, now + TIME_SLICE);
+		changed = true;
+		if (m_Speed == UNLIMITED) {
+			wait = Clock::duration::zero();
+		} else if (m_Owed < 1) {
+			// Until the next instruction is owed.
+			std::chrono::duration<double> next((1 - m_Owed) / m_Speed);
+			wait = std::min(std::chrono::duration_cast<Clock::duration>(next), wait);
+		} else {
+			wait = Clock::duration::zero();
+		}
+	}
+	if (Measure(Clock::now()) || changed) {
+		Publish();
+	}
+	return wait;
+}
+
+void Engine::RunSlice(Clock::time_point now, Clock::time_point deadline) {
+	if (m_Speed != UNLIMITED) {
+		std::chrono::duration<double> passed = now - m_LastTick;
+		double backlog = std::chrono::duration<double>(MAX_BACKLOG).count() * m_Speed;
+		m_Owed = std::min(m_Owed + passed.count() * m_Speed, std::max(backlog, 1.0));
+	}
+	m_LastTick = now;
+
+	while (m_Running) {
+		uint64_t chunk = m_Speed == UNLIMITED ? CHUNK : std::min<uint64_t>(m_Owed, CHUNK);
+		if (chunk == 0) {
+			break;
+		}
+		RunResult result = m_Machine.RunFor(chunk);
+		m_Retired += result.retired;
+		if (m_Speed != UNLIMITED) {
+			m_Owed -= result.retired;
+		}
+		if (result.reason != StopReason::BUDGET_EXHAUSTED) {
+			m_Running = false;
+		} else if (Clock::now() >= deadline) {
+			break;
+		}
+	}
+}
+
+bool Engine::Measure(Clock::time_point now) {
+	std::chrono::duration<double> passed = now - m_MeasureStart;
+	if (passed < MEASURE_PERIOD) {
+		return false;
+	}
+	m_Ips = (m_Retired - m_MeasureRetired) / passed.count();
+	m_MeasureStart = now;
+	m_MeasureRetired = m_Retired;
+	return true;
+}
+
+void Engine::Publish() {
+	// Only cells and registers written since the last publication are copied.
+	const CellMask &dirty = m_Machine.mem.Dirty();
+	uint16_t dirtyRegisters = m_Machine.reg.Dirty();
+	bool wrote = dirtyRegisters != 0;
+	for (size_t word = 0; word < dirty.size(); word++) {
+		for (uint64_t bits = dirty[word]; bits != 0; bits &= bits - 1) {
+			uint8_t cell = word * 64 + CountTrailingZeros(bits);
+			m_State.mem[cell] = m_Machine.mem.Read(cell);
+			m_State.generation[cell] = m_Machine.mem.CellGeneration(cell);
+		}
+		wrote = wrote || dirty[word] != 0;
+	}
+	for (uint16_t bits = dirtyRegisters; bits != 0; bits &= bits - 1) {
+		uint8_t r = CountTrailingZeros(bits);
+		m_State.reg[r] = m_Machine.reg.Read(r);
+	}
+	if (wrote) {
+		m_State.changed = dirty;
+		m_State.changedRegisters = dirtyRegisters;
+	}
+	m_Machine.mem.ClearDirty();
+	m_Machine.reg.ClearDirty();
+
+	m_State.pc = m_Machine.reg.pc;
+	m_State.running = m_Running;
+	m_State.retired = m_Retired;
+	m_State.undoable = m_History.Now() - m_History.Oldest();
+	for (size_t pc = 0; pc < Memory::SIZE; pc++) {
+		m_State.executions[pc] = m_Profiler.Executions(pc);
+	}
+	m_State.ips = m_Ips;
+	m_Published.Store(m_State);
+}
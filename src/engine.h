@@ -0,0 +1,254 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+
+#include "history.h"
+#include "profile.h"
+#include "vole.h"
+
+// Browsers without shared memory build without threads: Engine then runs on
+// the caller's thread from Pump().
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define VOLE_ENGINE_THREADED 1
+#else
+#define VOLE_ENGINE_THREADED 0
+#endif
+
+namespace vole {
+/// @brief Bounded lock-free queue between exactly one producer thread and
+/// one consumer thread.
+template <typename T, size_t CAPACITY> class SpscQueue {
+	static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+
+public:
+	/// @brief Producer only. `false` when the queue is full.
+	bool Push(const T &item) {
+		size_t tail = m_Tail.load(std::memory_order_relaxed);
+		if (tail - m_Head.load(std::memory_order_acquire) == CAPACITY) {
+			return false;
+		}
+		m_Items[tail & (CAPACITY - 1)] = item;
+		m_Tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// @brief Consumer only. `false` when the queue is empty.
+	bool Pop(T &item) {
+		size_t head = m_Head.load(std::memory_order_relaxed);
+		if (head == m_Tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		item = m_Items[head & (CAPACITY - 1)];
+		m_Head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::array<T, CAPACITY> m_Items;
+	/// Counts of items popped and pushed, on their own cache lines.
+	alignas(64) std::atomic<size_t> m_Head{0};
+	alignas(64) std::atomic<size_t> m_Tail{0};
+};
+
+/// @brief A value one thread publishes and others read without locks. A
+/// reader copies it and retries if a write happened meanwhile, so reads never
+/// block the writer. The value is kept in atomic words, which keeps the
+/// racing copies well defined.
+template <typename T> class SeqLock {
+	static_assert(std::is_trivially_copyable<T>::value, "T is copied word by word");
+
+public:
+	/// @brief Writer only.
+	void Store(const T &value) {
+		uint64_t words[WORDS] = {};
+		std::memcpy(words, &value, sizeof value);
+		uint64_t sequence = m_Sequence.load(std::memory_order_relaxed);
+		// Release stores keep the odd sequence ahead of the words, acquire
+		// loads the words ahead of the second look at the sequence.
+		m_Sequence.store(sequence + 1, std::memory_order_relaxed);
+		for (size_t i = 0; i < WORDS; i++) {
+			m_Words[i].store(words[i], std::memory_order_release);
+		}
+		m_Sequence.store(sequence + 2, std::memory_order_release);
+	}
+
+	void Load(T &value) const {
+		uint64_t words[WORDS];
+		uint64_t before, after;
+		do {
+			before = m_Sequence.load(std::memory_order_acquire);
+			for (size_t i = 0; i < WORDS; i++) {
+				words[i] = m_Words[i].load(std::memory_order_acquire);
+			}
+			after = m_Sequence.load(std::memory_order_relaxed);
+		} while ((before & 1) != 0 || before != after);
+		std::memcpy(&value, words, sizeof value);
+	}
+
+private:
+	static const size_t WORDS = (sizeof(T) + 7) / 8;
+
+	/// Odd while a Store() is under way.
+	std::atomic<uint64_t> m_Sequence{0};
+	std::array<std::atomic<uint64_t>, WORDS> m_Words{};
+};
+
+/// @brief The machine as an Engine last published it.
+struct EngineState {
+	std::array<uint8_t, Memory::SIZE> mem;
+	/// `Memory::CellGeneration()` of every cell, so a view can tell which
+	/// cells changed since it last looked.
+	std::array<uint64_t, Memory::SIZE> generation;
+	std::array<uint8_t, 16> reg;
+	/// Cells and registers written by the latest command, step or slice of
+	/// running that wrote any.
+	CellMask changed;
+	uint16_t changedRegisters;
+	uint8_t pc;
+	/// Whether the engine is running the machine until it halts.
+	bool running;
+	/// Instructions executed since the engine started.
+	uint64_t retired;
+	/// Instructions `Engine::StepBack()` can still undo.
+	uint64_t undoable;
+	/// Times the instruction at each PC was executed, see Profiler.
+	std::array<uint64_t, Memory::SIZE> executions;
+	/// Instructions per second actually executed, measured over the last
+	/// `Engine::MEASURE_PERIOD`.
+	double ips;
+};
+
+/// @brief Runs a machine on a thread of its own, so a user interface only
+/// reads published states and sends commands, and never waits for it.
+///
+/// Running is paced by a time accumulator: every tick adds the time passed
+/// times the target speed to the instructions owed, and as many are executed
+/// as owed, in chunks, for at most `TIME_SLICE` before commands are looked at
+/// and a state is published again.
+///
+/// Every instruction executed is recorded in a History, so it can be undone,
+/// and counted by a Profiler.
+///
+/// The machine must not be used by anything else while the engine exists,
+/// and its dirty masks are cleared whenever a state is published.
+/// Custom control units run on the engine's thread.
+class Engine {
+public:
+	/// Instructions per second when running, until SetSpeed().
+	static const uint32_t DEFAULT_SPEED = 5;
+	/// Speed to run as fast as the machine can (turbo).
+	static const uint32_t UNLIMITED = 0;
+	/// Longest a tick executes instructions, which keeps a single threaded
+	/// frame and the answer to commands quick.
+	static constexpr std::chrono::milliseconds TIME_SLICE{4};
+	/// How long EngineState::ips is averaged over.
+	static constexpr std::chrono::milliseconds MEASURE_PERIOD{250};
+
+	explicit Engine(Machine &);
+	Engine(const Engine &) = delete;
+	Engine &operator=(const Engine &) = delete;
+	/// Stops the thread. The machine is left as the engine last had it.
+	~Engine();
+
+	/// @brief The last published state.
+	void Read(EngineState &) const;
+
+	// Commands, carried out in order by the engine. They return `false` and
+	// are dropped when too many are waiting.
+	bool SetCell(uint8_t at, uint8_t value);
+	bool SetRegister(uint8_t r, uint8_t value);
+	bool SetPC(uint8_t value);
+	bool ResetMemory();
+	bool ResetRegisters();
+	/// @brief Run at the current speed until the machine halts or Pause().
+	bool Run();
+	bool Pause();
+	/// @brief Execute one instruction, unless running.
+	bool Step();
+	/// @brief Undo the last instruction executed, unless running. Editing the
+	/// machine forgets the instructions before.
+	bool StepBack();
+	/// @brief Forget the Profiler's counts.
+	bool ClearProfile();
+	/// @param ips Instructions per second, or `UNLIMITED`.
+	bool SetSpeed(uint32_t ips);
+
+	/// @brief Do the engine's work that is due. Needed once a frame without
+	/// threads (`VOLE_ENGINE_THREADED` is 0), does nothing otherwise.
+	void Pump();
+
+private:
+	typedef std::chrono::steady_clock Clock;
+
+	struct Command {
+		enum class Type {
+			SET_CELL,
+			SET_REGISTER,
+			SET_PC,
+			RESET_MEMORY,
+			RESET_REGISTERS,
+			RUN,
+			PAUSE,
+			STEP,
+			STEP_BACK,
+			CLEAR_PROFILE,
+			SET_SPEED,
+		} type;
+		uint8_t at;
+		uint8_t value;
+		uint32_t speed;
+	};
+
+	/// Longest the thread sleeps before looking for commands again.
+	static constexpr std::chrono::milliseconds IDLE_WAIT{1};
+	/// Most instructions run between two looks at the clock.
+	static const uint64_t CHUNK = 1 << 16;
+	/// Most time owed instructions are kept for, so a stalled engine catches
+	/// up with a short burst instead of a long one.
+	static constexpr std::chrono::milliseconds MAX_BACKLOG{100};
+
+	Machine &m_Machine;
+	History m_History;
+	Profiler m_Profiler;
+	SpscQueue<Command, 256> m_Commands;
+	SeqLock<EngineState> m_Published;
+	/// What was last published, updated from the machine's dirty masks.
+	EngineState m_State;
+
+	// Owned by the engine's thread.
+	bool m_Running;
+	uint32_t m_Speed;
+	uint64_t m_Retired;
+	/// Instructions owed at `m_Speed`, as of `m_LastTick`.
+	double m_Owed;
+	Clock::time_point m_LastTick;
+	/// Start of the current measurement of EngineState::ips.
+	Clock::time_point m_MeasureStart;
+	uint64_t m_MeasureRetired;
+	double m_Ips;
+
+#if VOLE_ENGINE_THREADED
+	std::atomic<bool> m_Quit;
+	std::thread m_Thread;
+#endif
+
+	bool Send(const Command &);
+	void Apply(const Command &);
+	/// Carry out waiting commands and execute the instructions due.
+	/// @return How long nothing is due.
+	Clock::duration Tick();
+	/// Execute owed instructions (all there is time for when UNLIMITED) until
+	/// `deadline`.
+	void RunSlice(Clock::time_point now, Clock::time_point deadline);
+	/// Update m_Ips once a measurement period is over; `true` if it was.
+	bool Measure(Clock::time_point now);
+	void Publish();
+};
+} // namespace vole
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+
 namespace vole {
 namespace error {
 enum class LoadProgramError {
@@ -7,6 +9,17 @@ enum class LoadProgramError {
 	FILE_OPEN_FAILED,
 	STREAM_READ_FAILED,
 	TOO_MUCH_INSTRUCTIONS,
+	/// A `.voleb` image with a bad header, or contents that do not match its
+	/// hash.
+	BAD_IMAGE,
+};
+
+/// @brief Where loading a program failed: the byte offset into the file and,
+/// for text, the line and column there (both from 1, 0 for binary images).
+struct Location {
+	size_t offset;
+	size_t line;
+	size_t column;
 };
-}
+} // namespace error
 } // namespace vole
@@ -4,6 +4,7 @@
 #include <cstdint>
 
 namespace vole::example {
+/// The GUI's drawing, built in for the web build. Also examples/draw.vole.
 inline const std::array<uint8_t, 256> DRAW = {
 	0xD0, 0xCC, 0xD0, 0xCE, 0xD0, 0xCC, 0xD0, 0xD0, 0xD0, 0xD2, 0xD0, 0xD4, 0xD0, 0xD6, 0xD0, 0xD8, 0xD0, 0xD8, 0xD0,
 	0xDA, 0xD0, 0xDC, 0xD0, 0xDE, 0xD0, 0xDE, 0xD0, 0xE0, 0xD0, 0xE0, 0xD0, 0xE2, 0xD0, 0xE2, 0xD0, 0xE4, 0xD0, 0xE6,
@@ -9,13 +9,17 @@
 #else
 #include <SDL2/SDL_opengl.h>
 #endif
+#include <algorithm>
 #include <bitset>
+#include <cmath>
+#include <mutex>
 #include <sstream>
 
 #ifdef __EMSCRIPTEN__
 #include "emscripten_mainloop_stub.h"
 #endif
 
+#include "engine.h"
 #include "font_source_code_pro.h"
 #include "vole.h"
 
@@ -23,10 +27,16 @@
 
 static ImVector<ImVec2> canvasPoints;
 
+// Points drawn on the engine's thread, not yet moved to canvasPoints.
+static std::mutex drawnLock;
+static ImVector<ImVec2> drawnPoints;
+
 class CanvasDraw : public vole::ControlUnit::ControlUnit {
 	using vole::ControlUnit::ControlUnit;
 	vole::ShouldHalt Execute() override {
-		canvasPoints.push_back({static_cast<float>(mac->mem[operandXY]), static_cast<float>(mac->mem[operandXY + 1])});
+		std::lock_guard<std::mutex> guard(drawnLock);
+		drawnPoints.push_back(
+			{static_cast<float>(mac->mem.Read(operandXY)), static_cast<float>(mac->mem.Read(operandXY + 1))});
 		return vole::ShouldHalt::NO;
 	};
 	std::string Humanize() override {
@@ -37,35 +47,51 @@ class CanvasDraw : public vole::ControlUnit::ControlUnit {
 	~CanvasDraw() = default;
 };
 
-void ShowControlWindow(vole::Machine &mac, ImGuiIO &io) {
-	static int speed = 5;
-	static bool isRunning = false;
-	static unsigned int currentTime, lastTime = 0;
-
-	currentTime = SDL_GetTicks();
-
-	if (isRunning && (currentTime > lastTime + 1000 / speed)) {
-		if (mac.Step() == vole::ShouldHalt::YES) {
-			isRunning = false;
-		};
-		lastTime = currentTime;
-	}
+void ShowControlWindow(vole::Engine &engine, const vole::EngineState &state, ImGuiIO &io) {
+	// Beyond this, turbo.
+	const int MAX_SPEED = 10000000;
+	static int speed = vole::Engine::DEFAULT_SPEED;
+	static bool turbo = false;
 
 	if (ImGui::Begin("Control", NULL,
 					 ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoCollapse)) {
-		ImGui::InputScalar("Program Counter", ImGuiDataType_U8, &mac.reg.pc, NULL, NULL, "%02X",
-						   ImGuiInputTextFlags_CharsHexadecimal | ImGuiInputTextFlags_CharsUppercase);
+		uint8_t pc = state.pc;
+		if (ImGui::InputScalar("Program Counter", ImGuiDataType_U8, &pc, NULL, NULL, "%02X",
+							   ImGuiInputTextFlags_CharsHexadecimal | ImGuiInputTextFlags_CharsUppercase)) {
+			engine.SetPC(pc);
+		}
 		ImGui::SeparatorText("Execution");
-		if (ImGui::Button("Run until HALT", {io.DisplaySize.x * 1.f / 6.f - 20, 100})) {
-			isRunning = true;
+		if (state.running) {
+			if (ImGui::Button("Pause", {io.DisplaySize.x * 1.f / 6.f - 20, 100})) {
+				engine.Pause();
+			}
+		} else if (ImGui::Button("Run until HALT", {io.DisplaySize.x * 1.f / 6.f - 20, 100})) {
+			engine.Run();
 		}
 		ImGui::SameLine();
 		if (ImGui::Button("Run one instruction", {io.DisplaySize.x * 1.f / 6.f - 20, 100})) {
-			mac.Step();
+			engine.Step();
+		}
+		ImGui::BeginDisabled(state.running || state.undoable == 0);
+		if (ImGui::Button("Undo one instruction", {io.DisplaySize.x * 1.f / 6.f - 20, 0})) {
+			engine.StepBack();
+		}
+		ImGui::EndDisabled();
+		ImGui::SameLine();
+		if (ImGui::Button("Clear heat", {io.DisplaySize.x * 1.f / 6.f - 20, 0})) {
+			engine.ClearProfile();
 		}
 		ImGui::SeparatorText("Speed");
 		ImGui::Text("Specify number of instructions per second (IPS):");
-		ImGui::VSliderInt("IPS", {50.f, 240}, &speed, 1, 100, "%d", ImGuiSliderFlags_ClampOnInput);
+		bool changed = ImGui::Checkbox("Turbo (unlimited)", &turbo);
+		ImGui::BeginDisabled(turbo);
+		changed |= ImGui::VSliderInt("IPS", {50.f, 240}, &speed, 1, MAX_SPEED, "%d",
+									 ImGuiSliderFlags_ClampOnInput | ImGuiSliderFlags_Logarithmic);
+		ImGui::EndDisabled();
+		if (changed) {
+			engine.SetSpeed(turbo ? vole::Engine::UNLIMITED : speed);
+		}
+		ImGui::Text("Measured: %.0f IPS", state.ips);
 		ImGui::End();
 	}
 }
@@ -73,6 +99,14 @@ void ShowControlWindow(vole::Machine &mac, ImGuiIO &io) {
 void ShowCanvasWindow() {
 	static ImVec2 scrolling(0.0f, 0.0f);
 
+	{
+		std::lock_guard<std::mutex> guard(drawnLock);
+		for (int n = 0; n < drawnPoints.Size; n++) {
+			canvasPoints.push_back(drawnPoints[n]);
+		}
+		drawnPoints.clear();
+	}
+
 	ImVec2 canvas_p0 = ImGui::GetCursorScreenPos();
 	ImVec2 canvas_sz = ImGui::GetContentRegionAvail();
 
@@ -122,33 +156,121 @@ void ShowCanvasWindow() {
 	draw_list->PopClipRect();
 }
 
-void ShowInstructionEditor(vole::Machine &mac) {
-	if (ImGui::BeginTable("##Instruction", 4, ImGuiTableFlags_RowBg)) {
+// Rows of the tables below are formatted when the generation of their cells
+// changes, and only the visible ones are drawn.
+static const uint64_t NEVER_FORMATTED = UINT64_MAX;
+/// Background of cells and registers the machine just wrote.
+static const ImU32 CHANGED_COLOR = IM_COL32(114, 92, 39, 255);
+
+static bool Changed(const vole::EngineState &state, uint8_t cell) {
+	return (state.changed[cell / 64] >> (cell % 64)) & 1;
+}
+
+/// Background of an instruction executed `count` times when the most executed
+/// one ran `most` times: the more, the redder, on a log scale so loops nested
+/// in loops still show apart.
+static ImU32 HeatColor(uint64_t count, uint64_t most) {
+	float heat = std::log1p(static_cast<float>(count)) / std::log1p(static_cast<float>(most));
+	return IM_COL32(200, 60, 40, 40 + static_cast<int>(heat * 180));
+}
+
+/// Write `count` in at most 5 characters, such as `65.5K`.
+static void FormatCount(char *buffer, size_t size, uint64_t count) {
+	static const char UNITS[] = " KMGTPE";
+	double value = count;
+	int unit = 0;
+	while (value >= 999.5 && UNITS[unit + 1] != '\0') {
+		value /= 1000;
+		unit++;
+	}
+	if (unit == 0) {
+		snprintf(buffer, size, "%llu", static_cast<unsigned long long>(count));
+	} else {
+		snprintf(buffer, size, value < 9.95 ? "%.1f%c" : "%.0f%c", value, UNITS[unit]);
+	}
+}
+
+struct InstructionRow {
+	uint64_t generation = NEVER_FORMATTED;
+	char note[80];
+};
+
+struct MemoryRow {
+	uint64_t generation = NEVER_FORMATTED;
+	char hex[3], bin[9], number[16];
+};
+
+/// @param view Machine the instructions are decoded in.
+void ShowInstructionEditor(vole::Engine &engine, const vole::EngineState &state, vole::Machine &view) {
+	static std::array<InstructionRow, (vole::Memory::SIZE >> 1)> rows;
+
+	// A row counts what ran from either of its cells, so code at odd PCs
+	// shows too.
+	uint64_t most = 0;
+	for (size_t cell = 0; cell < vole::Memory::SIZE; cell += 2) {
+		most = std::max(most, state.executions[cell] + state.executions[cell + 1]);
+	}
+
+	if (ImGui::BeginTable("##Instruction", 5, ImGuiTableFlags_RowBg)) {
 		ImGui::TableSetupColumn("Low Byte", ImGuiTableColumnFlags_WidthFixed);
 		ImGui::TableSetupColumn("Instruction", ImGuiTableColumnFlags_WidthFixed);
 		ImGui::TableSetupColumn("High Byte", ImGuiTableColumnFlags_WidthFixed);
+		ImGui::TableSetupColumn("Heat", ImGuiTableColumnFlags_WidthFixed);
 		ImGui::TableSetupColumn("Note", ImGuiTableColumnFlags_WidthStretch);
 
-		for (size_t row = 0; row < (vole::Memory::SIZE >> 1); row++) {
-			ImGui::TableNextRow();
-			ImGui::TableSetColumnIndex(0);
-			ImGui::TextDisabled("%02zX", 2 * row);
-			ImGui::TableSetColumnIndex(1);
-			ImGui::PushID(row);
-			ImGui::PushItemWidth(60);
-			ImGui::InputScalarN("##", ImGuiDataType_U8, &mac.mem[2 * row], 2, NULL, NULL, "%02X",
-								ImGuiInputTextFlags_CharsHexadecimal | ImGuiInputTextFlags_AutoSelectAll);
-			ImGui::PopItemWidth();
-			ImGui::PopID();
-			ImGui::TableSetColumnIndex(2);
-			ImGui::TextDisabled("%02zX", 2 * row + 1);
-			ImGui::TableSetColumnIndex(3);
-			vole::ControlUnit *cu = vole::ControlUnit::Decode(&mac, 2 * row);
-			ImGui::TextUnformatted(cu->Humanize().c_str());
-			delete cu;
-			if (row == mac.reg.pc >> 1) {
-				ImGui::TableSetBgColor(ImGuiTableBgTarget_RowBg0, IM_COL32(39, 73, 114, 255));
-				ImGui::TableSetBgColor(ImGuiTableBgTarget_RowBg1, IM_COL32(39, 73, 114, 255));
+		ImGuiListClipper clipper;
+		clipper.Begin(vole::Memory::SIZE >> 1);
+		while (clipper.Step()) {
+			for (int row = clipper.DisplayStart; row < clipper.DisplayEnd; row++) {
+				InstructionRow &cached = rows[row];
+				uint64_t generation = std::max(state.generation[2 * row], state.generation[2 * row + 1]);
+				if (cached.generation != generation) {
+					view.mem.Write(2 * row, state.mem[2 * row]);
+					view.mem.Write(2 * row + 1, state.mem[2 * row + 1]);
+					vole::Disassembly dis = view.Disassemble(row);
+					if (dis.mnemonic == vole::Mnemonic::CUSTOM) {
+						vole::ControlUnit *cu = vole::ControlUnit::Decode(&view, 2 * row);
+						snprintf(cached.note, sizeof cached.note, "%s", cu->Humanize().c_str());
+						delete cu;
+					} else {
+						vole::Disassembler::FormatNote(dis, cached.note, sizeof cached.note);
+					}
+					cached.generation = generation;
+				}
+
+				ImGui::TableNextRow();
+				ImGui::TableSetColumnIndex(0);
+				ImGui::TextDisabled("%02X", 2 * row);
+				ImGui::TableSetColumnIndex(1);
+				ImGui::PushID(row);
+				ImGui::PushItemWidth(60);
+				uint8_t word[2] = {state.mem[2 * row], state.mem[2 * row + 1]};
+				if (ImGui::InputScalarN("##", ImGuiDataType_U8, word, 2, NULL, NULL, "%02X",
+										ImGuiInputTextFlags_CharsHexadecimal | ImGuiInputTextFlags_AutoSelectAll)) {
+					engine.SetCell(2 * row, word[0]);
+					engine.SetCell(2 * row + 1, word[1]);
+				}
+				ImGui::PopItemWidth();
+				ImGui::PopID();
+				if (Changed(state, 2 * row) || Changed(state, 2 * row + 1)) {
+					ImGui::TableSetBgColor(ImGuiTableBgTarget_CellBg, CHANGED_COLOR);
+				}
+				ImGui::TableSetColumnIndex(2);
+				ImGui::TextDisabled("%02X", 2 * row + 1);
+				ImGui::TableSetColumnIndex(3);
+				uint64_t executions = state.executions[2 * row] + state.executions[2 * row + 1];
+				if (executions != 0) {
+					char count[8];
+					FormatCount(count, sizeof count, executions);
+					ImGui::Text("%5s", count);
+					ImGui::TableSetBgColor(ImGuiTableBgTarget_CellBg, HeatColor(executions, most));
+				}
+				ImGui::TableSetColumnIndex(4);
+				ImGui::TextUnformatted(cached.note);
+				if (row == state.pc >> 1) {
+					ImGui::TableSetBgColor(ImGuiTableBgTarget_RowBg0, IM_COL32(39, 73, 114, 255));
+					ImGui::TableSetBgColor(ImGuiTableBgTarget_RowBg1, IM_COL32(39, 73, 114, 255));
+				}
 			}
 		}
 
@@ -156,7 +278,9 @@ void ShowInstructionEditor(vole::Machine &mac) {
 	}
 }
 
-void ShowMainMemory(vole::Machine &mac, ImGuiIO &io) {
+void ShowMainMemory(vole::Engine &engine, const vole::EngineState &state, ImGuiIO &io) {
+	static std::array<MemoryRow, vole::Memory::SIZE> rows;
+
 	ImGui::BeginChild("Memory Table", {0, io.DisplaySize.y * 1.f / 2.f - 100}, ImGuiChildFlags_None,
 					  ImGuiWindowFlags_HorizontalScrollbar);
 	if (ImGui::BeginTable("##Memory", 4,
@@ -167,21 +291,39 @@ void ShowMainMemory(vole::Machine &mac, ImGuiIO &io) {
 		ImGui::TableSetupColumn("Float");
 		ImGui::TableHeadersRow();
 
-		for (size_t row = 0; row < vole::Memory::SIZE; row++) {
-			ImGui::TableNextRow();
-
-			ImGui::TableSetColumnIndex(0);
-			ImGui::Text("%02zX", row);
-
-			ImGui::TableSetColumnIndex(1);
-			ImGui::Text("%02X", mac.mem[row]);
-
-			ImGui::TableSetColumnIndex(2);
-			std::bitset<8> bin(mac.mem[row]);
-			ImGui::TextUnformatted(bin.to_string().c_str());
-
-			ImGui::TableSetColumnIndex(3);
-			ImGui::Text("%08f", vole::Float::Decode(mac.mem[row]));
+		ImGuiListClipper clipper;
+		clipper.Begin(vole::Memory::SIZE);
+		while (clipper.Step()) {
+			for (int row = clipper.DisplayStart; row < clipper.DisplayEnd; row++) {
+				MemoryRow &cached = rows[row];
+				if (cached.generation != state.generation[row]) {
+					uint8_t value = state.mem[row];
+					snprintf(cached.hex, sizeof cached.hex, "%02X", value);
+					for (int bit = 0; bit < 8; bit++) {
+						cached.bin[bit] = (value & (0x80 >> bit)) ? '1' : '0';
+					}
+					cached.bin[8] = '\0';
+					snprintf(cached.number, sizeof cached.number, "%08f", vole::Float::Decode(value));
+					cached.generation = state.generation[row];
+				}
+
+				ImGui::TableNextRow();
+
+				ImGui::TableSetColumnIndex(0);
+				ImGui::Text("%02X", row);
+
+				ImGui::TableSetColumnIndex(1);
+				ImGui::TextUnformatted(cached.hex);
+				if (Changed(state, row)) {
+					ImGui::TableSetBgColor(ImGuiTableBgTarget_CellBg, CHANGED_COLOR);
+				}
+
+				ImGui::TableSetColumnIndex(2);
+				ImGui::TextUnformatted(cached.bin);
+
+				ImGui::TableSetColumnIndex(3);
+				ImGui::TextUnformatted(cached.number);
+			}
 		}
 		ImGui::EndTable();
 	}
@@ -193,7 +335,7 @@ void ShowMainMemory(vole::Machine &mac, ImGuiIO &io) {
 		ImGui::Text("Are you sure you want to reset all memory cells?");
 		ImGui::Separator();
 		if (ImGui::Button("OK", ImVec2(120, 0))) {
-			mac.mem.Reset();
+			engine.ResetMemory();
 			ImGui::CloseCurrentPopup();
 		}
 		ImGui::SetItemDefaultFocus();
@@ -205,7 +347,7 @@ void ShowMainMemory(vole::Machine &mac, ImGuiIO &io) {
 	}
 }
 
-void ShowRegisters(vole::Machine &mac, ImGuiIO &io) {
+void ShowRegisters(vole::Engine &engine, const vole::EngineState &state, ImGuiIO &io) {
 	ImGui::BeginChild("Registers Table", ImVec2(0, io.DisplaySize.y * 1.f / 2.f - 100), ImGuiChildFlags_None,
 					  ImGuiWindowFlags_None);
 	if (ImGui::BeginTable("##Registers", 4,
@@ -223,20 +365,23 @@ void ShowRegisters(vole::Machine &mac, ImGuiIO &io) {
 			ImGui::Text("%01zX", row);
 
 			ImGui::TableSetColumnIndex(1);
-			ImGui::Text("%02X", mac.reg[row]);
+			ImGui::Text("%02X", state.reg[row]);
+			if ((state.changedRegisters >> row) & 1) {
+				ImGui::TableSetBgColor(ImGuiTableBgTarget_CellBg, CHANGED_COLOR);
+			}
 
 			ImGui::TableSetColumnIndex(2);
-			std::bitset<8> bin(mac.reg[row]);
+			std::bitset<8> bin(state.reg[row]);
 			ImGui::TextUnformatted(bin.to_string().c_str());
 
 			ImGui::TableSetColumnIndex(3);
-			ImGui::Text("%08f", vole::Float::Decode(mac.reg[row]));
+			ImGui::Text("%08f", vole::Float::Decode(state.reg[row]));
 		}
 		ImGui::EndTable();
 	}
 	ImGui::EndChild();
 	if (ImGui::Button("Clear Registers")) {
-		mac.reg.Reset();
+		engine.ResetRegisters();
 	}
 }
 
@@ -348,7 +493,12 @@ int main(int, char **) {
 	ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
 	vole::Screen* scr = new GraphicalSreen;
 	vole::Machine mac = vole::Machine(nullptr, ExtendedControlUnitFactory);
-	*mac.mem.Array() = vole::example::DRAW;
+	mac.mem.Write(0, vole::example::DRAW.data(), vole::example::DRAW.size());
+	// The machine belongs to the engine's thread from here on; the windows
+	// show the states it publishes and edit through its commands.
+	vole::Engine engine(mac);
+	vole::EngineState state;
+	vole::Machine view = vole::Machine(nullptr, ExtendedControlUnitFactory);
 	const ImGuiWindowFlags windowFlags =
 		ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoCollapse;
 
@@ -374,6 +524,9 @@ int main(int, char **) {
 			continue;
 		}
 
+		engine.Pump();
+		engine.Read(state);
+
 		// Start the Dear ImGui frame
 		ImGui_ImplOpenGL3_NewFrame();
 		ImGui_ImplSDL2_NewFrame();
@@ -382,7 +535,7 @@ int main(int, char **) {
 		ImGui::SetNextWindowSize({io.DisplaySize.x * 1.f / 3.f, io.DisplaySize.y * 1.f / 2.f});
 		ImGui::SetNextWindowPos({io.DisplaySize.x * 1.f / 3.f, 0});
 		if (ImGui::Begin("Control", NULL, windowFlags)) {
-			ShowControlWindow(mac, io);
+			ShowControlWindow(engine, state, io);
 			ImGui::End();
 		}
 
@@ -396,21 +549,21 @@ int main(int, char **) {
 		ImGui::SetNextWindowSize({io.DisplaySize.x * 1.f / 3.f, io.DisplaySize.y});
 		ImGui::SetNextWindowPos({0, 0});
 		if (ImGui::Begin("Instruction Editor", NULL, windowFlags)) {
-			ShowInstructionEditor(mac);
+			ShowInstructionEditor(engine, state, view);
 			ImGui::End();
 		}
 
 		ImGui::SetNextWindowSize({io.DisplaySize.x * 1.f / 3.f, io.DisplaySize.y * 1.f / 2.f});
 		ImGui::SetNextWindowPos({io.DisplaySize.x * 2.f / 3.f, io.DisplaySize.y * 1.f / 2.f});
 		if (ImGui::Begin("Main Memory", NULL, windowFlags)) {
-			ShowMainMemory(mac, io);
+			ShowMainMemory(engine, state, io);
 			ImGui::End();
 		}
 
 		ImGui::SetNextWindowSize({io.DisplaySize.x * 1.f / 3.f, io.DisplaySize.y * 1.f / 2.f});
 		ImGui::SetNextWindowPos({io.DisplaySize.x * 2.f / 3.f, 0});
 		if (ImGui::Begin("Registers", NULL, windowFlags)) {
-			ShowRegisters(mac, io);
+			ShowRegisters(engine, state, io);
 			ImGui::End();
 		}
 
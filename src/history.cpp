@@ -0,0 +1,119 @@
+#include <algorithm>
+
+#include "history.h"
+#include "screen.h"
+
+using namespace vole;
+
+History::History(Machine &mac, size_t capacity) : m_Machine(mac) {
+	size_t size = 1;
+	while (size < capacity) {
+		size *= 2;
+	}
+	m_Records.resize(size);
+	Clear();
+	m_Machine.m_History = this;
+}
+
+History::~History() { m_Machine.m_History = nullptr; }
+
+void History::Clear() {
+	m_Oldest = m_Now = 0;
+	m_Checkpoints.clear();
+	m_Checkpoints.push_back({0, m_Machine.Snapshot()});
+}
+
+uint64_t History::Now() const { return m_Now; }
+
+uint64_t History::Oldest() const { return m_Oldest; }
+
+uint64_t History::StepBack(uint64_t count) {
+	count = std::min(count, m_Now - m_Oldest);
+	for (uint64_t i = 0; i < count; i++) {
+		Undo();
+	}
+	Truncate();
+	return count;
+}
+
+void History::Seek(uint64_t to) {
+	to = std::max(to, m_Oldest);
+	if (to >= m_Now) {
+		return;
+	}
+	auto after = std::upper_bound(m_Checkpoints.begin(), m_Checkpoints.end(), to,
+								  [](uint64_t at, const Checkpoint &c) { return at < c.at; });
+	const Checkpoint &from = *(after - 1);
+	if (m_Now - to <= to - from.at) {
+		StepBack(m_Now - to);
+		return;
+	}
+
+	// Replay from the checkpoint, recording again, without output.
+	m_Machine.Restore(from.state);
+	m_Now = from.at;
+	Truncate();
+	NullScreen screen;
+	Screen *scr = m_Machine.scr;
+	m_Machine.scr = &screen;
+	// Nor is it traced or counted twice: the tracer records the state it ends
+	// in.
+	Tracer *tracer = m_Machine.m_Tracer;
+	Profiler *profiler = m_Machine.m_Profiler;
+	m_Machine.m_Tracer = nullptr;
+	m_Machine.m_Profiler = nullptr;
+	while (m_Now < to) {
+		m_Machine.Step();
+	}
+	m_Machine.scr = scr;
+	m_Machine.m_Tracer = tracer;
+	m_Machine.m_Profiler = profiler;
+}
+
+void History::Push(const UndoRecord &record) {
+	const Checkpoint &last = m_Checkpoints.back();
+	if (last.at != m_Now && (record.kind == UndoRecord::Kind::STATE || m_Now - last.at >= CHECKPOINT_INTERVAL)) {
+		m_Checkpoints.push_back({m_Now, m_Machine.Snapshot()});
+		// The instruction was fetched already.
+		m_Checkpoints.back().state.pc = record.pc;
+	}
+	if (m_Now - m_Oldest == m_Records.size()) {
+		m_Oldest++;
+		while (m_Checkpoints.size() > 1 && m_Checkpoints[1].at <= m_Oldest) {
+			m_Checkpoints.pop_front();
+		}
+	}
+	m_Records[m_Now & (m_Records.size() - 1)] = record;
+	m_Now++;
+}
+
+void History::Undo() {
+	m_Now--;
+	const UndoRecord &record = m_Records[m_Now & (m_Records.size() - 1)];
+	switch (record.kind) {
+	case UndoRecord::Kind::PC:
+		break;
+	case UndoRecord::Kind::REGISTER:
+		m_Machine.reg.Write(record.at, record.old);
+		break;
+	case UndoRecord::Kind::CELL:
+		m_Machine.mem.Write(record.at, record.old);
+		break;
+	case UndoRecord::Kind::STATE:
+		// Taken by Push() right before the instruction.
+		for (auto c = m_Checkpoints.rbegin(); c != m_Checkpoints.rend(); ++c) {
+			if (c->at == m_Now) {
+				m_Machine.Restore(c->state);
+				break;
+			}
+		}
+		break;
+	}
+	m_Machine.reg.pc = record.pc;
+}
+
+void History::Truncate() {
+	while (m_Checkpoints.back().at > m_Now) {
+		m_Checkpoints.pop_back();
+	}
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "vole.h"
+
+namespace vole {
+/// @brief What an executed instruction overwrote, enough to undo it.
+struct UndoRecord {
+	enum class Kind : uint8_t {
+		/// Only the PC changed.
+		PC,
+		/// Register `at` was `old`.
+		REGISTER,
+		/// Memory cell `at` was `old`.
+		CELL,
+		/// A custom control unit, which could have written anything: the
+		/// whole state before it is kept as a checkpoint.
+		STATE,
+	};
+
+	Kind kind;
+	/// The PC before the instruction.
+	uint8_t pc;
+	uint8_t at;
+	uint8_t old;
+};
+
+/// @brief Records the instructions a machine executes, so they can be undone
+/// again: reverse stepping and going back to any earlier instruction.
+///
+/// Every instruction the machine executes (`Machine::Step()` or
+/// `Machine::RunFor()`, which then takes its per-instruction path) adds an
+/// UndoRecord to a ring buffer; once it is full the oldest are dropped.
+/// Every `CHECKPOINT_INTERVAL` instructions a full Snapshot() is kept too, so
+/// Seek() never undoes or replays more than that many instructions.
+///
+/// Positions count the instructions executed since the history was started or
+/// last cleared. Changing the machine other than through its instructions
+/// (editing cells, registers or the PC, loading) must be followed by Clear().
+/// The screen is not rewound, and replaying from a checkpoint runs custom
+/// control units again.
+class History {
+public:
+	static const size_t DEFAULT_CAPACITY = 1 << 20;
+	static const uint64_t CHECKPOINT_INTERVAL = 4096;
+
+	/// @brief Start recording `mac`, from its current state at position 0.
+	/// A machine records to at most one history at a time.
+	/// @param capacity Most instructions kept, rounded up to a power of two.
+	explicit History(Machine &mac, size_t capacity = DEFAULT_CAPACITY);
+	History(const History &) = delete;
+	History &operator=(const History &) = delete;
+	/// Stops recording.
+	~History();
+
+	/// @brief Forget everything; the machine's current state is position 0.
+	void Clear();
+
+	/// @brief Position of the machine.
+	uint64_t Now() const;
+	/// @brief Earliest position still recorded.
+	uint64_t Oldest() const;
+
+	/// @brief Undo the last `count` instructions, or as many as are recorded.
+	/// @return How many were undone.
+	uint64_t StepBack(uint64_t count = 1);
+	/// @brief Go back to position `to`, or Oldest() if that is later. The
+	/// instructions after it are forgotten. Does nothing if `to >= Now()`.
+	void Seek(uint64_t to);
+
+private:
+	friend class Machine;
+
+	struct Checkpoint {
+		uint64_t at;
+		Machine::State state;
+	};
+
+	Machine &m_Machine;
+	std::vector<UndoRecord> m_Records;
+	uint64_t m_Oldest, m_Now;
+	/// Oldest first. The first one is at or before `m_Oldest`, so every
+	/// recorded position can be replayed from one.
+	std::deque<Checkpoint> m_Checkpoints;
+
+	/// Called by the machine before it executes an instruction.
+	void Push(const UndoRecord &);
+	void Undo();
+	/// Forget the checkpoints after `m_Now`.
+	void Truncate();
+};
+} // namespace vole
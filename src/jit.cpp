@@ -0,0 +1,559 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+
+#include "jit.h"
+#include "vole.h"
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#include <sys/mman.h>
+#define VOLE_JIT 1
+#endif
+
+using namespace vole;
+
+#ifdef VOLE_JIT
+
+namespace {
+enum HostReg : uint8_t { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/// Host registers holding machine registers 0 to A. The rest stay in
+/// `Context::reg`; RAX is scratch, RBP the budget, RSI the memory and RDI the
+/// context.
+const HostReg HOST[] = {RBX, RCX, RDX, R8, R9, R10, R11, R12, R13, R14, R15};
+const size_t HOST_COUNT = sizeof(HOST) / sizeof(HOST[0]);
+const HostReg CALLEE_SAVED[] = {RBX, RBP, R12, R13, R14, R15};
+
+/// Why native code returned to Run(). Packed with the machine's PC in the
+/// returned code: bits [7:0] PC, [15:8] reason, [31:16] budget to give back.
+enum Exit : uint8_t {
+	/// No translated block starts at PC.
+	EXIT_MISS,
+	/// Not enough budget left for the block at PC.
+	EXIT_BUDGET,
+	/// The instruction at PC has to be interpreted.
+	EXIT_INTERPRET,
+	/// A Store wrote into translated code.
+	EXIT_STORE,
+	EXIT_HALT,
+	EXIT_UNUSED,
+};
+
+const size_t CODE_SIZE = 1 << 20;
+const size_t MAX_BLOCK = 64;
+/// Blocks translated in one go, the one reached and those it jumps to, so
+/// that the code is made writable and executable again once for all.
+const size_t MAX_AHEAD = 16;
+/// Invalidations after which a word is interpreted for the rest of a run.
+const uint8_t MAX_INVALIDATIONS = 4;
+/// Native code that returns after fewer than `SHORT_RUN` instructions, for
+/// the interpreter to run one, costs more than it saves, as in printing loops
+/// and code that rewrites itself. The interpreter then carries on for a
+/// stretch, twice as long each time in a row up to `MAX_STRETCH`, long enough
+/// for its threaded loop to pay.
+const int64_t SHORT_RUN = 4, MIN_STRETCH = 16, MAX_STRETCH = 1024;
+/// Upper bound on the native code size of one instruction.
+const size_t MAX_INSTRUCTION_CODE = 96;
+
+/// A register or a memory byte at `[base + disp]`.
+struct Operand {
+	bool isReg;
+	uint8_t reg;
+	int32_t disp;
+
+	static Operand Reg(uint8_t reg) { return {true, reg, 0}; }
+	static Operand Mem(uint8_t base, int32_t disp) { return {false, base, disp}; }
+};
+
+class Emitter {
+public:
+	uint8_t *p;
+
+	Emitter(uint8_t *at) : p(at) {}
+
+	void Byte(uint8_t b) { *p++ = b; }
+
+	void Dword(uint32_t d) {
+		std::memcpy(p, &d, sizeof d);
+		p += sizeof d;
+	}
+
+	void Rex(bool w, uint8_t reg, const Operand &rm, bool force = false) {
+		uint8_t rex = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | ((rm.reg >> 3) & 1);
+		if (rex != 0x40 || force)
+			Byte(rex);
+	}
+
+	void ModRM(uint8_t reg, const Operand &rm) {
+		if (rm.isReg) {
+			Byte(0xC0 | ((reg & 7) << 3) | (rm.reg & 7));
+		} else if (rm.disp >= -128 && rm.disp <= 127) {
+			Byte(0x40 | ((reg & 7) << 3) | (rm.reg & 7));
+			Byte(rm.disp);
+		} else {
+			Byte(0x80 | ((reg & 7) << 3) | (rm.reg & 7));
+			Dword(rm.disp);
+		}
+	}
+
+	/// Byte-sized operation. Always has a REX prefix so registers 4 to 7 are
+	/// SPL, BPL, SIL and DIL rather than AH to BH.
+	void Op8(uint8_t opcode, uint8_t reg, const Operand &rm) {
+		Rex(false, reg, rm, true);
+		Byte(opcode);
+		ModRM(reg, rm);
+	}
+
+	void Op64(uint8_t opcode, uint8_t reg, const Operand &rm) {
+		Rex(true, reg, rm);
+		Byte(opcode);
+		ModRM(reg, rm);
+	}
+
+	void Push(HostReg r) {
+		if (r >= R8)
+			Byte(0x41);
+		Byte(0x50 | (r & 7));
+	}
+
+	void Pop(HostReg r) {
+		if (r >= R8)
+			Byte(0x41);
+		Byte(0x58 | (r & 7));
+	}
+
+	void Jmp(const uint8_t *to) {
+		Byte(0xE9);
+		Dword(static_cast<uint32_t>(to - (p + 4)));
+	}
+
+	/// `mov eax, code; jmp exit`
+	void Leave(uint32_t code, const uint8_t *exit) {
+		Byte(0xB8);
+		Dword(code);
+		Jmp(exit);
+	}
+	static const uint8_t LEAVE_SIZE = 10;
+};
+
+uint32_t ExitCode(uint8_t pc, Exit reason, uint16_t refund = 0) { return pc | (reason << 8) | (refund << 16); }
+
+Operand RegOperand(uint8_t r, size_t contextReg) {
+	if (r < HOST_COUNT)
+		return Operand::Reg(HOST[r]);
+	return Operand::Mem(RDI, contextReg + r);
+}
+} // namespace
+
+bool Jit::Supported() { return true; }
+
+Jit::Jit(Machine &machine)
+	: m_Machine(machine), m_Context(), m_Code(nullptr), m_CodeSize(0), m_CodeUsed(0), m_Validated(0),
+	  m_BusVersion(0), m_Writable(true) {
+	m_Context.sums = Float::AddTable();
+	void *code = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		return;
+	}
+	m_Code = static_cast<uint8_t *>(code);
+	m_CodeSize = CODE_SIZE;
+
+	const size_t contextReg = offsetof(Context, reg);
+	Emitter e(m_Code);
+
+	// uint32_t enter(Context *rdi, Memory *rsi, void *rdx)
+	m_Enter = reinterpret_cast<EnterFn>(e.p);
+	for (HostReg r : CALLEE_SAVED)
+		e.Push(r);
+	e.Op64(0x89, RDX, Operand::Reg(RAX)); // mov rax, rdx
+	e.Op64(0x8B, RBP, Operand::Mem(RDI, offsetof(Context, budget)));
+	for (size_t r = 0; r < HOST_COUNT; r++) {
+		// movzx host, byte [rdi + reg]
+		e.Rex(false, HOST[r], Operand::Mem(RDI, 0));
+		e.Byte(0x0F);
+		e.Byte(0xB6);
+		e.ModRM(HOST[r], Operand::Mem(RDI, contextReg + r));
+	}
+	e.Byte(0xFF); // jmp rax
+	e.Byte(0xE0);
+
+	m_Exit = e.p;
+	for (size_t r = 0; r < HOST_COUNT; r++)
+		e.Op8(0x88, HOST[r], Operand::Mem(RDI, contextReg + r));
+	e.Op64(0x89, RBP, Operand::Mem(RDI, offsetof(Context, budget)));
+	for (size_t i = sizeof(CALLEE_SAVED) / sizeof(CALLEE_SAVED[0]); i-- > 0;)
+		e.Pop(CALLEE_SAVED[i]);
+	e.Byte(0xC3); // ret
+
+	for (size_t slot = 0; slot < m_Misses.size(); slot++) {
+		m_Misses[slot] = e.p;
+		e.Leave(ExitCode(2 * slot, EXIT_MISS), m_Exit);
+	}
+	m_CodeFixed = e.p - m_Code;
+	Flush();
+}
+
+Jit::~Jit() {
+	if (m_Code != nullptr)
+		munmap(m_Code, m_CodeSize);
+}
+
+void Jit::Flush() {
+	m_CodeUsed = m_CodeFixed;
+	m_Blocks.clear();
+	std::copy(m_Misses.begin(), m_Misses.end(), m_Context.blocks);
+	std::fill(std::begin(m_Context.translated), std::end(m_Context.translated), 0);
+	m_BusVersion = m_Machine.bus.Version();
+}
+
+void Jit::SetWritable(bool writable) {
+	if (m_Writable != writable) {
+		mprotect(m_Code, m_CodeSize, PROT_READ | (writable ? PROT_WRITE : PROT_EXEC));
+		m_Writable = writable;
+	}
+}
+
+void Jit::Run() {
+	StopReason reason;
+	do {
+		reason = RunFor(std::numeric_limits<uint64_t>::max()).reason;
+	} while (reason == StopReason::BUDGET_EXHAUSTED || reason == StopReason::BREAKPOINT);
+}
+
+RunResult Jit::RunFor(uint64_t maxInstructions) {
+	bool detectLoops = m_Machine.DetectsLoops() && !m_Machine.bus.HasLoads();
+	if (m_Code == nullptr || m_Machine.m_Breakpoints.any() || detectLoops || m_Machine.Observed()) {
+		return m_Machine.RunFor(maxInstructions);
+	}
+	int64_t budget = std::min<uint64_t>(maxInstructions, std::numeric_limits<int64_t>::max());
+	RunResult result = Execute(budget);
+	if (m_Machine.scr != nullptr) {
+		m_Machine.scr->Stopped();
+	}
+	return result;
+}
+
+RunResult Jit::Execute(int64_t budget) {
+	Machine &mac = m_Machine;
+	RunResult result = {StopReason::BUDGET_EXHAUSTED, 0};
+	int64_t initial = budget;
+	Validate();
+	m_Invalidations.fill(0);
+	int64_t stretch = 0;
+	bool brief = false;
+	while (budget > 0) {
+		// Translations load and store memory directly, only where no device was
+		// mapped when they were made.
+		if (mac.bus.Version() != m_BusVersion) {
+			Flush();
+		}
+		uint8_t pc = mac.reg.pc;
+		if (pc % 2 == 0 && Translate(pc >> 1)) {
+			int64_t entered = budget;
+			SetWritable(false);
+			for (size_t r = 0; r < 16; r++)
+				m_Context.reg[r] = mac.reg.Read(r);
+			m_Context.budget = budget;
+			uint32_t code = m_Enter(&m_Context, &mac.mem, m_Context.blocks[pc >> 1]);
+			// Only registers whose value changed count as written.
+			for (size_t r = 0; r < 16; r++)
+				if (mac.reg.Read(r) != m_Context.reg[r])
+					mac.reg.Write(r, m_Context.reg[r]);
+			budget = m_Context.budget + (code >> 16);
+			mac.reg.pc = code & 0xFF;
+			brief = entered - budget < SHORT_RUN;
+			switch (static_cast<Exit>((code >> 8) & 0xFF)) {
+			case EXIT_MISS:
+				continue;
+			case EXIT_STORE:
+				Validate();
+				continue;
+			case EXIT_HALT:
+				result.reason = StopReason::HALTED;
+				result.retired = initial - budget;
+				return result;
+			case EXIT_UNUSED:
+				result.reason = StopReason::UNUSED_OPCODE;
+				result.retired = initial - budget;
+				return result;
+			case EXIT_BUDGET:
+			case EXIT_INTERPRET:
+				break;
+			}
+			if (budget == 0) {
+				break;
+			}
+		}
+
+		int64_t steps = 1;
+		if (brief) {
+			stretch = std::clamp(2 * stretch, MIN_STRETCH, MAX_STRETCH);
+			steps = stretch;
+		} else {
+			stretch = 0;
+		}
+		Instruction ins(mac.mem.Read(mac.reg.pc), mac.mem.Read(mac.reg.pc + 1));
+		uint64_t generation = mac.mem.m_Generation;
+		RunResult step = mac.Advance(std::min(steps, budget));
+		budget -= step.retired;
+		if (step.reason != StopReason::BUDGET_EXHAUSTED) {
+			result.reason = step.reason;
+			break;
+		}
+		// A single Store to a device that wrote nothing else only changed its
+		// own cell; anything more checks every word.
+		if (step.retired == 1 && mac.mem.m_Generation == generation + 1 &&
+			mac.m_Handlers[ins.opcode] == &Store::Apply) {
+			Validate(ins.operandXY >> 1);
+		} else if (mac.mem.m_Generation != generation) {
+			Validate();
+		}
+	}
+	result.retired = initial - budget;
+	return result;
+}
+
+void Jit::Validate() {
+	const Memory &mem = m_Machine.mem;
+	if (mem.m_Generation == m_Validated) {
+		return;
+	}
+	for (size_t slot = 0; slot < m_Generations.size(); slot++) {
+		if (m_Context.translated[slot] != 0 && m_Generations[slot] != mem.m_SlotGeneration[slot]) {
+			Validate(slot);
+		}
+	}
+	m_Validated = mem.m_Generation;
+}
+
+void Jit::Validate(uint8_t slot) {
+	const Memory &mem = m_Machine.mem;
+	if (m_Context.translated[slot] == 0 || m_Generations[slot] == mem.m_SlotGeneration[slot]) {
+		return;
+	}
+	// Printing loops store to the screen cell over and over; the code there
+	// only goes stale when the bytes change.
+	if (m_Words[slot] == (mem.Read(2 * slot) << 8 | mem.Read(2 * slot + 1))) {
+		m_Generations[slot] = mem.m_SlotGeneration[slot];
+		return;
+	}
+	Invalidate(slot);
+	if (m_Invalidations[slot] < MAX_INVALIDATIONS) {
+		m_Invalidations[slot]++;
+	}
+}
+
+void Jit::Invalidate(uint8_t slot) {
+	auto covers = [slot](const Block &b) { return b.first <= slot && slot <= b.last; };
+	for (const Block &b : m_Blocks) {
+		if (covers(b)) {
+			m_Context.blocks[b.first] = m_Misses[b.first];
+			for (size_t s = b.first; s <= b.last; s++)
+				m_Context.translated[s]--;
+		}
+	}
+	m_Blocks.erase(std::remove_if(m_Blocks.begin(), m_Blocks.end(), covers), m_Blocks.end());
+}
+
+bool Jit::Translate(uint8_t slot) {
+	if (m_Context.blocks[slot] != m_Misses[slot]) {
+		return true;
+	}
+	std::vector<uint8_t> next;
+	if (!TranslateBlock(slot, true, next)) {
+		return false;
+	}
+	for (size_t i = 0, ahead = 1; i < next.size() && ahead < MAX_AHEAD; i++) {
+		if (m_Context.blocks[next[i]] == m_Misses[next[i]]) {
+			if (!TranslateBlock(next[i], false, next)) {
+				continue;
+			}
+			ahead++;
+		}
+	}
+	return true;
+}
+
+bool Jit::TranslateBlock(uint8_t slot, bool mayFlush, std::vector<uint8_t> &next) {
+	const Machine &mac = m_Machine;
+	const std::array<InstructionHandler, 16> &handlers = mac.m_Handlers;
+
+	// Find where the block ends first, the budget check needs its length.
+	size_t count = 0;
+	bool interpret = false;
+	for (uint8_t pc = 2 * slot;; pc += 2) {
+		Instruction ins(mac.mem.Read(pc), mac.mem.Read(pc + 1));
+		InstructionHandler h = handlers[ins.opcode];
+		// Loads and stores a device answers are left to the interpreter, and
+		// so are words that keep being rewritten.
+		uint8_t attribute = mac.bus.Attribute(ins.operandXY);
+		bool native =
+			m_Invalidations[pc >> 1] < MAX_INVALIDATIONS &&
+			(h == &Nothing::Apply || (h == &Load1::Apply && !(attribute & Bus::LOAD)) || h == &Load2::Apply ||
+			 (h == &Store::Apply && !(attribute & Bus::STORE)) || h == &Move::Apply || h == &Add1::Apply ||
+			 h == &Add2::Apply || h == &Or::Apply || h == &And::Apply || h == &Xor::Apply || h == &Rotate::Apply ||
+			 h == &Jump::Apply || h == &Halt::Apply || h == &Unused::Apply);
+		if (!native) {
+			interpret = true;
+			break;
+		}
+		count++;
+		if (h == &Jump::Apply || h == &Halt::Apply || h == &Unused::Apply || pc == 0xFE || count == MAX_BLOCK) {
+			break;
+		}
+	}
+	if (count == 0) {
+		return false;
+	}
+
+	if (m_CodeSize - m_CodeUsed < (count + 2) * MAX_INSTRUCTION_CODE) {
+		// Flushing would drop the blocks translated just before.
+		if (!mayFlush) {
+			return false;
+		}
+		Flush();
+	}
+	SetWritable(true);
+
+	const size_t contextReg = offsetof(Context, reg);
+	const Operand al = Operand::Reg(RAX);
+	auto reg = [contextReg](uint8_t r) { return RegOperand(r, contextReg); };
+	auto cell = [](uint8_t xy) { return Operand::Mem(RSI, offsetof(Memory, m_Array) + xy); };
+	auto chain = [](Emitter &e, uint8_t pc) {
+		// jmp [rdi + blocks + slot]
+		e.Byte(0xFF);
+		e.ModRM(4, Operand::Mem(RDI, offsetof(Context, blocks) + (pc >> 1) * sizeof(void *)));
+	};
+
+	uint8_t *entry = m_Code + m_CodeUsed;
+	Emitter e(entry);
+
+	// cmp rbp, count; jge +LEAVE_SIZE; leave; sub rbp, count
+	e.Op64(0x81, 7, Operand::Reg(RBP));
+	e.Dword(count);
+	e.Byte(0x7D);
+	e.Byte(Emitter::LEAVE_SIZE);
+	e.Leave(ExitCode(2 * slot, EXIT_BUDGET), m_Exit);
+	e.Op64(0x81, 5, Operand::Reg(RBP));
+	e.Dword(count);
+
+	uint8_t pc = 2 * slot;
+	bool chained = false;
+	for (size_t i = 0; i < count; i++, pc += 2) {
+		Instruction ins(mac.mem.Read(pc), mac.mem.Read(pc + 1));
+		InstructionHandler h = handlers[ins.opcode];
+		if (h == &Load1::Apply) {
+			e.Op8(0x8A, RAX, cell(ins.operandXY));
+			e.Op8(0x88, RAX, reg(ins.operand1));
+		} else if (h == &Load2::Apply) {
+			e.Op8(0xC6, 0, reg(ins.operand1));
+			e.Byte(ins.operandXY);
+		} else if (h == &Store::Apply) {
+			e.Op8(0x8A, RAX, reg(ins.operand1));
+			e.Op8(0x88, RAX, cell(ins.operandXY));
+			// Same bookkeeping as Memory::Write(): bump the generation of
+			// the written cell and instruction word, mark the cell dirty and
+			// written.
+			Operand generation = Operand::Mem(RSI, offsetof(Memory, m_Generation));
+			e.Op64(0x8B, RAX, generation);
+			e.Op64(0xFF, 0, al); // inc rax
+			e.Op64(0x89, RAX, generation);
+			e.Op64(0x89, RAX,
+				   Operand::Mem(RSI, offsetof(Memory, m_SlotGeneration) + (ins.operandXY >> 1) * sizeof(uint64_t)));
+			e.Op64(0x89, RAX, Operand::Mem(RSI, offsetof(Memory, m_CellGeneration) + ins.operandXY * sizeof(uint64_t)));
+			// or byte [rsi + mask + xy / 8], 1 << xy % 8, the masks being
+			// little endian words.
+			for (size_t mask : {offsetof(Memory, m_Dirty), offsetof(Memory, m_Written)}) {
+				e.Op8(0x80, 1, Operand::Mem(RSI, mask + ins.operandXY / 8));
+				e.Byte(1 << (ins.operandXY % 8));
+			}
+			// cmp byte [rdi + translated + slot], 0; je +LEAVE_SIZE; leave
+			e.Op8(0x80, 7, Operand::Mem(RDI, offsetof(Context, translated) + (ins.operandXY >> 1)));
+			e.Byte(0);
+			e.Byte(0x74);
+			e.Byte(Emitter::LEAVE_SIZE);
+			e.Leave(ExitCode(pc + 2, EXIT_STORE, count - i - 1), m_Exit);
+		} else if (h == &Move::Apply) {
+			e.Op8(0x8A, RAX, reg(ins.operand2));
+			e.Op8(0x88, RAX, reg(ins.operand3));
+		} else if (h == &Add2::Apply) {
+			// rax = sums + (reg s << 8 | reg t); mov al, [rax]
+			e.Op64(0x31, RAX, al); // xor rax, rax
+			e.Op8(0x8A, RAX, reg(ins.operand2));
+			e.Op64(0xC1, 4, al); // shl rax, 8
+			e.Byte(8);
+			e.Op8(0x8A, RAX, reg(ins.operand3));
+			e.Op64(0x03, RAX, Operand::Mem(RDI, offsetof(Context, sums)));
+			e.Op8(0x8A, RAX, Operand::Mem(RAX, 0));
+			e.Op8(0x88, RAX, reg(ins.operand1));
+		} else if (h == &Add1::Apply || h == &Or::Apply || h == &And::Apply || h == &Xor::Apply) {
+			uint8_t op = h == &Add1::Apply ? 0x02 : h == &Or::Apply ? 0x0A : h == &And::Apply ? 0x22 : 0x32;
+			e.Op8(0x8A, RAX, reg(ins.operand2));
+			e.Op8(op, RAX, reg(ins.operand3));
+			e.Op8(0x88, RAX, reg(ins.operand1));
+		} else if (h == &Rotate::Apply) {
+			if (ins.operand3 % 8 != 0) {
+				e.Op8(0xC0, 1, reg(ins.operand1)); // ror
+				e.Byte(ins.operand3 % 8);
+			}
+		} else if (h == &Jump::Apply) {
+			uint8_t target = ins.operandXY & ~1;
+			if (ins.operand1 != 0) {
+				// mov al, reg; cmp al, reg0; jne +6; jmp [target]
+				e.Op8(0x8A, RAX, reg(ins.operand1));
+				e.Op8(0x3A, RAX, reg(0));
+				uint8_t *jne = e.p;
+				e.Byte(0x75);
+				e.Byte(0);
+				chain(e, target);
+				jne[1] = static_cast<uint8_t>(e.p - (jne + 2));
+				chain(e, pc + 2);
+				next.push_back(static_cast<uint8_t>(pc + 2) >> 1);
+			} else {
+				chain(e, target);
+			}
+			next.push_back(target >> 1);
+			chained = true;
+		} else if (h == &Halt::Apply || h == &Unused::Apply) {
+			e.Leave(ExitCode(pc + 2, h == &Halt::Apply ? EXIT_HALT : EXIT_UNUSED), m_Exit);
+			chained = true;
+		}
+	}
+	if (!chained) {
+		if (interpret) {
+			e.Leave(ExitCode(pc, EXIT_INTERPRET), m_Exit);
+		} else {
+			chain(e, pc);
+			next.push_back(pc >> 1);
+		}
+	}
+
+	m_CodeUsed = e.p - m_Code;
+
+	Block block = {slot, static_cast<uint8_t>(slot + count - 1)};
+	m_Blocks.push_back(block);
+	m_Context.blocks[slot] = entry;
+	for (size_t s = block.first; s <= block.last; s++) {
+		m_Context.translated[s]++;
+		m_Generations[s] = mac.mem.SlotGeneration(s);
+		m_Words[s] = mac.mem.Read(2 * s) << 8 | mac.mem.Read(2 * s + 1);
+	}
+	return true;
+}
+
+#else
+
+bool Jit::Supported() { return false; }
+
+Jit::Jit(Machine &machine)
+	: m_Machine(machine), m_Context(), m_Code(nullptr), m_CodeSize(0), m_CodeUsed(0), m_Validated(0),
+	  m_BusVersion(0), m_Writable(false) {}
+
+Jit::~Jit() = default;
+
+void Jit::Run() { m_Machine.RunThreaded(); }
+
+RunResult Jit::RunFor(uint64_t maxInstructions) { return m_Machine.RunFor(maxInstructions); }
+
+#endif
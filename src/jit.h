@@ -0,0 +1,104 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "vole.h"
+
+namespace vole {
+/// @brief Runs a machine's program by translating its basic blocks to native
+/// x86-64 code.
+///
+/// A block starts at an instruction word and ends at a Jump (B), Halt (C) or
+/// unused opcode. Registers 0 to A live in host registers for as long as
+/// native code runs, and blocks jump straight into each other through a
+/// table indexed by instruction word. Instructions the generated code does
+/// not handle itself (custom control units, stores to the screen cell)
+/// end the block and are executed by the interpreter, which carries on for a
+/// while when native code keeps coming back after a few instructions.
+///
+/// A Store into a translated word leaves native code, and if the word's bytes
+/// changed every block covering it is dropped and translated again when next
+/// reached. Words rewritten more than a few times in one run are left to the
+/// interpreter from then on. Writes from outside (`mem`, the CLI, the GUI) are
+/// noticed through the memory's slot generations the next time Run() is
+/// called.
+class Jit {
+public:
+	explicit Jit(Machine &);
+	Jit(const Jit &) = delete;
+	Jit &operator=(const Jit &) = delete;
+	~Jit();
+
+	/// @brief Whether native code can be generated on this host. When it
+	/// cannot, Run() and RunFor() use the machine's own interpreter.
+	static bool Supported();
+
+	/// @brief Run instructions until the machine halts, same as
+	/// `Machine::Run()`.
+	void Run();
+
+	/// @brief Same as `Machine::RunFor()`. Runs on the interpreter while the
+	/// machine has breakpoints, detects loops, records a History, is traced or
+	/// is profiled.
+	RunResult RunFor(uint64_t maxInstructions);
+
+private:
+	/// State shared with the generated code, which addresses it relative to
+	/// a host register.
+	struct Context {
+		/// Machine registers while native code runs.
+		uint8_t reg[16];
+		/// Native entry of the block starting at each instruction word, or a
+		/// stub returning to Run() when there is none.
+		void *blocks[Memory::SIZE / 2];
+		/// Number of translated blocks covering each instruction word.
+		uint8_t translated[Memory::SIZE / 2];
+		/// Instructions left to run.
+		int64_t budget;
+		/// `Float::AddTable()`, for Add2.
+		const uint8_t *sums;
+	};
+
+	/// Range of instruction words (inclusive) translated as one block.
+	struct Block {
+		uint8_t first, last;
+	};
+
+	typedef uint32_t (*EnterFn)(Context *, Memory *, void *);
+
+	Machine &m_Machine;
+	Context m_Context;
+	uint8_t *m_Code;
+	size_t m_CodeSize, m_CodeUsed, m_CodeFixed;
+	EnterFn m_Enter;
+	uint8_t *m_Exit;
+	std::array<void *, Memory::SIZE / 2> m_Misses;
+	/// `mem.SlotGeneration()` each translated word was read at.
+	std::array<uint64_t, Memory::SIZE / 2> m_Generations;
+	/// Bytes of each translated word, high one first, to tell a Store that
+	/// left the word as it was from one that changed it.
+	std::array<uint16_t, Memory::SIZE / 2> m_Words;
+	/// Times each word was invalidated since Execute() started.
+	std::array<uint8_t, Memory::SIZE / 2> m_Invalidations;
+	/// Memory's generation at the last Validate(): nothing to check until
+	/// memory is written again.
+	uint64_t m_Validated;
+	std::vector<Block> m_Blocks;
+	/// `bus.Version()` the translations were made with.
+	uint64_t m_BusVersion;
+	/// Whether the code is mapped for writing rather than executing.
+	bool m_Writable;
+
+	RunResult Execute(int64_t budget);
+	bool Translate(uint8_t slot);
+	bool TranslateBlock(uint8_t slot, bool mayFlush, std::vector<uint8_t> &next);
+	void Validate();
+	void Validate(uint8_t slot);
+	void Invalidate(uint8_t slot);
+	void Flush();
+	void SetWritable(bool writable);
+};
+} // namespace vole
@@ -0,0 +1,405 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define VOLE_MMAP
+#endif
+
+#include "loader.h"
+#include "vole.h"
+
+using namespace vole;
+
+MappedFile::MappedFile(const std::string &path) : m_Open(false), m_Data(nullptr), m_Size(0), m_Mapped(false) {
+#ifdef VOLE_MMAP
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		m_Open = true;
+		m_Size = st.st_size;
+		if (m_Size != 0) {
+			void *data = mmap(nullptr, m_Size, PROT_READ, MAP_PRIVATE, fd, 0);
+			m_Mapped = data != MAP_FAILED;
+			m_Data = static_cast<const uint8_t *>(data);
+		}
+	}
+	close(fd);
+	if (m_Mapped || (m_Open && m_Size == 0)) {
+		return;
+	}
+	m_Open = false;
+	m_Size = 0;
+	m_Data = nullptr;
+#endif
+	// Not a regular file, or no mmap().
+	std::ifstream ifs(path, std::ios::binary);
+	if (!ifs.is_open()) {
+		return;
+	}
+	m_Buffer.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+	m_Open = !ifs.bad();
+	m_Data = m_Buffer.data();
+	m_Size = m_Buffer.size();
+}
+
+MappedFile::~MappedFile() {
+#ifdef VOLE_MMAP
+	if (m_Mapped) {
+		munmap(const_cast<uint8_t *>(m_Data), m_Size);
+	}
+#endif
+}
+
+bool MappedFile::IsOpen() const { return m_Open; }
+
+const uint8_t *MappedFile::Data() const { return m_Data; }
+
+size_t MappedFile::Size() const { return m_Size; }
+
+ProgramImage::ProgramImage() : mem(), cells(), reg(), registers(0), entry(0), hasEntry(false) {}
+
+bool ProgramImage::Has(uint8_t cell) const { return (cells[cell / 64] >> (cell % 64)) & 1; }
+
+void ProgramImage::Set(uint8_t cell, uint8_t value) {
+	mem[cell] = value;
+	cells[cell / 64] |= uint64_t(1) << (cell % 64);
+}
+
+void ProgramImage::Give(size_t from, size_t to) {
+	for (size_t word = from / 64; word * 64 < to; word++) {
+		size_t low = std::max(from, word * 64) % 64, high = std::min(to, word * 64 + 64) - word * 64;
+		cells[word] |= (high - low == 64 ? ~uint64_t(0) : (uint64_t(1) << (high - low)) - 1) << low;
+	}
+}
+
+bool ProgramImage::IsEmpty() const {
+	return cells == CellMask() && registers == 0 && !hasEntry;
+}
+
+namespace {
+/// What the parser makes of a character: the value of a hexadecimal digit,
+/// or one of these. Whatever is at most BLANK ends a word.
+enum : int8_t { OTHER = -1, BLANK = -2, NEWLINE = -3, COMMENT = -4 };
+
+struct CharClasses {
+	int8_t of[256];
+	CharClasses() {
+		std::memset(of, OTHER, sizeof of);
+		for (int d = 0; d < 10; d++) {
+			of['0' + d] = d;
+		}
+		for (int d = 0; d < 6; d++) {
+			of['a' + d] = of['A' + d] = 10 + d;
+		}
+		for (char c : {' ', '\t', '\r', '\v', '\f'}) {
+			of[static_cast<uint8_t>(c)] = BLANK;
+		}
+		of['\n'] = NEWLINE;
+		of['#'] = COMMENT;
+	}
+	int8_t operator()(char c) const { return of[static_cast<uint8_t>(c)]; }
+};
+const CharClasses CLASS;
+
+bool isBlank(char c) { return CLASS(c) == BLANK; }
+
+bool isSpace(char c) { return CLASS(c) == BLANK || CLASS(c) == NEWLINE; }
+
+/// Whether a word, number or directive name ends before `text[i]`.
+bool endsBefore(const char *text, size_t size, size_t i) { return i == size || CLASS(text[i]) <= BLANK; }
+
+/// Parse the hexadecimal number at `text[i]`, at most `max`, and move `i`
+/// past it. On failure `i` is where it went wrong.
+bool parseNumber(const char *text, size_t size, size_t &i, uint32_t max, uint32_t &value) {
+	size_t start = i;
+	if (text[i] == '0' && i + 1 < size && (text[i + 1] == 'x' || text[i + 1] == 'X')) {
+		i += 2;
+	}
+	value = 0;
+	size_t digits = 0;
+	for (int8_t digit; i < size && (digit = CLASS(text[i])) >= 0; i++, digits++) {
+		value = value << 4 | digit;
+		if (value > max) {
+			i = start;
+			return false;
+		}
+	}
+	return digits != 0 && endsBefore(text, size, i);
+}
+
+/// Same as parseNumber(), for an argument of a directive: on the same line,
+/// after blanks.
+bool parseArgument(const char *text, size_t size, size_t &i, uint32_t max, uint32_t &value) {
+	while (i < size && isBlank(text[i])) {
+		i++;
+	}
+	return i < size && parseNumber(text, size, i, max, value);
+}
+
+bool isDirective(const char *text, size_t size, size_t start, size_t end, const char *name) {
+	size_t length = std::strlen(name);
+	return end - start == length && start + length <= size && std::memcmp(text + start, name, length) == 0;
+}
+
+error::LoadProgramError fail(error::LoadProgramError err, const char *text, size_t offset, error::Location *where) {
+	if (where != nullptr) {
+		where->offset = offset;
+		where->line = 1;
+		size_t lineStart = 0;
+		for (size_t i = 0; i < offset; i++) {
+			if (text[i] == '\n') {
+				where->line++;
+				lineStart = i + 1;
+			}
+		}
+		where->column = offset - lineStart + 1;
+	}
+	return err;
+}
+
+error::LoadProgramError badImage(size_t offset, error::Location *where) {
+	if (where != nullptr) {
+		*where = {offset, 0, 0};
+	}
+	return error::LoadProgramError::BAD_IMAGE;
+}
+} // namespace
+
+error::LoadProgramError vole::ParseProgram(const char *text, size_t size, uint8_t at, ProgramImage &program,
+										   error::Location *where) {
+	const error::LoadProgramError NOT_A_PROGRAM = error::LoadProgramError::STREAM_READ_FAILED;
+	const error::LoadProgramError TOO_LONG = error::LoadProgramError::TOO_MUCH_INSTRUCTIONS;
+	program = ProgramImage();
+	// Cell the next word or byte goes to, and where the words and bytes
+	// stored since the last `.org` start.
+	size_t next = at, run = at;
+	size_t i = 0;
+	uint32_t value;
+	for (;;) {
+		while (i < size && isSpace(text[i])) {
+			i++;
+		}
+		if (i == size) {
+			break;
+		}
+		size_t start = i;
+		if (text[i] == '#') {
+			while (i < size && text[i] != '\n') {
+				i++;
+			}
+			continue;
+		}
+		if (text[i] != '.') {
+			// Most words are four digits.
+			int8_t d0, d1, d2, d3;
+			if (i + 4 <= size && (d0 = CLASS(text[i])) >= 0 && (d1 = CLASS(text[i + 1])) >= 0 &&
+				(d2 = CLASS(text[i + 2])) >= 0 && (d3 = CLASS(text[i + 3])) >= 0 && endsBefore(text, size, i + 4)) {
+				value = d0 << 12 | d1 << 8 | d2 << 4 | d3;
+				i += 4;
+			} else if (!parseNumber(text, size, i, 0xFFFF, value)) {
+				return fail(NOT_A_PROGRAM, text, i, where);
+			}
+			if (next + 2 > Memory::SIZE) {
+				return fail(TOO_LONG, text, start, where);
+			}
+			program.mem[next++] = value >> 8;
+			program.mem[next++] = value & 0xFF;
+			continue;
+		}
+
+		while (!endsBefore(text, size, i)) {
+			i++;
+		}
+		if (isDirective(text, size, start, i, ".org")) {
+			if (!parseArgument(text, size, i, 0xFF, value)) {
+				return fail(NOT_A_PROGRAM, text, i, where);
+			}
+			program.Give(run, next);
+			next = run = value;
+		} else if (isDirective(text, size, start, i, ".byte")) {
+			for (;;) {
+				while (i < size && isBlank(text[i])) {
+					i++;
+				}
+				if (i == size || text[i] == '\n' || text[i] == '#') {
+					break;
+				}
+				size_t byte = i;
+				if (!parseNumber(text, size, i, 0xFF, value)) {
+					return fail(NOT_A_PROGRAM, text, i, where);
+				}
+				if (next >= Memory::SIZE) {
+					return fail(TOO_LONG, text, byte, where);
+				}
+				program.mem[next++] = value;
+			}
+		} else if (isDirective(text, size, start, i, ".entry")) {
+			if (!parseArgument(text, size, i, 0xFF, value)) {
+				return fail(NOT_A_PROGRAM, text, i, where);
+			}
+			program.entry = value;
+			program.hasEntry = true;
+		} else if (isDirective(text, size, start, i, ".reg")) {
+			uint32_t r;
+			if (!parseArgument(text, size, i, 0xF, r) || !parseArgument(text, size, i, 0xFF, value)) {
+				return fail(NOT_A_PROGRAM, text, i, where);
+			}
+			program.reg[r] = value;
+			program.registers |= 1 << r;
+		} else {
+			return fail(NOT_A_PROGRAM, text, start, where);
+		}
+	}
+	program.Give(run, next);
+	if (program.IsEmpty()) {
+		return fail(NOT_A_PROGRAM, text, size, where);
+	}
+	return error::LoadProgramError::NOT_AN_ERROR;
+}
+
+uint64_t image::Hash(const uint8_t *data, size_t size) {
+	uint64_t hash = 0xCBF29CE484222325 ^ size;
+	auto mix = [&hash](uint64_t word) {
+		hash = (hash ^ word) * 0x9E3779B97F4A7C15;
+		hash ^= hash >> 29;
+	};
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		const uint8_t *b = data + i;
+		mix(uint64_t(b[0]) | uint64_t(b[1]) << 8 | uint64_t(b[2]) << 16 | uint64_t(b[3]) << 24 | uint64_t(b[4]) << 32 |
+			uint64_t(b[5]) << 40 | uint64_t(b[6]) << 48 | uint64_t(b[7]) << 56);
+	}
+	if (i < size) {
+		uint64_t word = 0;
+		for (size_t b = 0; i + b < size; b++) {
+			word |= uint64_t(data[i + b]) << (8 * b);
+		}
+		mix(word);
+	}
+	return hash;
+}
+
+bool image::IsImage(const uint8_t *data, size_t size) {
+	return size >= sizeof MAGIC && std::memcmp(data, MAGIC, sizeof MAGIC) == 0;
+}
+
+error::LoadProgramError image::ReadHeader(const uint8_t *data, size_t size, Header &header, error::Location *where) {
+	if (!IsImage(data, size)) {
+		return badImage(0, where);
+	}
+	if (size < HEADER_SIZE) {
+		return badImage(size, where);
+	}
+	header.version = data[4];
+	if (header.version != 1 && header.version != VERSION) {
+		return badImage(4, where);
+	}
+	if ((data[7] & ~HAS_ENTRY) != 0 || (header.version == 1 && data[7] != 0)) {
+		return badImage(7, where);
+	}
+	header.entry = data[6];
+	std::memcpy(header.reg.data(), data + 8, header.reg.size());
+	header.size = data[24] | data[25] << 8;
+	header.hash = 0;
+	for (int i = 7; i >= 0; i--) {
+		header.hash = header.hash << 8 | data[HASH_OFFSET + i];
+	}
+	if (header.version == 1) {
+		if (data[26] != 0 || data[27] != 0) {
+			return badImage(26, where);
+		}
+		header.segments = 1;
+		header.hasEntry = true;
+		header.registers = 0xFFFF;
+		if (header.size > Memory::SIZE - data[5] || header.size > size - HEADER_SIZE) {
+			return badImage(24, where);
+		}
+		if (Hash(data + HEADER_SIZE, header.size) != header.hash) {
+			return badImage(HASH_OFFSET, where);
+		}
+		return error::LoadProgramError::NOT_AN_ERROR;
+	}
+
+	header.segments = data[5];
+	header.hasEntry = data[7] & HAS_ENTRY;
+	header.registers = data[26] | data[27] << 8;
+	size_t table = header.segments * SEGMENT_SIZE;
+	if (table + header.size > size - HEADER_SIZE) {
+		return badImage(24, where);
+	}
+	size_t contents = 0;
+	for (size_t i = 0; i < header.segments; i++) {
+		Segment segment = ReadSegment(data, header, i);
+		size_t field = HEADER_SIZE + i * SEGMENT_SIZE;
+		if (data[field + 1] != 0 || segment.size == 0 || segment.size > Memory::SIZE - segment.at) {
+			return badImage(field, where);
+		}
+		contents += segment.size;
+	}
+	if (contents != header.size) {
+		return badImage(24, where);
+	}
+	if (Hash(data + HEADER_SIZE, table + header.size) != header.hash) {
+		return badImage(HASH_OFFSET, where);
+	}
+	return error::LoadProgramError::NOT_AN_ERROR;
+}
+
+image::Segment image::ReadSegment(const uint8_t *data, const Header &header, size_t i) {
+	if (header.version == 1) {
+		return {data[5], header.size};
+	}
+	const uint8_t *field = data + HEADER_SIZE + i * SEGMENT_SIZE;
+	return {field[0], static_cast<uint16_t>(field[2] | field[3] << 8)};
+}
+
+size_t image::ContentsOffset(const Header &header) {
+	return HEADER_SIZE + (header.version == 1 ? 0 : header.segments * SEGMENT_SIZE);
+}
+
+std::vector<uint8_t> image::Encode(const ProgramImage &program) {
+	std::vector<uint8_t> table, contents;
+	for (size_t cell = 0; cell < Memory::SIZE;) {
+		if (!program.Has(cell)) {
+			cell++;
+			continue;
+		}
+		size_t end = cell;
+		while (end < Memory::SIZE && program.Has(end)) {
+			end++;
+		}
+		size_t length = end - cell;
+		table.insert(table.end(), {static_cast<uint8_t>(cell), 0, static_cast<uint8_t>(length & 0xFF),
+								   static_cast<uint8_t>(length >> 8)});
+		contents.insert(contents.end(), program.mem.begin() + cell, program.mem.begin() + end);
+		cell = end;
+	}
+
+	std::vector<uint8_t> bytes(HEADER_SIZE);
+	std::memcpy(bytes.data(), MAGIC, sizeof MAGIC);
+	bytes[4] = VERSION;
+	bytes[5] = table.size() / SEGMENT_SIZE;
+	bytes[6] = program.entry;
+	bytes[7] = program.hasEntry ? HAS_ENTRY : 0;
+	std::memcpy(bytes.data() + 8, program.reg.data(), program.reg.size());
+	bytes[24] = contents.size() & 0xFF;
+	bytes[25] = contents.size() >> 8;
+	bytes[26] = program.registers & 0xFF;
+	bytes[27] = program.registers >> 8;
+	bytes.insert(bytes.end(), table.begin(), table.end());
+	bytes.insert(bytes.end(), contents.begin(), contents.end());
+	uint64_t hash = Hash(bytes.data() + HEADER_SIZE, bytes.size() - HEADER_SIZE);
+	for (int i = 0; i < 8; i++) {
+		bytes[HASH_OFFSET + i] = hash >> (8 * i);
+	}
+	return bytes;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "error.h"
+#include "vole.h"
+
+namespace vole {
+/// @brief A whole file in memory, mapped where the system supports it and
+/// read into a buffer otherwise.
+class MappedFile {
+public:
+	explicit MappedFile(const std::string &path);
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+	~MappedFile();
+
+	bool IsOpen() const;
+	const uint8_t *Data() const;
+	size_t Size() const;
+
+private:
+	bool m_Open;
+	const uint8_t *m_Data;
+	size_t m_Size;
+	/// Whether m_Data is mapped, not m_Buffer.
+	bool m_Mapped;
+	std::vector<uint8_t> m_Buffer;
+};
+
+/// @brief A program ready to be put in a machine: the cells it gives a value,
+/// and the registers and PC it starts with if it says.
+struct ProgramImage {
+	/// Cells the program gives, the others are 0.
+	std::array<uint8_t, Memory::SIZE> mem;
+	CellMask cells;
+	std::array<uint8_t, 16> reg;
+	/// Registers given, bit `r` for register `r`.
+	uint16_t registers;
+	uint8_t entry;
+	bool hasEntry;
+
+	ProgramImage();
+	bool Has(uint8_t cell) const;
+	/// @brief Give `cell` a value.
+	void Set(uint8_t cell, uint8_t value);
+	/// @brief Count cells `from` to `to` as given, their values already in
+	/// `mem`.
+	void Give(size_t from, size_t to);
+	bool IsEmpty() const;
+};
+
+/// @brief Parse a program text in one pass. It holds whitespace separated
+/// hexadecimal instruction words (up to FFFF, `0x` prefix allowed), stored
+/// big-endian, two bytes per word, from cell `at` on, and directives:
+///
+///     .org CC         store what follows from cell CC on
+///     .byte 0A 32 19  store single bytes, up to the end of the line
+///     .entry 10       start with the PC at 10
+///     .reg 1 FF       start with register 1 holding FF
+///
+/// `#` starts a comment up to the end of the line. A cell given twice keeps
+/// the later value. Text that gives nothing is not a program.
+/// @param where If not null, where the first word or directive that could not
+/// be parsed or stored starts.
+error::LoadProgramError ParseProgram(const char *text, size_t size, uint8_t at, ProgramImage &program,
+									 error::Location *where = nullptr);
+
+/// `.voleb` binary program images: a fixed header, a table of segments, then
+/// the contents of the segments one after the other, copied to memory as they
+/// are. Numbers are little-endian.
+namespace image {
+const char MAGIC[4] = {'V', 'O', 'L', 'B'};
+/// Version 1 images hold a single segment and all registers.
+const uint8_t VERSION = 2;
+/// magic[4] version segments entry flags reg[16] size[2] registers[2] hash[8]
+///
+/// Version 1: magic[4] version at entry flags(0) reg[16] size[2]
+/// reserved(0)[2] hash[8], the contents right after.
+const size_t HEADER_SIZE = 36;
+/// Offset of the hash in the header.
+const size_t HASH_OFFSET = 28;
+/// A segment in the table: at reserved(0) size[2].
+const size_t SEGMENT_SIZE = 4;
+/// Header `flags`: the entry PC is given.
+const uint8_t HAS_ENTRY = 1;
+
+struct Header {
+	uint8_t version;
+	/// Segments in the table, and bytes of contents.
+	uint8_t segments;
+	uint16_t size;
+	uint8_t entry;
+	bool hasEntry;
+	std::array<uint8_t, 16> reg;
+	/// Registers given, bit `r` for register `r`.
+	uint16_t registers;
+	/// Hash() of the segment table and contents.
+	uint64_t hash;
+};
+
+struct Segment {
+	uint8_t at;
+	uint16_t size;
+};
+
+/// @brief Hash of `size` bytes, taken 8 at a time as little-endian words.
+uint64_t Hash(const uint8_t *data, size_t size);
+/// @brief Whether `size` bytes start like an image.
+bool IsImage(const uint8_t *data, size_t size);
+/// @brief Read and check the image in `data`: its header, that every segment
+/// fits in memory and the contents in the file, and the hash.
+/// @return NOT_AN_ERROR or BAD_IMAGE, with the offset of the field at fault
+/// in `where`.
+error::LoadProgramError ReadHeader(const uint8_t *data, size_t size, Header &header,
+								   error::Location *where = nullptr);
+/// @brief Segment `i` of an image whose header was read.
+Segment ReadSegment(const uint8_t *data, const Header &header, size_t i);
+/// @brief Where the contents of the first segment start, those of the next
+/// follow.
+size_t ContentsOffset(const Header &header);
+/// @brief Encode `program` as an image, one segment per run of given cells.
+std::vector<uint8_t> Encode(const ProgramImage &program);
+} // namespace image
+} // namespace vole
@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "profile.h"
+
+using namespace vole;
+
+double ProfiledLoop::TripCount() const {
+	return entries == 0 ? 0 : static_cast<double>(entries + iterations) / entries;
+}
+
+Profiler::Profiler(Machine &mac) : m_Machine(mac) {
+	Clear();
+	m_Machine.m_Profiler = this;
+}
+
+Profiler::~Profiler() { m_Machine.m_Profiler = nullptr; }
+
+void Profiler::Clear() {
+	m_Total = 0;
+	m_Executions.fill(0);
+	m_Opcodes.fill(0);
+	m_Taken.fill(0);
+	m_NotTaken.fill(0);
+	m_Target.fill(0);
+	m_Targets.reset();
+}
+
+uint64_t Profiler::Total() const { return m_Total; }
+
+uint64_t Profiler::Executions(uint8_t pc) const { return m_Executions[pc]; }
+
+uint64_t Profiler::OpcodeExecutions(uint8_t opcode) const { return m_Opcodes[opcode & 0xF]; }
+
+uint64_t Profiler::Taken(uint8_t pc) const { return m_Taken[pc]; }
+
+uint64_t Profiler::NotTaken(uint8_t pc) const { return m_NotTaken[pc]; }
+
+bool Profiler::IsJump(uint8_t pc) const { return m_Taken[pc] != 0 || m_NotTaken[pc] != 0; }
+
+std::vector<ProfiledBlock> Profiler::Blocks() const {
+	std::vector<ProfiledBlock> blocks;
+	for (size_t pc = 0; pc < Memory::SIZE; pc++) {
+		uint64_t executions = m_Executions[pc];
+		if (executions == 0) {
+			continue;
+		}
+		// Continues the block of the instruction before?
+		if (pc >= 2 && m_Executions[pc - 2] == executions && !IsJump(pc - 2) && !m_Targets[pc]) {
+			continue;
+		}
+		ProfiledBlock block = {static_cast<uint8_t>(pc), static_cast<uint8_t>(pc), executions, executions};
+		for (size_t next = pc + 2;
+			 next < Memory::SIZE && m_Executions[next] == executions && !IsJump(next - 2) && !m_Targets[next];
+			 next += 2) {
+			block.last = next;
+			block.instructions += executions;
+		}
+		blocks.push_back(block);
+	}
+	std::stable_sort(blocks.begin(), blocks.end(), [](const ProfiledBlock &a, const ProfiledBlock &b) {
+		return a.instructions > b.instructions;
+	});
+	return blocks;
+}
+
+std::vector<ProfiledLoop> Profiler::Loops() const {
+	// One loop per head, however many back edges go to it.
+	std::array<ProfiledLoop, Memory::SIZE> byHead;
+	std::bitset<Memory::SIZE> heads;
+	for (size_t pc = 0; pc < Memory::SIZE; pc++) {
+		if (m_Taken[pc] == 0 || m_Target[pc] > pc) {
+			continue;
+		}
+		ProfiledLoop &loop = byHead[m_Target[pc]];
+		if (!heads[m_Target[pc]]) {
+			heads[m_Target[pc]] = true;
+			loop = {m_Target[pc], 0, 0, 0};
+		}
+		loop.tail = pc;
+		loop.iterations += m_Taken[pc];
+	}
+	std::vector<ProfiledLoop> loops;
+	for (size_t head = 0; head < Memory::SIZE; head++) {
+		if (heads[head]) {
+			ProfiledLoop loop = byHead[head];
+			// The head runs once per entry and once per iteration. Started
+			// inside the loop, it ran once less.
+			loop.entries = std::max<uint64_t>(m_Executions[head] - std::min(m_Executions[head], loop.iterations), 1);
+			loops.push_back(loop);
+		}
+	}
+	std::stable_sort(loops.begin(), loops.end(),
+					 [](const ProfiledLoop &a, const ProfiledLoop &b) { return a.iterations > b.iterations; });
+	return loops;
+}
+
+void Profiler::Report(std::ostream &out, size_t top) const {
+	char line[128];
+	double total = m_Total == 0 ? 1 : m_Total;
+	out << "Instructions executed: " << m_Total << "\n";
+
+	out << "\nBy opcode:\n";
+	for (uint8_t opcode = 0; opcode < 16; opcode++) {
+		if (m_Opcodes[opcode] != 0) {
+			std::snprintf(line, sizeof line, "  %X %-8s %14llu %6.2f%%\n", opcode,
+						  Disassembler::Name(m_Machine.m_Mnemonics[opcode]), (unsigned long long)m_Opcodes[opcode],
+						  100 * m_Opcodes[opcode] / total);
+			out << line;
+		}
+	}
+
+	std::vector<ProfiledBlock> blocks = Blocks();
+	out << "\nHottest blocks:\n";
+	for (size_t i = 0; i < blocks.size() && i < top; i++) {
+		const ProfiledBlock &block = blocks[i];
+		std::snprintf(line, sizeof line, "  %02X-%02X %3d instructions x %12llu = %14llu %6.2f%%\n", block.first,
+					  block.last, (block.last - block.first) / 2 + 1, (unsigned long long)block.executions,
+					  (unsigned long long)block.instructions, 100 * block.instructions / total);
+		out << line;
+	}
+
+	std::vector<ProfiledLoop> loops = Loops();
+	out << "\nLoops:\n";
+	if (loops.empty()) {
+		out << "  none\n";
+	}
+	for (const ProfiledLoop &loop : loops) {
+		std::snprintf(line, sizeof line, "  %02X-%02X entered %llu times, %llu iterations, %.1f per entry\n",
+					  loop.head, loop.tail, (unsigned long long)loop.entries, (unsigned long long)loop.iterations,
+					  loop.TripCount());
+		out << line;
+	}
+
+	out << "\nJumps:\n";
+	for (size_t pc = 0; pc < Memory::SIZE; pc++) {
+		if (IsJump(pc)) {
+			std::snprintf(line, sizeof line, "  %02X to %02X: taken %llu, not taken %llu\n", static_cast<int>(pc),
+						  m_Target[pc], (unsigned long long)m_Taken[pc], (unsigned long long)m_NotTaken[pc]);
+			out << line;
+		}
+	}
+}
+
+void Profiler::WriteFolded(std::ostream &out) const {
+	std::vector<ProfiledLoop> loops = Loops();
+	// Outermost first: a loop around another is longer.
+	std::stable_sort(loops.begin(), loops.end(), [](const ProfiledLoop &a, const ProfiledLoop &b) {
+		return a.tail - a.head > b.tail - b.head;
+	});
+	char frame[16];
+	for (const ProfiledBlock &block : Blocks()) {
+		out << "vole";
+		for (const ProfiledLoop &loop : loops) {
+			if (loop.head <= block.first && block.last <= loop.tail) {
+				std::snprintf(frame, sizeof frame, ";loop %02X-%02X", loop.head, loop.tail);
+				out << frame;
+			}
+		}
+		std::snprintf(frame, sizeof frame, ";%02X-%02X", block.first, block.last);
+		out << frame << " " << block.instructions << "\n";
+	}
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "vole.h"
+
+namespace vole {
+/// @brief Straight-line code that ran as a whole: consecutive instruction
+/// words executed equally often, no jump but maybe the last, entered only at
+/// the first.
+struct ProfiledBlock {
+	/// PCs of the first and last instruction.
+	uint8_t first, last;
+	/// Times the block ran.
+	uint64_t executions;
+	/// Instructions executed in it, `executions` times its length.
+	uint64_t instructions;
+};
+
+/// @brief A loop, found from the jumps taken backwards to its head (the back
+/// edges).
+struct ProfiledLoop {
+	/// PC the back edges jump to, and PC of the last of them.
+	uint8_t head, tail;
+	/// Times the loop was entered from elsewhere.
+	uint64_t entries;
+	/// Times a back edge was taken.
+	uint64_t iterations;
+	/// Times the head ran per entry, the trip count.
+	double TripCount() const;
+};
+
+/// @brief Counts the instructions a machine executes (through
+/// `Machine::Step()` or `Machine::RunFor()`, which then takes its
+/// per-instruction path): per PC, per opcode and per jump taken or not.
+///
+/// Basic blocks and loops are worked out from the counts when asked for, so
+/// counting stays a few increments per instruction. Counts wrap around PCs
+/// the way the machine does, so self-modifying programs get a profile of
+/// whatever ran at each PC.
+class Profiler {
+public:
+	/// @brief Start counting `mac`. A machine counts to at most one profiler
+	/// at a time.
+	explicit Profiler(Machine &mac);
+	Profiler(const Profiler &) = delete;
+	Profiler &operator=(const Profiler &) = delete;
+	/// Stops counting.
+	~Profiler();
+
+	/// @brief Forget all counts.
+	void Clear();
+
+	/// @brief Instructions executed.
+	uint64_t Total() const;
+	/// @brief Times the instruction at `pc` was executed.
+	uint64_t Executions(uint8_t pc) const;
+	uint64_t OpcodeExecutions(uint8_t opcode) const;
+	/// @brief Times the Jump at `pc` jumped, and did not.
+	uint64_t Taken(uint8_t pc) const;
+	uint64_t NotTaken(uint8_t pc) const;
+
+	/// @brief Blocks executed, most instructions first.
+	std::vector<ProfiledBlock> Blocks() const;
+	/// @brief Loops executed, most iterations first.
+	std::vector<ProfiledLoop> Loops() const;
+
+	/// @brief Write a report: opcodes, the `top` hottest blocks, loops and
+	/// their trip counts, and the jumps.
+	void Report(std::ostream &, size_t top = 10) const;
+	/// @brief Write the blocks as folded stacks for flame graph tools
+	/// (`flamegraph.pl`, speedscope), one `vole;loop 04-10;loop 06-0A;06-0A
+	/// 65280` line per block: the loops around it, outermost first, then
+	/// the block and its instructions executed.
+	void WriteFolded(std::ostream &) const;
+
+private:
+	friend class Machine;
+
+	Machine &m_Machine;
+	uint64_t m_Total;
+	std::array<uint64_t, Memory::SIZE> m_Executions;
+	std::array<uint64_t, 16> m_Opcodes;
+	std::array<uint64_t, Memory::SIZE> m_Taken, m_NotTaken;
+	/// Where the Jump last executed at each PC jumps to.
+	std::array<uint8_t, Memory::SIZE> m_Target;
+	/// PCs a taken jump went to.
+	std::bitset<Memory::SIZE> m_Targets;
+
+	/// Called by the machine after it executed `ins` from `pc`.
+	void Executed(uint8_t pc, const Instruction &ins, bool isJump) {
+		m_Total++;
+		m_Executions[pc]++;
+		m_Opcodes[ins.opcode]++;
+		if (!isJump) {
+			return;
+		}
+		// A jump does not change the registers it compares. It goes to the
+		// instruction word holding an odd target, as Jump::Apply() does.
+		uint8_t target = ins.operandXY & ~1;
+		m_Target[pc] = target;
+		if (m_Machine.reg.Read(ins.operand1) == m_Machine.reg.Read(0)) {
+			m_Taken[pc]++;
+			m_Targets[target] = true;
+		} else {
+			m_NotTaken[pc]++;
+		}
+	}
+	bool IsJump(uint8_t pc) const;
+};
+} // namespace vole
@@ -0,0 +1,333 @@
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "dump.h"
+#include "error.h"
+#include "scheduler.h"
+#include "screen.h"
+#include "trace.h"
+#include "vole.h"
+
+namespace fs = std::filesystem;
+
+/// Instructions a job may run when `--max-steps` is not given.
+const uint64_t DEFAULT_MAX_STEPS = 10000000;
+
+struct Program {
+	std::string path;
+	/// Memory, registers and PC as loaded.
+	vole::Machine::State image;
+};
+
+/// One `R<r>=<value>`, `M<cell>=<value>` or `PC=<value>` of an input vector.
+struct Assignment {
+	enum class Target { REGISTER, CELL, PC } target;
+	uint8_t at;
+	uint8_t value;
+};
+
+typedef std::vector<Assignment> Input;
+
+void usage() {
+	std::cerr << "usage: vole-batch [OPTION]... PROGRAMS...\n"
+			  << "Run every program against every input vector on all cores, one JSON line per run.\n"
+			  << "\n"
+			  << "PROGRAMS are .vole (hexadecimal) or .voleb (image) files, directories searched\n"
+			  << "for them, or manifests listing one program path per line (relative to the\n"
+			  << "manifest).\n"
+			  << "\n"
+			  << "  --inputs FILE     input vectors, one per line, e.g. `R1=05 M80=FF PC=10`;\n"
+			  << "                    without it every program runs once as loaded\n"
+			  << "  --max-steps N     stop a run after N instructions (default " << DEFAULT_MAX_STEPS << ")\n"
+			  << "  --jobs N          worker threads (default: one per hardware thread)\n"
+			  << "  --detect-loops    stop a run as soon as it repeats a machine state\n"
+			  << "  --memory          include the final memory in the output\n"
+			  << "  --output FILE     write results to FILE instead of standard output\n"
+			  << "  --trace FILE      record every executed instruction of every run to FILE, one\n"
+			  << "                    stream per run named PROGRAM#INPUT (see vole-trace)\n";
+}
+
+/// Parse a count option. std::stoull() would take `-1` as the largest count,
+/// so a sign is refused.
+/// @throw std::logic_error If it is not a count.
+uint64_t parseCount(const std::string &s) {
+	size_t start = s.find_first_not_of(" \t\n\v\f\r");
+	if (start == std::string::npos || s[start] == '-' || s[start] == '+') {
+		throw std::invalid_argument(s);
+	}
+	return std::stoull(s);
+}
+
+bool isHexByte(const std::string &s, uint8_t &value) {
+	if (s.empty() || s.size() > 2 || s.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+		return false;
+	}
+	value = std::stoul(s, nullptr, 16);
+	return true;
+}
+
+bool parseAssignment(const std::string &word, Assignment &a) {
+	size_t eq = word.find('=');
+	if (eq == std::string::npos || !isHexByte(word.substr(eq + 1), a.value)) {
+		return false;
+	}
+	std::string target = word.substr(0, eq);
+	std::transform(target.begin(), target.end(), target.begin(), ::toupper);
+	a.at = 0;
+	if (target == "PC") {
+		a.target = Assignment::Target::PC;
+		return true;
+	}
+	if (target.size() < 2 || !isHexByte(target.substr(1), a.at)) {
+		return false;
+	}
+	if (target[0] == 'R' && a.at < 16) {
+		a.target = Assignment::Target::REGISTER;
+		return true;
+	}
+	if (target[0] == 'M') {
+		a.target = Assignment::Target::CELL;
+		return true;
+	}
+	return false;
+}
+
+bool readInputs(const std::string &path, std::vector<Input> &inputs) {
+	std::ifstream ifs(path);
+	if (!ifs.is_open()) {
+		std::cerr << "vole-batch: " << path << ": cannot open input vectors.\n";
+		return false;
+	}
+	std::string line;
+	for (size_t number = 1; std::getline(ifs, line); number++) {
+		std::istringstream words(line.substr(0, line.find('#')));
+		std::string word;
+		Input input;
+		while (words >> word) {
+			Assignment a;
+			if (!parseAssignment(word, a)) {
+				std::cerr << "vole-batch: " << path << ":" << number << ": bad assignment `" << word << "`.\n";
+				return false;
+			}
+			input.push_back(a);
+		}
+		if (!input.empty()) {
+			inputs.push_back(input);
+		}
+	}
+	return true;
+}
+
+bool isProgram(const fs::path &path) { return path.extension() == ".vole" || path.extension() == ".voleb"; }
+
+bool collectPrograms(const fs::path &path, std::vector<std::string> &programs) {
+	std::error_code ec;
+	if (fs::is_directory(path, ec)) {
+		std::vector<std::string> found;
+		for (const fs::directory_entry &entry : fs::recursive_directory_iterator(path, ec)) {
+			if (entry.is_regular_file(ec) && isProgram(entry.path())) {
+				found.push_back(entry.path().string());
+			}
+		}
+		std::sort(found.begin(), found.end());
+		programs.insert(programs.end(), found.begin(), found.end());
+		return !ec;
+	}
+	if (isProgram(path)) {
+		programs.push_back(path.string());
+		return true;
+	}
+	std::ifstream manifest(path);
+	if (!manifest.is_open()) {
+		std::cerr << "vole-batch: " << path.string() << ": cannot open manifest.\n";
+		return false;
+	}
+	std::string line;
+	while (std::getline(manifest, line)) {
+		line = line.substr(0, line.find('#'));
+		line.erase(0, line.find_first_not_of(" \t\r"));
+		line.erase(line.find_last_not_of(" \t\r") + 1);
+		if (!line.empty()) {
+			programs.push_back((path.parent_path() / line).string());
+		}
+	}
+	return true;
+}
+
+void hexBytes(std::string &out, const uint8_t *bytes, size_t count) {
+	size_t at = out.size();
+	out.resize(at + 2 * count + 2);
+	out[at] = '"';
+	*vole::dump::Hex(bytes, count, &out[at + 1]) = '"';
+}
+
+int main(int argc, char *argv[]) {
+	std::vector<std::string> programPaths;
+	std::vector<Input> inputs;
+	uint64_t maxSteps = DEFAULT_MAX_STEPS;
+	size_t jobs = 0;
+	bool withMemory = false;
+	bool detectLoops = false;
+	std::string outputPath;
+	std::string tracePath;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		try {
+			if (arg == "--inputs" && hasValue) {
+				if (!readInputs(argv[++i], inputs)) {
+					return 1;
+				}
+			} else if (arg == "--max-steps" && hasValue) {
+				maxSteps = parseCount(argv[++i]);
+				// Every run would stop before its first instruction.
+				if (maxSteps == 0) {
+					throw std::out_of_range(arg);
+				}
+			} else if (arg == "--jobs" && hasValue) {
+				jobs = parseCount(argv[++i]);
+			} else if (arg == "--detect-loops") {
+				detectLoops = true;
+			} else if (arg == "--memory") {
+				withMemory = true;
+			} else if (arg == "--output" && hasValue) {
+				outputPath = argv[++i];
+			} else if (arg == "--trace" && hasValue) {
+				tracePath = argv[++i];
+			} else if (arg == "--help" || arg == "-h") {
+				usage();
+				return 0;
+			} else if (arg.size() > 1 && arg[0] == '-') {
+				usage();
+				return 2;
+			} else if (!collectPrograms(arg, programPaths)) {
+				return 1;
+			}
+		} catch (const std::logic_error &) { // parseCount().
+			const char *what = arg == "--max-steps" ? "not a positive number" : "not a number";
+			std::cerr << "vole-batch: " << arg << ": " << what << ": " << argv[i] << "\n";
+			return 2;
+		}
+	}
+	if (programPaths.empty()) {
+		usage();
+		return 2;
+	}
+	if (inputs.empty()) {
+		inputs.push_back(Input());
+	}
+
+	std::ofstream file;
+	if (!outputPath.empty()) {
+		file.open(outputPath);
+		if (!file.is_open()) {
+			std::cerr << "vole-batch: " << outputPath << ": cannot open for writing.\n";
+			return 1;
+		}
+	}
+	std::ostream &out = outputPath.empty() ? std::cout : file;
+	std::unique_ptr<vole::TraceFile> trace;
+	if (!tracePath.empty()) {
+		trace.reset(new vole::TraceFile(tracePath));
+		if (!trace->IsOpen()) {
+			std::cerr << "vole-batch: " << tracePath << ": cannot open for writing.\n";
+			return 1;
+		}
+	}
+	std::mutex outLock;
+	int status = 0;
+
+	// Programs are parsed once here; every run starts from a copy.
+	std::vector<Program> programs;
+	for (const std::string &path : programPaths) {
+		vole::Machine loader(nullptr);
+		vole::error::Location where = {};
+		vole::error::LoadProgramError err = loader.LoadProgram(path, 0, &where);
+		if (err != vole::error::LoadProgramError::NOT_AN_ERROR) {
+			std::string line = "{\"program\":";
+			vole::dump::JsonString(line, path);
+			line += ",\"error\":";
+			vole::dump::JsonString(line, vole::dump::Describe(err));
+			if (err != vole::error::LoadProgramError::FILE_OPEN_FAILED) {
+				line += ",\"offset\":" + std::to_string(where.offset);
+			}
+			if (where.line != 0) {
+				line += ",\"line\":" + std::to_string(where.line) + ",\"column\":" + std::to_string(where.column);
+			}
+			out << line << "}\n";
+			status = 1;
+			continue;
+		}
+		programs.push_back({path, loader.Snapshot()});
+	}
+	out.flush();
+
+	vole::Scheduler scheduler(jobs);
+	scheduler.Run(programs.size() * inputs.size(), [&](size_t index, size_t) {
+		const Program &program = programs[index / inputs.size()];
+		size_t inputIndex = index % inputs.size();
+
+		vole::MemoryScreen screen;
+		vole::Machine mac(&screen);
+		mac.Restore(program.image);
+		for (const Assignment &a : inputs[inputIndex]) {
+			switch (a.target) {
+			case Assignment::Target::REGISTER:
+				mac.reg.Write(a.at, a.value);
+				break;
+			case Assignment::Target::CELL:
+				mac.mem.Write(a.at, a.value);
+				break;
+			case Assignment::Target::PC:
+				mac.reg.pc = a.value;
+				break;
+			}
+		}
+		mac.DetectLoops(detectLoops);
+		std::unique_ptr<vole::Tracer> tracer;
+		if (trace) {
+			tracer.reset(new vole::Tracer(mac, *trace, program.path + "#" + std::to_string(inputIndex)));
+		}
+		vole::RunResult result = mac.RunFor(maxSteps);
+		tracer.reset();
+
+		vole::Machine::State state = mac.Snapshot();
+		std::string line = "{\"program\":";
+		vole::dump::JsonString(line, program.path);
+		line += ",\"input\":" + std::to_string(inputIndex);
+		line += ",\"status\":\"";
+		line += vole::dump::Describe(result.reason);
+		line += "\",\"steps\":" + std::to_string(result.retired);
+		line += ",\"pc\":";
+		hexBytes(line, &state.pc, 1);
+		if (result.reason == vole::StopReason::LOOP_DETECTED) {
+			line += ",\"loop\":{\"entry\":";
+			hexBytes(line, &mac.DetectedLoop().entry, 1);
+			line += ",\"period\":" + std::to_string(mac.DetectedLoop().period) + "}";
+		}
+		line += ",\"registers\":";
+		hexBytes(line, state.reg.data(), state.reg.size());
+		if (withMemory) {
+			line += ",\"memory\":";
+			hexBytes(line, state.mem.data(), state.mem.size());
+		}
+		line += ",\"screen\":";
+		vole::dump::JsonString(line, screen.Text());
+		line += "}\n";
+
+		std::lock_guard<std::mutex> guard(outLock);
+		out << line << std::flush;
+	});
+	return status;
+}
@@ -0,0 +1,84 @@
+#include <thread>
+
+#include "scheduler.h"
+
+using namespace vole;
+
+static size_t WorkerCount(size_t workers) {
+	if (workers == 0) {
+		workers = std::thread::hardware_concurrency();
+	}
+	return workers != 0 ? workers : 1;
+}
+
+Scheduler::Scheduler(size_t workers) : m_Workers(WorkerCount(workers)), m_Shares(m_Workers) {}
+
+size_t Scheduler::Workers() const { return m_Workers; }
+
+void Scheduler::Run(size_t count, const std::function<void(size_t index, size_t worker)> &job) {
+	for (size_t worker = 0; worker < m_Workers; worker++) {
+		m_Shares[worker].begin = count * worker / m_Workers;
+		m_Shares[worker].end = count * (worker + 1) / m_Workers;
+	}
+
+	auto work = [this, &job](size_t worker) {
+		size_t index;
+		do {
+			while (Take(worker, index)) {
+				job(index, worker);
+			}
+		} while (Steal(worker));
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t worker = 1; worker < m_Workers; worker++) {
+		threads.emplace_back(work, worker);
+	}
+	work(0);
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+}
+
+bool Scheduler::Take(size_t worker, size_t &index) {
+	Share &share = m_Shares[worker];
+	std::lock_guard<std::mutex> guard(share.lock);
+	if (share.begin == share.end) {
+		return false;
+	}
+	index = share.begin++;
+	return true;
+}
+
+bool Scheduler::Steal(size_t worker) {
+	for (;;) {
+		size_t victim = worker, most = 0;
+		for (size_t other = 0; other < m_Workers; other++) {
+			std::lock_guard<std::mutex> guard(m_Shares[other].lock);
+			if (m_Shares[other].end - m_Shares[other].begin > most) {
+				victim = other;
+				most = m_Shares[other].end - m_Shares[other].begin;
+			}
+		}
+		if (most == 0) {
+			return false;
+		}
+
+		size_t begin, end;
+		{
+			Share &share = m_Shares[victim];
+			std::lock_guard<std::mutex> guard(share.lock);
+			if (share.begin == share.end) { // Taken meanwhile, look again.
+				continue;
+			}
+			begin = share.begin + (share.end - share.begin) / 2;
+			end = share.end;
+			share.end = begin;
+		}
+		Share &own = m_Shares[worker];
+		std::lock_guard<std::mutex> guard(own.lock);
+		own.begin = begin;
+		own.end = end;
+		return true;
+	}
+}
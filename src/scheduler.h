@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace vole {
+/// @brief Runs numbered jobs on a pool of threads with work stealing.
+///
+/// Every worker starts with an equal share of the job numbers and takes
+/// jobs from the front of its share. A worker that runs out steals the back
+/// half of the largest share left, so uneven jobs (a program that loops until
+/// its budget next to one that halts at once) keep every core busy.
+class Scheduler {
+public:
+	/// @param workers Number of threads, 0 for one per hardware thread.
+	explicit Scheduler(size_t workers = 0);
+
+	size_t Workers() const;
+
+	/// @brief Call `job(index, worker)` once for every index below `count`,
+	/// from `Workers()` threads, and return when all calls returned.
+	void Run(size_t count, const std::function<void(size_t index, size_t worker)> &job);
+
+private:
+	/// Job numbers `[begin, end)` not taken yet.
+	struct Share {
+		std::mutex lock;
+		size_t begin = 0, end = 0;
+	};
+
+	size_t m_Workers;
+	std::vector<Share> m_Shares;
+
+	bool Take(size_t worker, size_t &index);
+	bool Steal(size_t worker);
+};
+} // namespace vole
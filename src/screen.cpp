@@ -0,0 +1,93 @@
+#include <algorithm>
+
+#include "screen.h"
+
+using namespace vole;
+
+BufferedScreen::BufferedScreen(FlushPolicy policy, size_t capacity) : m_Buffer(std::max<size_t>(capacity, 1)) {
+	m_Next = m_Buffer.data();
+	m_End = m_Buffer.data() + m_Buffer.size();
+	m_FlushAfter = policy == FlushPolicy::ON_NEWLINE ? '\n' : -1;
+	m_FlushOnStop = policy != FlushPolicy::ON_FULL;
+}
+
+void BufferedScreen::clear() {
+	Flush();
+	Cleared();
+}
+
+void BufferedScreen::write(uint8_t c) { Put(c); }
+
+void BufferedScreen::Flush() {
+	size_t size = m_Next - m_Buffer.data();
+	m_Next = m_Buffer.data();
+	if (size != 0) {
+		Emit(m_Buffer.data(), size);
+	}
+}
+
+void BufferedScreen::Overflow(uint8_t c) {
+	if (m_Next == m_End) {
+		Flush();
+	}
+	*m_Next++ = c;
+	if (c == m_FlushAfter) {
+		Flush();
+	}
+}
+
+void BufferedScreen::Sync() { Flush(); }
+
+StreamScreen::StreamScreen(std::ostream &stream, FlushPolicy policy, size_t capacity)
+	: BufferedScreen(policy, capacity), m_Stream(stream) {}
+
+StreamScreen::~StreamScreen() { Flush(); }
+
+void StreamScreen::Emit(const uint8_t *data, size_t size) {
+	m_Stream.write(reinterpret_cast<const char *>(data), size);
+	m_Stream.flush();
+}
+
+void StreamScreen::Cleared() {}
+
+FileScreen::FileScreen(const std::string &path, FlushPolicy policy, size_t capacity)
+	: BufferedScreen(policy, capacity), m_File(std::fopen(path.c_str(), "wb")) {
+	if (m_File != nullptr) {
+		// Blocks are already as big as we want them.
+		std::setvbuf(m_File, nullptr, _IONBF, 0);
+	}
+}
+
+FileScreen::~FileScreen() {
+	Flush();
+	if (m_File != nullptr) {
+		std::fclose(m_File);
+	}
+}
+
+bool FileScreen::IsOpen() const { return m_File != nullptr; }
+
+void FileScreen::Emit(const uint8_t *data, size_t size) {
+	if (m_File != nullptr) {
+		std::fwrite(data, 1, size, m_File);
+	}
+}
+
+void FileScreen::Cleared() {}
+
+void NullScreen::clear() {}
+
+void NullScreen::write(uint8_t) {}
+
+MemoryScreen::MemoryScreen(FlushPolicy policy, size_t capacity) : BufferedScreen(policy, capacity) {}
+
+MemoryScreen::~MemoryScreen() { Flush(); }
+
+const std::string &MemoryScreen::Text() {
+	Flush();
+	return m_Text;
+}
+
+void MemoryScreen::Emit(const uint8_t *data, size_t size) { m_Text.append(reinterpret_cast<const char *>(data), size); }
+
+void MemoryScreen::Cleared() { m_Text.clear(); }
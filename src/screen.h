@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "vole.h"
+
+namespace vole {
+/// @brief When a BufferedScreen passes its output on.
+enum class FlushPolicy {
+	/// Only when the buffer is full or on Flush(): fewest writes, for
+	/// capturing output.
+	ON_FULL,
+	/// After every newline, and when a run of the machine stops.
+	ON_NEWLINE,
+	/// When a run of the machine stops (halted, out of budget, ...).
+	ON_HALT,
+};
+
+/// @brief A Screen that collects output in a buffer, filled by
+/// `Screen::Put()` without virtual calls, and passes it to Emit() a block at
+/// a time. The buffer is also flushed when full and before a clear.
+///
+/// Subclasses must call Flush() in their destructor, since Emit() cannot be
+/// called from this one.
+class BufferedScreen : public Screen {
+public:
+	static const size_t DEFAULT_CAPACITY = 64 * 1024;
+
+	explicit BufferedScreen(FlushPolicy policy = FlushPolicy::ON_HALT, size_t capacity = DEFAULT_CAPACITY);
+	BufferedScreen(const BufferedScreen &) = delete;
+	BufferedScreen &operator=(const BufferedScreen &) = delete;
+
+	void clear() override;
+	void write(uint8_t) override;
+
+	/// @brief Pass everything buffered to Emit().
+	void Flush();
+
+protected:
+	/// @brief Output `size` bytes.
+	virtual void Emit(const uint8_t *data, size_t size) = 0;
+	/// @brief Clear the screen. Everything before was emitted already.
+	virtual void Cleared() = 0;
+
+	void Overflow(uint8_t c) override;
+	void Sync() override;
+
+private:
+	std::vector<uint8_t> m_Buffer;
+};
+
+/// @brief Output to a `std::ostream`, such as `std::cout`, with one write
+/// and flush of the stream per block.
+class StreamScreen : public BufferedScreen {
+public:
+	explicit StreamScreen(std::ostream &, FlushPolicy policy = FlushPolicy::ON_NEWLINE,
+						  size_t capacity = DEFAULT_CAPACITY);
+	~StreamScreen() override;
+
+protected:
+	void Emit(const uint8_t *data, size_t size) override;
+	/// Does nothing.
+	void Cleared() override;
+
+	std::ostream &m_Stream;
+};
+
+/// @brief Output written to a file. Clears are not recorded.
+class FileScreen : public BufferedScreen {
+public:
+	explicit FileScreen(const std::string &path, FlushPolicy policy = FlushPolicy::ON_FULL,
+						size_t capacity = DEFAULT_CAPACITY);
+	~FileScreen() override;
+
+	/// @brief Whether the file could be opened (for writing, truncated).
+	bool IsOpen() const;
+
+protected:
+	void Emit(const uint8_t *data, size_t size) override;
+	void Cleared() override;
+
+private:
+	std::FILE *m_File;
+};
+
+/// @brief Output thrown away.
+class NullScreen : public Screen {
+public:
+	void clear() override;
+	void write(uint8_t) override;
+};
+
+/// @brief Output kept in memory.
+class MemoryScreen : public BufferedScreen {
+public:
+	explicit MemoryScreen(FlushPolicy policy = FlushPolicy::ON_FULL, size_t capacity = DEFAULT_CAPACITY);
+	~MemoryScreen() override;
+
+	/// @brief Everything written since the screen was last cleared.
+	const std::string &Text();
+
+protected:
+	void Emit(const uint8_t *data, size_t size) override;
+	void Cleared() override;
+
+private:
+	std::string m_Text;
+};
+} // namespace vole
@@ -0,0 +1,510 @@
+#include <cstring>
+
+#include "trace.h"
+
+using namespace vole;
+
+constexpr std::chrono::milliseconds TraceFile::IDLE_WAIT;
+
+namespace {
+/// Longest a record can be: a STATE, or a custom control unit writing every
+/// cell and register.
+const size_t MAX_RECORD = 4 + 2 + (Memory::SIZE + 16) * 3;
+
+void PutVarint(std::vector<uint8_t> &out, uint64_t value) {
+	while (value >= 0x80) {
+		out.push_back(static_cast<uint8_t>(value) | 0x80);
+		value >>= 7;
+	}
+	out.push_back(static_cast<uint8_t>(value));
+}
+
+bool GetVarint(const uint8_t *&p, const uint8_t *end, uint64_t &value) {
+	value = 0;
+	for (int shift = 0; shift < 64 && p != end; shift += 7) {
+		uint8_t byte = *p++;
+		value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// LZ77 in LZ4's sequence layout: a token (literal count in the high nibble,
+// match length minus MIN_MATCH in the low one, 15 meaning more follow in
+// bytes up to 255), the literals, then a 16-bit match offset. The last
+// sequence has literals only.
+const size_t MIN_MATCH = 4;
+const size_t MAX_OFFSET = 0xFFFF;
+const int HASH_BITS = 12;
+
+void PutLength(std::vector<uint8_t> &out, size_t length) {
+	for (; length >= 255; length -= 255) {
+		out.push_back(255);
+	}
+	out.push_back(static_cast<uint8_t>(length));
+}
+
+void PutSequence(std::vector<uint8_t> &out, const uint8_t *literals, size_t count, size_t offset, size_t match) {
+	size_t extra = match == 0 ? 0 : match - MIN_MATCH;
+	out.push_back(static_cast<uint8_t>(std::min<size_t>(count, 15) << 4 | std::min<size_t>(extra, 15)));
+	if (count >= 15) {
+		PutLength(out, count - 15);
+	}
+	out.insert(out.end(), literals, literals + count);
+	if (match != 0) {
+		out.push_back(static_cast<uint8_t>(offset));
+		out.push_back(static_cast<uint8_t>(offset >> 8));
+		if (extra >= 15) {
+			PutLength(out, extra - 15);
+		}
+	}
+}
+
+void Compress(const uint8_t *in, size_t size, std::vector<uint8_t> &out) {
+	// Last position each hash of 4 bytes was seen at, plus one.
+	std::vector<uint32_t> seen(size_t(1) << HASH_BITS);
+	size_t anchor = 0;
+	for (size_t i = 0; i + MIN_MATCH <= size;) {
+		uint32_t word;
+		std::memcpy(&word, in + i, sizeof word);
+		uint32_t &slot = seen[(word * 2654435761u) >> (32 - HASH_BITS)];
+		size_t candidate = slot;
+		slot = i + 1;
+		if (candidate == 0 || i - (candidate - 1) > MAX_OFFSET || std::memcmp(in + candidate - 1, in + i, 4) != 0) {
+			i++;
+			continue;
+		}
+		candidate--;
+		size_t match = MIN_MATCH;
+		while (i + match < size && in[candidate + match] == in[i + match]) {
+			match++;
+		}
+		PutSequence(out, in + anchor, i - anchor, i - candidate, match);
+		i += match;
+		anchor = i;
+	}
+	PutSequence(out, in + anchor, size - anchor, 0, 0);
+}
+
+bool GetLength(const uint8_t *&p, const uint8_t *end, size_t &length) {
+	uint8_t byte;
+	do {
+		if (p == end) {
+			return false;
+		}
+		byte = *p++;
+		length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+bool Decompress(const uint8_t *p, const uint8_t *end, std::vector<uint8_t> &out, size_t size) {
+	out.clear();
+	out.reserve(size);
+	while (p != end) {
+		uint8_t token = *p++;
+		size_t count = token >> 4;
+		if (count == 15 && !GetLength(p, end, count)) {
+			return false;
+		}
+		if (static_cast<size_t>(end - p) < count || out.size() + count > size) {
+			return false;
+		}
+		out.insert(out.end(), p, p + count);
+		p += count;
+		if (p == end) {
+			break;
+		}
+		if (end - p < 2) {
+			return false;
+		}
+		size_t offset = p[0] | p[1] << 8;
+		p += 2;
+		size_t match = token & 0x0F;
+		if (match == 15 && !GetLength(p, end, match)) {
+			return false;
+		}
+		match += MIN_MATCH;
+		if (offset == 0 || offset > out.size() || out.size() + match > size) {
+			return false;
+		}
+		// Byte by byte: the match may overlap what it copies.
+		for (size_t from = out.size() - offset; match > 0; match--) {
+			out.push_back(out[from++]);
+		}
+	}
+	return out.size() == size;
+}
+} // namespace
+
+TraceFile::TraceFile(const std::string &path)
+	: m_File(std::fopen(path.c_str(), "wb")), m_Enqueue(0), m_Dequeue(0), m_Streams(0), m_Quit(false) {
+	for (size_t i = 0; i < QUEUE_SIZE; i++) {
+		m_Queue[i].sequence.store(i, std::memory_order_relaxed);
+		m_Queue[i].chunk = nullptr;
+	}
+	if (m_File == nullptr) {
+		return;
+	}
+	std::fwrite(trace::MAGIC, 1, sizeof trace::MAGIC, m_File);
+	std::fputc(trace::VERSION, m_File);
+	m_Writer = std::thread([this] {
+		for (;;) {
+			Chunk *chunk = Pop();
+			if (chunk != nullptr) {
+				std::fwrite(chunk->data(), 1, chunk->size(), m_File);
+				delete chunk;
+			} else if (m_Quit.load(std::memory_order_acquire)) {
+				// Everything pushed before the quit is in the queue now.
+				while ((chunk = Pop()) != nullptr) {
+					std::fwrite(chunk->data(), 1, chunk->size(), m_File);
+					delete chunk;
+				}
+				return;
+			} else {
+				std::this_thread::sleep_for(IDLE_WAIT);
+			}
+		}
+	});
+}
+
+TraceFile::~TraceFile() {
+	if (m_File == nullptr) {
+		return;
+	}
+	m_Quit.store(true, std::memory_order_release);
+	m_Writer.join();
+	std::fclose(m_File);
+}
+
+bool TraceFile::IsOpen() const { return m_File != nullptr; }
+
+void TraceFile::Push(Chunk *chunk) {
+	if (m_File == nullptr) {
+		delete chunk;
+		return;
+	}
+	size_t position = m_Enqueue.load(std::memory_order_relaxed);
+	Slot *slot;
+	for (;;) {
+		slot = &m_Queue[position & (QUEUE_SIZE - 1)];
+		size_t sequence = slot->sequence.load(std::memory_order_acquire);
+		if (sequence == position) {
+			if (m_Enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+				break;
+			}
+		} else if (sequence < position) {
+			// Full: the writer has yet to take the slot's last chunk.
+			std::this_thread::yield();
+			position = m_Enqueue.load(std::memory_order_relaxed);
+		} else {
+			position = m_Enqueue.load(std::memory_order_relaxed);
+		}
+	}
+	slot->chunk = chunk;
+	slot->sequence.store(position + 1, std::memory_order_release);
+}
+
+TraceFile::Chunk *TraceFile::Pop() {
+	Slot &slot = m_Queue[m_Dequeue & (QUEUE_SIZE - 1)];
+	if (slot.sequence.load(std::memory_order_acquire) != m_Dequeue + 1) {
+		return nullptr;
+	}
+	Chunk *chunk = slot.chunk;
+	slot.sequence.store(m_Dequeue + QUEUE_SIZE, std::memory_order_release);
+	m_Dequeue++;
+	return chunk;
+}
+
+uint32_t TraceFile::NewStream() { return m_Streams.fetch_add(1, std::memory_order_relaxed); }
+
+Tracer::Tracer(Machine &mac, TraceFile &file, const std::string &name)
+	: m_Machine(mac), m_File(file), m_Stream(file.NewStream()), m_BlockRecords(0), m_Records(0) {
+	m_Block.reserve(trace::BLOCK_SIZE);
+	Frame(trace::START, std::vector<uint8_t>(name.begin(), name.end()));
+	RecordState();
+	m_Machine.m_Tracer = this;
+}
+
+Tracer::~Tracer() {
+	m_Machine.m_Tracer = nullptr;
+	// So the stream ends in the state the machine is left in.
+	Fetching();
+	if (m_Machine.reg.pc != m_ExpectedPC) {
+		RecordState();
+	}
+	Flush();
+	std::vector<uint8_t> payload;
+	PutVarint(payload, m_Records);
+	Frame(trace::END, payload);
+}
+
+uint64_t Tracer::Records() const { return m_Records; }
+
+void Tracer::Fetching() {
+	if (m_Machine.mem.Generation() != m_MemoryGeneration || m_Machine.reg.Generation() != m_RegisterGeneration) {
+		RecordState();
+	}
+}
+
+void Tracer::Retired(uint8_t pc, const Instruction &ins, int written) {
+	Reserve();
+	size_t header = m_Block.size();
+	uint8_t flags = 0;
+	m_Block.push_back(0);
+	if (pc != m_ExpectedPC) {
+		flags |= trace::EXPLICIT_PC;
+		m_Block.push_back(pc);
+	}
+	m_Block.push_back(ins.inst >> 8);
+	m_Block.push_back(ins.inst & 0xFF);
+
+	const Memory &mem = m_Machine.mem;
+	const Registers &reg = m_Machine.reg;
+	if (written == ANYWHERE) {
+		// Whatever got a newer generation than the last record saw.
+		flags |= trace::WRITES_MANY;
+		std::vector<uint8_t> writes;
+		size_t count = 0;
+		for (size_t cell = 0; cell < Memory::SIZE; cell++) {
+			if (mem.CellGeneration(cell) > m_MemoryGeneration) {
+				PutVarint(writes, cell);
+				writes.push_back(mem.Read(cell));
+				count++;
+			}
+		}
+		for (uint8_t r = 0; r < 16; r++) {
+			if (reg.Generation(r) > m_RegisterGeneration) {
+				PutVarint(writes, Memory::SIZE + r);
+				writes.push_back(reg.Read(r));
+				count++;
+			}
+		}
+		PutVarint(m_Block, count);
+		m_Block.insert(m_Block.end(), writes.begin(), writes.end());
+	} else if (written >= static_cast<int>(Memory::SIZE)) {
+		uint8_t r = written - Memory::SIZE;
+		flags |= trace::WRITES_REGISTER | r << trace::REGISTER_SHIFT;
+		m_Block.push_back(reg.Read(r));
+	} else if (written >= 0) {
+		flags |= trace::WRITES_CELL;
+		m_Block.push_back(written);
+		m_Block.push_back(mem.Read(written));
+	}
+	m_Block[header] = flags;
+
+	m_ExpectedPC = pc + 2;
+	m_BlockRecords++;
+	m_Records++;
+	Synced();
+}
+
+void Tracer::RecordState() {
+	Reserve();
+	Machine::State state = m_Machine.Snapshot();
+	m_Block.push_back(trace::STATE);
+	m_Block.insert(m_Block.end(), state.mem.begin(), state.mem.end());
+	m_Block.insert(m_Block.end(), state.reg.begin(), state.reg.end());
+	m_Block.push_back(state.pc);
+	m_ExpectedPC = state.pc;
+	Synced();
+}
+
+void Tracer::Synced() {
+	m_MemoryGeneration = m_Machine.mem.Generation();
+	m_RegisterGeneration = m_Machine.reg.Generation();
+}
+
+void Tracer::Reserve() {
+	if (m_Block.size() + MAX_RECORD > trace::BLOCK_SIZE) {
+		Flush();
+	}
+}
+
+void Tracer::Flush() {
+	if (m_Block.empty()) {
+		return;
+	}
+	std::vector<uint8_t> payload;
+	PutVarint(payload, m_BlockRecords);
+	PutVarint(payload, m_Block.size());
+	Compress(m_Block.data(), m_Block.size(), payload);
+	Frame(trace::BLOCK, payload);
+	m_Block.clear();
+	m_BlockRecords = 0;
+}
+
+void Tracer::Frame(trace::Frame type, const std::vector<uint8_t> &payload) {
+	TraceFile::Chunk *chunk = new TraceFile::Chunk;
+	chunk->reserve(payload.size() + 16);
+	chunk->push_back(type);
+	PutVarint(*chunk, m_Stream);
+	PutVarint(*chunk, payload.size());
+	chunk->insert(chunk->end(), payload.begin(), payload.end());
+	m_File.Push(chunk);
+}
+
+TraceReader::TraceReader(const std::string &path)
+	: m_File(std::fopen(path.c_str(), "rb")), m_BlockAt(0), m_BlockStream(0), m_CompressedBytes(0), m_RawBytes(0) {
+	if (m_File == nullptr) {
+		Fail("cannot open for reading");
+		return;
+	}
+	char magic[sizeof trace::MAGIC];
+	if (std::fread(magic, 1, sizeof magic, m_File) != sizeof magic ||
+		std::memcmp(magic, trace::MAGIC, sizeof magic) != 0) {
+		Fail("not a trace file");
+	} else if (std::fgetc(m_File) != trace::VERSION) {
+		Fail("unsupported trace version");
+	}
+}
+
+TraceReader::~TraceReader() {
+	if (m_File != nullptr) {
+		std::fclose(m_File);
+	}
+}
+
+bool TraceReader::Next(TraceEvent &event) {
+	if (!m_Error.empty()) {
+		return false;
+	}
+	if (m_BlockAt < m_Block.size()) {
+		return ReadRecord(event);
+	}
+	return ReadFrame(event);
+}
+
+const std::string &TraceReader::Error() const { return m_Error; }
+
+uint64_t TraceReader::CompressedBytes() const { return m_CompressedBytes; }
+
+uint64_t TraceReader::RawBytes() const { return m_RawBytes; }
+
+bool TraceReader::Fail(const std::string &error) {
+	m_Error = error;
+	return false;
+}
+
+bool TraceReader::ReadFrame(TraceEvent &event) {
+	int type = std::fgetc(m_File);
+	if (type == EOF) {
+		return false;
+	}
+	// The stream and size varints, read a byte at a time.
+	uint64_t header[2];
+	for (uint64_t &value : header) {
+		uint8_t bytes[10];
+		size_t count = 0;
+		int byte;
+		do {
+			byte = std::fgetc(m_File);
+			if (byte == EOF || count == sizeof bytes) {
+				return Fail("truncated frame");
+			}
+			bytes[count++] = byte;
+		} while (byte & 0x80);
+		const uint8_t *p = bytes;
+		GetVarint(p, bytes + count, value);
+	}
+	event.stream = header[0];
+	m_Payload.resize(header[1]);
+	if (std::fread(m_Payload.data(), 1, m_Payload.size(), m_File) != m_Payload.size()) {
+		return Fail("truncated frame");
+	}
+	if (event.stream >= m_ExpectedPC.size()) {
+		m_ExpectedPC.resize(event.stream + 1);
+	}
+
+	const uint8_t *p = m_Payload.data(), *end = p + m_Payload.size();
+	uint64_t records, rawSize;
+	switch (type) {
+	case trace::START:
+		event.type = TraceEvent::Type::START;
+		event.name.assign(p, end);
+		return true;
+	case trace::END:
+		event.type = TraceEvent::Type::END;
+		if (!GetVarint(p, end, event.records)) {
+			return Fail("bad end frame");
+		}
+		return true;
+	case trace::BLOCK:
+		if (!GetVarint(p, end, records) || !GetVarint(p, end, rawSize) || rawSize > trace::BLOCK_SIZE ||
+			!Decompress(p, end, m_Block, rawSize)) {
+			return Fail("corrupt block");
+		}
+		m_CompressedBytes += end - p;
+		m_RawBytes += rawSize;
+		m_BlockAt = 0;
+		m_BlockStream = event.stream;
+		return Next(event);
+	default:
+		return Fail("unknown frame type");
+	}
+}
+
+bool TraceReader::ReadRecord(TraceEvent &event) {
+	const uint8_t *p = m_Block.data() + m_BlockAt, *end = m_Block.data() + m_Block.size();
+	uint8_t &expected = m_ExpectedPC[m_BlockStream];
+	event.stream = m_BlockStream;
+	uint8_t flags = *p++;
+	if (flags & trace::STATE) {
+		const size_t size = Memory::SIZE + 16 + 1;
+		if (static_cast<size_t>(end - p) < size) {
+			return Fail("truncated record");
+		}
+		event.type = TraceEvent::Type::STATE;
+		std::memcpy(event.state.mem.data(), p, Memory::SIZE);
+		std::memcpy(event.state.reg.data(), p + Memory::SIZE, 16);
+		event.state.pc = p[Memory::SIZE + 16];
+		expected = event.state.pc;
+		m_BlockAt = p + size - m_Block.data();
+		return true;
+	}
+
+	event.type = TraceEvent::Type::INSTRUCTION;
+	event.writes.clear();
+	size_t fixed = (flags & trace::EXPLICIT_PC ? 1 : 0) + 2;
+	if (static_cast<size_t>(end - p) < fixed) {
+		return Fail("truncated record");
+	}
+	event.pc = flags & trace::EXPLICIT_PC ? *p++ : expected;
+	event.high = *p++;
+	event.low = *p++;
+	event.custom = (flags & trace::WRITES) == trace::WRITES_MANY;
+	uint64_t count, location;
+	switch (flags & trace::WRITES) {
+	case trace::WRITES_NONE:
+		break;
+	case trace::WRITES_REGISTER:
+		if (p == end) {
+			return Fail("truncated record");
+		}
+		event.writes.push_back({static_cast<uint16_t>(Memory::SIZE + (flags >> trace::REGISTER_SHIFT)), *p++});
+		break;
+	case trace::WRITES_CELL:
+		if (end - p < 2) {
+			return Fail("truncated record");
+		}
+		event.writes.push_back({p[0], p[1]});
+		p += 2;
+		break;
+	case trace::WRITES_MANY:
+		if (!GetVarint(p, end, count)) {
+			return Fail("truncated record");
+		}
+		for (; count > 0; count--) {
+			if (!GetVarint(p, end, location) || location >= Memory::SIZE + 16 || p == end) {
+				return Fail("bad write in record");
+			}
+			event.writes.push_back({static_cast<uint16_t>(location), *p++});
+		}
+		break;
+	}
+	expected = event.pc + 2;
+	m_BlockAt = p - m_Block.data();
+	return true;
+}
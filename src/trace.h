@@ -0,0 +1,227 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vole.h"
+
+namespace vole {
+/// Execution traces are files of frames, each belonging to a stream (one
+/// machine run). A stream starts with a START frame holding its name, has
+/// BLOCK frames of compressed records and ends with an END frame:
+///
+///     file   = "VOLETRC" version:u8 frame*
+///     frame  = type:u8 stream:varint size:varint payload[size]
+///     START  = name[size]
+///     BLOCK  = records:varint rawSize:varint compressed
+///     END    = records:varint
+///
+/// Varints are LEB128, and blocks are compressed with a small LZ77 (LZ4's
+/// sequence layout). A record is an instruction that retired, or a full state
+/// the following ones continue from:
+///
+///     record = header:u8 [pc:u8] high:u8 low:u8 write*
+///            | header:u8 mem[256] reg[16] pc:u8          (header & STATE)
+///
+/// The PC is only given when it is not the previous record's plus 2. A
+/// REGISTER write is the value written (the register is in the header), a
+/// CELL write the cell and value, MANY a varint count of locations (cells,
+/// then 256 plus a register) as varints, each followed by its value.
+namespace trace {
+const char MAGIC[7] = {'V', 'O', 'L', 'E', 'T', 'R', 'C'};
+const uint8_t VERSION = 1;
+
+enum Frame : uint8_t {
+	START = 1,
+	BLOCK = 2,
+	END = 3,
+};
+
+/// Record header bits.
+enum Header : uint8_t {
+	WRITES = 0x03,
+	WRITES_NONE = 0x00,
+	WRITES_REGISTER = 0x01,
+	WRITES_CELL = 0x02,
+	WRITES_MANY = 0x03,
+	EXPLICIT_PC = 0x04,
+	STATE = 0x08,
+	/// Register a WRITES_REGISTER record writes, in the high nibble.
+	REGISTER_SHIFT = 4,
+};
+
+/// Most raw record bytes in a block.
+const size_t BLOCK_SIZE = 64 * 1024;
+} // namespace trace
+
+/// @brief A trace file being written. Streams hand it finished frames
+/// through a lock-free queue, and a thread of its own writes them out, so
+/// machines never wait for the disk unless it falls far behind.
+class TraceFile {
+public:
+	/// @brief Create (truncate) `path`. See IsOpen().
+	explicit TraceFile(const std::string &path);
+	TraceFile(const TraceFile &) = delete;
+	TraceFile &operator=(const TraceFile &) = delete;
+	/// Writes everything queued and closes the file. Every Tracer writing to
+	/// it must be gone.
+	~TraceFile();
+
+	bool IsOpen() const;
+
+private:
+	friend class Tracer;
+
+	typedef std::vector<uint8_t> Chunk;
+
+	/// A slot of the queue: bounded, many producers (Vyukov's), one consumer.
+	struct Slot {
+		std::atomic<size_t> sequence;
+		Chunk *chunk;
+	};
+	static const size_t QUEUE_SIZE = 256;
+	/// Longest the writer sleeps when there is nothing to write.
+	static constexpr std::chrono::milliseconds IDLE_WAIT{1};
+
+	std::FILE *m_File;
+	std::array<Slot, QUEUE_SIZE> m_Queue;
+	alignas(64) std::atomic<size_t> m_Enqueue;
+	alignas(64) size_t m_Dequeue;
+	std::atomic<uint32_t> m_Streams;
+	std::atomic<bool> m_Quit;
+	std::thread m_Writer;
+
+	/// @brief Queue a frame to be written, waiting while the queue is full.
+	void Push(Chunk *);
+	/// Writer only. `nullptr` when the queue is empty.
+	Chunk *Pop();
+	uint32_t NewStream();
+};
+
+/// @brief Records every instruction a machine retires (through
+/// `Machine::Step()` or `Machine::RunFor()`, which then takes its
+/// per-instruction path) as a stream of a TraceFile.
+///
+/// The stream starts with the machine's state. Changes made other than by
+/// instructions (editing, loading, undoing) are noticed before the next
+/// instruction through the memory's and registers' generations, and the
+/// whole state is recorded again. Blocks are compressed on the machine's
+/// thread, so machines tracing in parallel compress in parallel.
+class Tracer {
+public:
+	/// @brief Start a stream named `name` in `file` and attach to `mac`. A
+	/// machine records to at most one tracer at a time.
+	Tracer(Machine &mac, TraceFile &file, const std::string &name);
+	Tracer(const Tracer &) = delete;
+	Tracer &operator=(const Tracer &) = delete;
+	/// Detaches and ends the stream.
+	~Tracer();
+
+	/// @brief Instructions recorded.
+	uint64_t Records() const;
+
+private:
+	friend class Machine;
+
+	/// `written` of Retired() for a custom control unit.
+	static const int ANYWHERE = -2;
+
+	Machine &m_Machine;
+	TraceFile &m_File;
+	uint32_t m_Stream;
+	std::vector<uint8_t> m_Block;
+	uint64_t m_BlockRecords;
+	uint64_t m_Records;
+	/// Memory and register generations after the last record.
+	uint64_t m_MemoryGeneration, m_RegisterGeneration;
+	/// PC a record does not need to give.
+	uint8_t m_ExpectedPC;
+
+	/// Called by the machine before it fetches an instruction.
+	void Fetching();
+	/// Called by the machine after it executed `ins` from `pc`.
+	/// @param written What `Machine::Written()` says, or ANYWHERE.
+	void Retired(uint8_t pc, const Instruction &ins, int written);
+	void RecordState();
+	void Synced();
+	/// Make room for a record, passing the block on if full.
+	void Reserve();
+	void Flush();
+	void Frame(trace::Frame, const std::vector<uint8_t> &payload);
+};
+
+/// @brief A write a traced instruction made.
+struct TraceWrite {
+	/// A cell, or `Memory::SIZE` plus a register.
+	uint16_t location;
+	uint8_t value;
+};
+
+/// @brief What TraceReader::Next() read.
+struct TraceEvent {
+	enum class Type {
+		/// A stream started; `name` is set.
+		START,
+		/// The stream continues from `state`: its first event after START, and
+		/// again after changes made from outside.
+		STATE,
+		/// An instruction retired: `pc`, `high`, `low` and `writes` are set.
+		INSTRUCTION,
+		/// The stream ended after `records` instructions.
+		END,
+	} type;
+	uint32_t stream;
+	std::string name;
+	Machine::State state;
+	uint8_t pc, high, low;
+	/// A custom control unit ran the instruction. Its `writes` are all it
+	/// changed, found by comparing generations; builtin ones write at most one.
+	bool custom;
+	std::vector<TraceWrite> writes;
+	uint64_t records;
+};
+
+/// @brief Reads a trace file event by event, in the order written. Streams
+/// of parallel runs are interleaved.
+class TraceReader {
+public:
+	/// @brief Open `path`. See Error().
+	explicit TraceReader(const std::string &path);
+	TraceReader(const TraceReader &) = delete;
+	TraceReader &operator=(const TraceReader &) = delete;
+	~TraceReader();
+
+	/// @brief Read the next event. `false` at the end of the file or on an
+	/// error.
+	bool Next(TraceEvent &);
+	/// @brief What went wrong, empty if nothing did.
+	const std::string &Error() const;
+
+	/// @brief Bytes of compressed and of raw records read so far.
+	uint64_t CompressedBytes() const;
+	uint64_t RawBytes() const;
+
+private:
+	std::FILE *m_File;
+	std::string m_Error;
+	std::vector<uint8_t> m_Payload;
+	/// The block being read, of stream `m_BlockStream`.
+	std::vector<uint8_t> m_Block;
+	size_t m_BlockAt;
+	uint32_t m_BlockStream;
+	/// PC the next record of each stream does not need to give.
+	std::vector<uint8_t> m_ExpectedPC;
+	uint64_t m_CompressedBytes, m_RawBytes;
+
+	bool Fail(const std::string &);
+	bool ReadFrame(TraceEvent &);
+	bool ReadRecord(TraceEvent &);
+};
+} // namespace vole
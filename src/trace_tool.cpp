@@ -0,0 +1,217 @@
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "dump.h"
+#include "screen.h"
+#include "trace.h"
+#include "vole.h"
+
+void usage() {
+	std::cerr << "usage: vole-trace COMMAND FILE\n"
+			  << "Read a trace written by `vole-sim --trace` or `vole-batch --trace`.\n"
+			  << "\n"
+			  << "  dump    print every record, disassembled\n"
+			  << "  stats   count the records of every stream and show how well they compressed\n"
+			  << "  replay  run every stream again from its states, check each instruction writes\n"
+			  << "          what the trace says and print the final states. Instructions of\n"
+			  << "          custom control units are not run; their writes are applied\n";
+}
+
+/// Print `state` as `pc=.. reg=.. mem=..` and a newline.
+void printState(const vole::Machine::State &state) {
+	char line[vole::dump::MAX_SIZE + 1];
+	char *end = vole::dump::State(state, vole::dump::Format::HEX, line);
+	*end++ = '\n';
+	std::fwrite(line, 1, end - line, stdout);
+}
+
+void printWrite(const vole::TraceWrite &write) {
+	if (write.location >= vole::Memory::SIZE) {
+		std::printf(" R%d=%02X", static_cast<int>(write.location - vole::Memory::SIZE), write.value);
+	} else {
+		std::printf(" [%02X]=%02X", write.location, write.value);
+	}
+}
+
+int dump(vole::TraceReader &reader) {
+	vole::TraceEvent event;
+	while (reader.Next(event)) {
+		switch (event.type) {
+		case vole::TraceEvent::Type::START:
+			std::printf("%u start %s\n", event.stream, event.name.c_str());
+			break;
+		case vole::TraceEvent::Type::STATE:
+			std::printf("%u state ", event.stream);
+			printState(event.state);
+			break;
+		case vole::TraceEvent::Type::INSTRUCTION: {
+			char instruction[32];
+			vole::Disassembler::FormatInstruction(vole::Disassembler::Decode(event.high, event.low), instruction,
+												  sizeof instruction);
+			std::printf("%u %02X: %02X%02X  %-18s", event.stream, event.pc, event.high, event.low, instruction);
+			for (const vole::TraceWrite &write : event.writes) {
+				printWrite(write);
+			}
+			std::printf("\n");
+			break;
+		}
+		case vole::TraceEvent::Type::END:
+			std::printf("%u end after %llu instructions\n", event.stream, (unsigned long long)event.records);
+			break;
+		}
+	}
+	return 0;
+}
+
+int stats(vole::TraceReader &reader) {
+	struct Stream {
+		std::string name;
+		uint64_t instructions = 0, states = 0;
+		bool ended = false;
+	};
+	std::map<uint32_t, Stream> streams;
+	vole::TraceEvent event;
+	while (reader.Next(event)) {
+		Stream &stream = streams[event.stream];
+		switch (event.type) {
+		case vole::TraceEvent::Type::START:
+			stream.name = event.name;
+			break;
+		case vole::TraceEvent::Type::STATE:
+			stream.states++;
+			break;
+		case vole::TraceEvent::Type::INSTRUCTION:
+			stream.instructions++;
+			break;
+		case vole::TraceEvent::Type::END:
+			stream.ended = true;
+			break;
+		}
+	}
+	uint64_t instructions = 0;
+	for (const auto &entry : streams) {
+		const Stream &stream = entry.second;
+		std::printf("%u %s: %llu instructions, %llu states%s\n", entry.first, stream.name.c_str(),
+					(unsigned long long)stream.instructions, (unsigned long long)stream.states,
+					stream.ended ? "" : " (not ended)");
+		instructions += stream.instructions;
+	}
+	double raw = reader.RawBytes(), compressed = reader.CompressedBytes();
+	std::printf("%zu streams, %llu instructions, %llu raw bytes, %llu compressed (%.1fx, %.2f bytes per "
+				"instruction)\n",
+				streams.size(), (unsigned long long)instructions, (unsigned long long)reader.RawBytes(),
+				(unsigned long long)reader.CompressedBytes(), compressed == 0 ? 0 : raw / compressed,
+				instructions == 0 ? 0 : compressed / instructions);
+	return 0;
+}
+
+int replay(vole::TraceReader &reader) {
+	struct Stream {
+		std::string name;
+		std::unique_ptr<vole::Machine> machine;
+		uint64_t instructions = 0, mismatches = 0;
+	};
+	vole::NullScreen screen;
+	std::map<uint32_t, Stream> streams;
+	uint64_t mismatches = 0;
+	vole::TraceEvent event;
+	while (reader.Next(event)) {
+		Stream &stream = streams[event.stream];
+		if (!stream.machine) {
+			stream.machine.reset(new vole::Machine(&screen));
+		}
+		vole::Machine &mac = *stream.machine;
+		switch (event.type) {
+		case vole::TraceEvent::Type::START:
+			stream.name = event.name;
+			break;
+		case vole::TraceEvent::Type::STATE:
+			mac.Restore(event.state);
+			break;
+		case vole::TraceEvent::Type::INSTRUCTION: {
+			stream.instructions++;
+			mac.reg.pc = event.pc;
+			if (mac.mem.Read(event.pc) != event.high || mac.mem.Read(event.pc + 1) != event.low) {
+				std::printf("%u %s: %02X: the trace ran %02X%02X, memory holds %02X%02X\n", event.stream,
+							stream.name.c_str(), event.pc, event.high, event.low, mac.mem.Read(event.pc),
+							mac.mem.Read(event.pc + 1));
+				stream.mismatches++;
+				mismatches++;
+			}
+			if (!event.custom) {
+				mac.Step();
+			}
+			for (const vole::TraceWrite &write : event.writes) {
+				bool isRegister = write.location >= vole::Memory::SIZE;
+				uint8_t at = isRegister ? write.location - vole::Memory::SIZE : write.location;
+				uint8_t value = isRegister ? mac.reg.Read(at) : mac.mem.Read(at);
+				if (value == write.value) {
+					continue;
+				}
+				// A custom control unit's writes are taken as they are.
+				if (!event.custom) {
+					std::printf("%u %s: %02X: %02X%02X wrote %s%02X=%02X, the trace says %02X\n", event.stream,
+								stream.name.c_str(), event.pc, event.high, event.low, isRegister ? "R" : "M", at, value,
+								write.value);
+					stream.mismatches++;
+					mismatches++;
+				}
+				if (isRegister) {
+					mac.reg.Write(at, write.value);
+				} else {
+					mac.mem.Write(at, write.value);
+				}
+			}
+			if (event.custom) {
+				// Where it went is in the next record, if it jumped.
+				mac.reg.pc = event.pc + 2;
+			}
+			break;
+		}
+		case vole::TraceEvent::Type::END: {
+			vole::Machine::State state = mac.Snapshot();
+			std::printf("%u %s: %llu instructions, %llu mismatches, ", event.stream, stream.name.c_str(),
+						(unsigned long long)stream.instructions, (unsigned long long)stream.mismatches);
+			printState(state);
+			if (event.records != stream.instructions) {
+				std::printf("%u %s: the stream says it has %llu instructions\n", event.stream, stream.name.c_str(),
+							(unsigned long long)event.records);
+				mismatches++;
+			}
+			stream.machine.reset();
+			break;
+		}
+		}
+	}
+	return mismatches == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc != 3) {
+		usage();
+		return 2;
+	}
+	std::string command = argv[1];
+	int (*run)(vole::TraceReader &);
+	if (command == "dump") {
+		run = dump;
+	} else if (command == "stats") {
+		run = stats;
+	} else if (command == "replay") {
+		run = replay;
+	} else {
+		usage();
+		return 2;
+	}
+
+	vole::TraceReader reader(argv[2]);
+	int status = reader.Error().empty() ? run(reader) : 1;
+	if (!reader.Error().empty()) {
+		std::cerr << "vole-trace: " << argv[2] << ": " << reader.Error() << ".\n";
+		return 1;
+	}
+	return status;
+}
@@ -1,10 +1,22 @@
-#include <cmath>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
 #include <sstream>
+#include <typeinfo>
+#include <utility>
 
 #include "error.h"
+#include "history.h"
+#include "loader.h"
+#include "profile.h"
+#include "screen.h"
+#include "trace.h"
 #include "vole.h"
 
 using namespace vole;
@@ -12,33 +24,194 @@ using namespace vole;
 #define OS_HEX1 std::hex << std::uppercase
 #define OS_HEX2 std::hex << std::uppercase << std::setfill('0') << std::setw(2)
 
-Machine::Machine(Screen *screen, const std::array<ControlUnitBuilder, 16> cuFactory)
-	: controlUnitFactory(cuFactory), scr(screen) {}
+template <typename T> static bool BuildsA(const ControlUnit *cu) { return typeid(*cu) == typeid(T); }
 
-error::LoadProgramError Machine::LoadProgram(const std::string &path, uint8_t addr) {
-	std::ifstream ifs(path);
-	if (!ifs.is_open()) {
+namespace {
+/// Passes Stores to cell 00 to the machine's screen, whichever it is at the
+/// time.
+class ScreenDevice : public Device {
+public:
+	void Store(Machine &mac, uint8_t, uint8_t value) override {
+		if (mac.scr == nullptr) {
+			return;
+		} else if (value != 0) {
+			mac.scr->Put(value);
+		} else {
+			mac.scr->clear();
+		}
+	}
+};
+
+ScreenDevice screenDevice;
+} // namespace
+
+static const std::pair<InstructionHandler, Mnemonic> BUILTIN_MNEMONICS[] = {
+	{&Nothing::Apply, Mnemonic::NOTHING}, {&Load1::Apply, Mnemonic::LOAD1},	  {&Load2::Apply, Mnemonic::LOAD2},
+	{&Store::Apply, Mnemonic::STORE},	  {&Move::Apply, Mnemonic::MOVE},	  {&Add1::Apply, Mnemonic::ADD1},
+	{&Add2::Apply, Mnemonic::ADD2},		  {&Or::Apply, Mnemonic::OR},		  {&And::Apply, Mnemonic::AND},
+	{&Xor::Apply, Mnemonic::XOR},		  {&Rotate::Apply, Mnemonic::ROTATE}, {&Jump::Apply, Mnemonic::JUMP},
+	{&Halt::Apply, Mnemonic::HALT},		  {&Unused::Apply, Mnemonic::UNUSED},
+};
+
+ControlUnitFactory::ControlUnitFactory(const std::array<ControlUnitBuilder, 16> &builders)
+	: m_Builders(std::make_shared<const std::array<ControlUnitBuilder, 16>>(builders)) {}
+
+const ControlUnitFactory &ControlUnitFactory::Default() {
+	static const ControlUnitFactory factory(DefaultControlUnitFactory);
+	return factory;
+}
+
+const ControlUnitBuilder &ControlUnitFactory::operator[](uint8_t opcode) const { return (*m_Builders)[opcode]; }
+
+Machine::Machine(Screen *screen, const ControlUnitFactory &cuFactory)
+	: controlUnitFactory(cuFactory), scr(screen), m_Decoded(), m_Loops(), m_History(nullptr), m_Tracer(nullptr), m_Profiler(nullptr) {
+	// Build each control unit once to find out which ones we can run
+	// natively; only custom control units pay for a heap allocation per step.
+	for (size_t opcode = 0; opcode < m_Handlers.size(); opcode++) {
+		std::unique_ptr<ControlUnit> cu(controlUnitFactory[opcode](this, 0));
+		InstructionHandler handler = &Machine::ExecuteControlUnit;
+		if (BuildsA<Nothing>(cu.get()))
+			handler = &Nothing::Apply;
+		else if (BuildsA<Load1>(cu.get()))
+			handler = &Load1::Apply;
+		else if (BuildsA<Load2>(cu.get()))
+			handler = &Load2::Apply;
+		else if (BuildsA<Store>(cu.get()))
+			handler = &Store::Apply;
+		else if (BuildsA<Move>(cu.get()))
+			handler = &Move::Apply;
+		else if (BuildsA<Add1>(cu.get()))
+			handler = &Add1::Apply;
+		else if (BuildsA<Add2>(cu.get()))
+			handler = &Add2::Apply;
+		else if (BuildsA<Or>(cu.get()))
+			handler = &Or::Apply;
+		else if (BuildsA<And>(cu.get()))
+			handler = &And::Apply;
+		else if (BuildsA<Xor>(cu.get()))
+			handler = &Xor::Apply;
+		else if (BuildsA<Rotate>(cu.get()))
+			handler = &Rotate::Apply;
+		else if (BuildsA<Jump>(cu.get()))
+			handler = &Jump::Apply;
+		else if (BuildsA<Halt>(cu.get()))
+			handler = &Halt::Apply;
+		else if (BuildsA<Unused>(cu.get()))
+			handler = &Unused::Apply;
+		m_Handlers[opcode] = handler;
+		m_Mnemonics[opcode] = Mnemonic::CUSTOM;
+		for (const auto &builtin : BUILTIN_MNEMONICS) {
+			if (handler == builtin.first) {
+				m_Mnemonics[opcode] = builtin.second;
+			}
+		}
+	}
+	bus.Map(&screenDevice, 0x00, 0x00, Bus::STORE);
+}
+
+error::LoadProgramError Machine::LoadProgram(const std::string &path, uint8_t at, error::Location *where) {
+	MappedFile file(path);
+	if (!file.IsOpen()) {
 		return error::LoadProgramError::FILE_OPEN_FAILED;
 	}
-	return LoadProgram(ifs, addr);
+	if (image::IsImage(file.Data(), file.Size())) {
+		return LoadImage(file.Data(), file.Size(), where);
+	}
+	return LoadProgram(reinterpret_cast<const char *>(file.Data()), file.Size(), at, where);
+}
+
+error::LoadProgramError Machine::LoadProgram(std::istream &stream, uint8_t at, error::Location *where) {
+	std::string text(std::istreambuf_iterator<char>(stream), {});
+	if (stream.bad()) {
+		return error::LoadProgramError::STREAM_READ_FAILED;
+	}
+	return LoadProgram(text.data(), text.size(), at, where);
 }
 
-error::LoadProgramError Machine::LoadProgram(std::istream &stream, uint8_t addr) {
-	uint16_t inst;
-	for (size_t i = addr; !stream.eof(); i += 2) {
-		if (i >= 2 * 128) {
-			return error::LoadProgramError::TOO_MUCH_INSTRUCTIONS;
+error::LoadProgramError Machine::LoadProgram(const char *text, size_t size, uint8_t at, error::Location *where) {
+	// Parsed aside first, so a bad program leaves the machine as it was.
+	ProgramImage program;
+	error::LoadProgramError err = ParseProgram(text, size, at, program, where);
+	if (err == error::LoadProgramError::NOT_AN_ERROR) {
+		LoadProgram(program);
+	}
+	return err;
+}
+
+void Machine::LoadProgram(const ProgramImage &program) {
+	// One write per run of given cells.
+	for (size_t cell = 0; cell < Memory::SIZE;) {
+		uint64_t given = program.cells[cell / 64] >> (cell % 64);
+		if (given == 0) {
+			cell = (cell / 64 + 1) * 64;
+			continue;
 		}
-		stream >> std::hex >> inst;
-		if (stream.fail()) {
-			return error::LoadProgramError::STREAM_READ_FAILED;
+		cell += CountTrailingZeros(given);
+		size_t end = cell;
+		while (end < Memory::SIZE) {
+			size_t shift = end % 64;
+			// Bits shifted in count as not given.
+			uint64_t missing = ~(program.cells[end / 64] >> shift);
+			size_t run = missing == 0 ? 64 : CountTrailingZeros(missing);
+			end += run;
+			if (shift + run < 64) {
+				break;
+			}
 		}
-		mem[i] = inst >> 8;
-		mem[i + 1] = inst & 0x00FF;
+		mem.Write(cell, &program.mem[cell], end - cell);
+		cell = end;
+	}
+	for (uint8_t r = 0; r < 16; r++) {
+		if ((program.registers >> r) & 1) {
+			reg.Write(r, program.reg[r]);
+		}
+	}
+	if (program.hasEntry) {
+		reg.pc = program.entry;
+	}
+}
+
+error::LoadProgramError Machine::LoadImage(const uint8_t *data, size_t size, error::Location *where) {
+	image::Header header;
+	error::LoadProgramError err = image::ReadHeader(data, size, header, where);
+	if (err != error::LoadProgramError::NOT_AN_ERROR) {
+		return err;
+	}
+	// Straight from the file to memory.
+	size_t offset = image::ContentsOffset(header);
+	for (size_t i = 0; i < header.segments; i++) {
+		image::Segment segment = image::ReadSegment(data, header, i);
+		mem.Write(segment.at, data + offset, segment.size);
+		offset += segment.size;
+	}
+	for (uint8_t r = 0; r < 16; r++) {
+		if ((header.registers >> r) & 1) {
+			reg.Write(r, header.reg[r]);
+		}
+	}
+	if (header.hasEntry) {
+		reg.pc = header.entry;
 	}
 	return error::LoadProgramError::NOT_AN_ERROR;
 }
 
+bool Machine::SaveImage(const std::string &path) const {
+	ProgramImage program;
+	for (size_t cell = 0; cell < Memory::SIZE; cell++) {
+		program.Set(cell, mem.Read(cell));
+	}
+	for (uint8_t r = 0; r < 16; r++) {
+		program.reg[r] = reg.Read(r);
+	}
+	program.registers = 0xFFFF;
+	program.entry = reg.pc;
+	program.hasEntry = true;
+	std::vector<uint8_t> bytes = image::Encode(program);
+	std::ofstream ofs(path, std::ios::binary);
+	ofs.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+	return ofs.good();
+}
+
 void Machine::Reset() {
 	reg.Reset(); // CPU
 	mem.Reset(); // RAM
@@ -48,38 +221,603 @@ void Machine::Run() {
 	do {
 		// Doin' what? nothing...
 	} while (Step() != ShouldHalt::YES);
+	if (scr != nullptr) {
+		scr->Stopped();
+	}
+}
+
+void Machine::RunThreaded() {
+	StopReason reason;
+	do {
+		reason = RunFor(std::numeric_limits<uint64_t>::max()).reason;
+	} while (reason == StopReason::BUDGET_EXHAUSTED || reason == StopReason::BREAKPOINT);
+}
+
+RunResult Machine::RunFor(uint64_t maxInstructions) {
+	RunResult result = Advance(maxInstructions);
+	if (scr != nullptr) {
+		scr->Stopped();
+	}
+	return result;
+}
+
+RunResult Machine::Advance(uint64_t maxInstructions) {
+	// Most instructions the threaded loop runs between two budget checks.
+	const uint64_t slack = Memory::SIZE / 2;
+	RunResult result = {StopReason::BUDGET_EXHAUSTED, 0};
+	// A device answering loads could make a repeated state go elsewhere.
+	bool detectLoops = m_Loops.enabled && !bus.HasLoads();
+	if (detectLoops && m_Loops.hash != StateHash()) {
+		// Changed from outside since the last run, which makes the states
+		// seen so far useless.
+		StartLoopDetection();
+	}
+	if (m_Breakpoints.none() && !detectLoops && !Observed() && maxInstructions > slack &&
+		RunThreadedUntil(maxInstructions - slack, result) == ShouldHalt::YES) {
+		return result;
+	}
+	// Close to the budget, stopping at breakpoints, detecting loops, recording,
+	// tracing or profiling: check every instruction.
+	while (result.retired < maxInstructions) {
+		if (result.retired != 0 && m_Breakpoints[reg.pc]) {
+			result.reason = StopReason::BREAKPOINT;
+			return result;
+		}
+		if (m_Tracer != nullptr) {
+			m_Tracer->Fetching();
+		}
+		uint8_t at = reg.pc;
+		Instruction unaligned;
+		InstructionHandler handler;
+		const Instruction &ins = Fetch(unaligned, handler);
+		result.retired++;
+		if (m_History != nullptr) {
+			Record(handler, ins);
+		}
+		bool looping = false;
+		ShouldHalt halt = detectLoops ? ExecuteDetectingLoops(handler, ins, looping) : handler(this, ins);
+		if (m_Tracer != nullptr) {
+			Trace(at, handler, ins);
+		}
+		if (m_Profiler != nullptr) {
+			m_Profiler->Executed(at, ins, handler == &Jump::Apply);
+		}
+		if (halt == ShouldHalt::YES) {
+			result.reason = HaltReason(handler);
+			return result;
+		}
+		if (looping) {
+			result.reason = StopReason::LOOP_DETECTED;
+			return result;
+		}
+	}
+	return result;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+ShouldHalt Machine::RunThreadedUntil(uint64_t limit, RunResult &result) {
+	// Builtin handlers get their own label, so `Apply` is inlined and each
+	// one dispatches the next instruction with its own indirect jump.
+	const std::pair<InstructionHandler, void *> builtins[] = {
+		{&Nothing::Apply, &&nothing}, {&Load1::Apply, &&load1},	  {&Load2::Apply, &&load2}, {&Store::Apply, &&store},
+		{&Move::Apply, &&move},		  {&Add1::Apply, &&add1},	  {&Add2::Apply, &&add2},	{&Or::Apply, &&or_},
+		{&And::Apply, &&and_},		  {&Xor::Apply, &&xor_},	  {&Rotate::Apply, &&rotate}, {&Jump::Apply, &&jump},
+		{&Halt::Apply, &&halt},		  {&Unused::Apply, &&unused},
+	};
+	void *labels[16];
+	for (size_t opcode = 0; opcode < 16; opcode++) {
+		labels[opcode] = &&handler;
+		for (const auto &builtin : builtins) {
+			if (m_Handlers[opcode] == builtin.first) {
+				labels[opcode] = builtin.second;
+			}
+		}
+	}
+
+	const Instruction *ins;
+	Instruction unaligned;
+
+	// The budget is only checked after a Jump and before the instruction at
+	// FE or at an odd PC. Straight-line code reaches FE within 128
+	// instructions, and the check shares its branch with the (rare) unaligned
+	// fetch instead of costing one per instruction.
+#define DISPATCH()                                                                                                     \
+	do {                                                                                                               \
+		uint8_t at = reg.pc;                                                                                           \
+		if (at % 2 == 0 && at != 0xFE) {                                                                               \
+			ins = &Decoded(at >> 1).ins;                                                                               \
+		} else {                                                                                                       \
+			if (result.retired >= limit) {                                                                             \
+				return ShouldHalt::NO;                                                                                 \
+			}                                                                                                          \
+			unaligned = Instruction(mem.Read(at), mem.Read(at + 1));                                                   \
+			ins = &unaligned;                                                                                          \
+		}                                                                                                              \
+		reg.pc += 2;                                                                                                   \
+		result.retired++;                                                                                              \
+		goto *labels[ins->opcode];                                                                                     \
+	} while (0)
+
+	DISPATCH();
+nothing:
+	DISPATCH();
+load1:
+	Load1::Apply(this, *ins);
+	DISPATCH();
+load2:
+	Load2::Apply(this, *ins);
+	DISPATCH();
+store:
+	Store::Apply(this, *ins);
+	DISPATCH();
+move:
+	Move::Apply(this, *ins);
+	DISPATCH();
+add1:
+	Add1::Apply(this, *ins);
+	DISPATCH();
+add2:
+	Add2::Apply(this, *ins);
+	DISPATCH();
+or_:
+	Or::Apply(this, *ins);
+	DISPATCH();
+and_:
+	And::Apply(this, *ins);
+	DISPATCH();
+xor_:
+	Xor::Apply(this, *ins);
+	DISPATCH();
+rotate:
+	Rotate::Apply(this, *ins);
+	DISPATCH();
+jump:
+	Jump::Apply(this, *ins);
+	if (result.retired >= limit) {
+		return ShouldHalt::NO;
+	}
+	DISPATCH();
+handler:
+	if (m_Handlers[ins->opcode](this, *ins) == ShouldHalt::YES) {
+		result.reason = StopReason::HALTED;
+		return ShouldHalt::YES;
+	}
+	if (result.retired >= limit) {
+		return ShouldHalt::NO;
+	}
+	DISPATCH();
+halt:
+	result.reason = StopReason::HALTED;
+	return ShouldHalt::YES;
+unused:
+	result.reason = StopReason::UNUSED_OPCODE;
+	return ShouldHalt::YES;
+
+#undef DISPATCH
+}
+#else
+ShouldHalt Machine::RunThreadedUntil(uint64_t limit, RunResult &result) {
+	while (result.retired < limit) {
+		Instruction unaligned;
+		InstructionHandler handler;
+		const Instruction &ins = Fetch(unaligned, handler);
+		result.retired++;
+		if (handler(this, ins) == ShouldHalt::YES) {
+			result.reason = HaltReason(handler);
+			return ShouldHalt::YES;
+		}
+	}
+	return ShouldHalt::NO;
 }
+#endif
+
+void Machine::SetBreakpoint(uint8_t at, bool enabled) { m_Breakpoints[at] = enabled; }
+
+bool Machine::HasBreakpoint(uint8_t at) const { return m_Breakpoints[at]; }
 
 ShouldHalt Machine::Step() {
-	ControlUnit *cu = ControlUnit::Decode(this);
-	ShouldHalt shouldHalt = cu->Execute();
-	delete cu;
-	return shouldHalt;
+	if (Observed()) {
+		return StepObserved();
+	}
+	Instruction unaligned;
+	InstructionHandler handler;
+	const Instruction &ins = Fetch(unaligned, handler);
+	return handler(this, ins);
+}
+
+ShouldHalt Machine::StepObserved() {
+	if (m_Tracer != nullptr) {
+		m_Tracer->Fetching();
+	}
+	uint8_t at = reg.pc;
+	Instruction unaligned;
+	InstructionHandler handler;
+	const Instruction &ins = Fetch(unaligned, handler);
+	if (m_History != nullptr) {
+		Record(handler, ins);
+	}
+	ShouldHalt halt = handler(this, ins);
+	if (m_Tracer != nullptr) {
+		Trace(at, handler, ins);
+	}
+	if (m_Profiler != nullptr) {
+		m_Profiler->Executed(at, ins, handler == &Jump::Apply);
+	}
+	return halt;
+}
+
+const Instruction &Machine::Fetch(Instruction &unaligned, InstructionHandler &handler) {
+	uint8_t at = reg.pc;
+	reg.pc += 2;
+	if (at % 2 != 0) { // Not on an instruction word, nothing cached for it.
+		unaligned = Instruction(mem.Read(at), mem.Read(at + 1));
+		handler = m_Handlers[unaligned.opcode];
+		return unaligned;
+	}
+	const DecodedSlot &slot = Decoded(at >> 1);
+	handler = slot.handler;
+	return slot.ins;
+}
+
+StopReason Machine::HaltReason(InstructionHandler handler) {
+	return handler == &Unused::Apply ? StopReason::UNUSED_OPCODE : StopReason::HALTED;
+}
+
+int Machine::Written(InstructionHandler handler, const Instruction &ins) {
+	if (handler == &Store::Apply) {
+		return ins.operandXY;
+	} else if (handler == &Move::Apply) {
+		return Memory::SIZE + ins.operand3;
+	} else if (handler == &Load1::Apply || handler == &Load2::Apply || handler == &Add1::Apply ||
+			   handler == &Add2::Apply || handler == &Or::Apply || handler == &And::Apply || handler == &Xor::Apply ||
+			   handler == &Rotate::Apply) {
+		return Memory::SIZE + ins.operand1;
+	}
+	return -1;
+}
+
+void Machine::Record(InstructionHandler handler, const Instruction &ins) {
+	// Fetch() already moved past the instruction.
+	UndoRecord record = {UndoRecord::Kind::PC, static_cast<uint8_t>(reg.pc - 2), 0, 0};
+	int written = Written(handler, ins);
+	if (handler == &ExecuteControlUnit) {
+		record.kind = UndoRecord::Kind::STATE;
+	} else if (written >= static_cast<int>(Memory::SIZE)) {
+		record.kind = UndoRecord::Kind::REGISTER;
+		record.at = written - Memory::SIZE;
+		record.old = reg.Read(record.at);
+	} else if (written >= 0) {
+		record.kind = UndoRecord::Kind::CELL;
+		record.at = written;
+		record.old = mem.Read(record.at);
+	}
+	m_History->Push(record);
+}
+
+void Machine::Trace(uint8_t pc, InstructionHandler handler, const Instruction &ins) {
+	m_Tracer->Retired(pc, ins, handler == &ExecuteControlUnit ? Tracer::ANYWHERE : Written(handler, ins));
+}
+
+namespace {
+/// Zobrist locations: memory cells first, then registers, then the PC.
+const uint16_t REGISTER_LOCATION = Memory::SIZE;
+const uint16_t PC_LOCATION = REGISTER_LOCATION + 16;
+
+/// Pseudo-random key of `value` at `location`. Computed (splitmix64's
+/// finalizer) instead of looked up in a 70 KiB table of random numbers.
+uint64_t Zobrist(uint16_t location, uint8_t value) {
+	uint64_t z = ((static_cast<uint64_t>(location) << 8 | value) + 1) * 0x9E3779B97F4A7C15ull;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+} // namespace
+
+void Machine::DetectLoops(bool enabled) {
+	m_Loops.enabled = enabled;
+	if (enabled) {
+		StartLoopDetection();
+	}
+}
+
+bool Machine::DetectsLoops() const { return m_Loops.enabled; }
+
+const Loop &Machine::DetectedLoop() const { return m_Loops.found; }
+
+Machine::State Machine::Snapshot() const {
+	State state;
+	for (size_t cell = 0; cell < Memory::SIZE; cell++) {
+		state.mem[cell] = mem.Read(cell);
+	}
+	for (uint8_t r = 0; r < 16; r++) {
+		state.reg[r] = reg.Read(r);
+	}
+	state.pc = reg.pc;
+	return state;
+}
+
+void Machine::Restore(const State &state) {
+	for (size_t cell = 0; cell < Memory::SIZE; cell++) {
+		if (mem.Read(cell) != state.mem[cell]) {
+			mem.Write(cell, state.mem[cell]);
+		}
+	}
+	for (uint8_t r = 0; r < 16; r++) {
+		if (reg.Read(r) != state.reg[r]) {
+			reg.Write(r, state.reg[r]);
+		}
+	}
+	reg.pc = state.pc;
+}
+
+Machine Machine::Fork() const {
+	Machine fork = *this;
+	fork.m_History = nullptr;
+	fork.m_Tracer = nullptr;
+	fork.m_Profiler = nullptr;
+	return fork;
+}
+
+uint64_t Machine::StateHash() const {
+	uint64_t hash = Zobrist(PC_LOCATION, reg.pc);
+	for (size_t cell = 0; cell < Memory::SIZE; cell++) {
+		hash ^= Zobrist(cell, mem[cell]);
+	}
+	for (uint8_t r = 0; r < 16; r++) {
+		hash ^= Zobrist(REGISTER_LOCATION + r, reg[r]);
+	}
+	return hash;
+}
+
+void Machine::StartLoopDetection() {
+	m_Loops.hash = StateHash();
+	m_Loops.start = Snapshot();
+	m_Loops.tortoise = m_Loops.start;
+	m_Loops.tortoiseHash = m_Loops.hash;
+	m_Loops.power = 1;
+	m_Loops.lambda = 1;
+}
+
+static bool SameState(const Machine &a, const Machine &b) {
+	if (a.reg.pc != b.reg.pc) {
+		return false;
+	}
+	for (uint8_t r = 0; r < 16; r++) {
+		if (a.reg[r] != b.reg[r]) {
+			return false;
+		}
+	}
+	for (size_t cell = 0; cell < Memory::SIZE; cell++) {
+		if (a.mem[cell] != b.mem[cell]) {
+			return false;
+		}
+	}
+	return true;
 }
 
-Memory::Memory() : m_Array() {}
+ShouldHalt Machine::ExecuteDetectingLoops(InstructionHandler handler, const Instruction &ins, bool &looping) {
+	// Besides the PC, a builtin instruction writes at most one location.
+	int written = Written(handler, ins);
+	auto value = [this](int location) {
+		return location < REGISTER_LOCATION ? mem.Read(location) : reg.Read(location - REGISTER_LOCATION);
+	};
 
-void Memory::Reset() { m_Array.fill(0); }
+	uint8_t from = reg.pc - 2; // Fetch() already moved past the instruction.
+	uint8_t before = written >= 0 ? value(written) : 0;
+	ShouldHalt halt = handler(this, ins);
+	if (halt == ShouldHalt::YES) {
+		return halt;
+	}
+	if (handler == &ExecuteControlUnit) { // Could have written anything.
+		m_Loops.hash = StateHash();
+	} else {
+		m_Loops.hash ^= Zobrist(PC_LOCATION, from) ^ Zobrist(PC_LOCATION, reg.pc);
+		if (written >= 0) {
+			m_Loops.hash ^= Zobrist(written, before) ^ Zobrist(written, value(written));
+		}
+	}
 
-uint8_t &Memory::operator[](uint8_t idx) { return m_Array[idx]; }
+	// Brent: compare against the state saved at the last power of two, and
+	// save a new one each time `lambda` reaches it. A matching hash is only
+	// a candidate until the full states compare equal.
+	if (m_Loops.hash == m_Loops.tortoiseHash) {
+		State now = Snapshot();
+		const State &then = m_Loops.tortoise;
+		if (now.pc == then.pc && now.reg == then.reg && now.mem == then.mem) {
+			m_Loops.found.period = m_Loops.lambda;
+			m_Loops.found.entry = FindLoopEntry(m_Loops.lambda);
+			StartLoopDetection();
+			looping = true;
+			return halt;
+		}
+	}
+	if (m_Loops.power == m_Loops.lambda) {
+		m_Loops.tortoise = Snapshot();
+		m_Loops.tortoiseHash = m_Loops.hash;
+		m_Loops.power *= 2;
+		m_Loops.lambda = 0;
+	}
+	m_Loops.lambda++;
+	return halt;
+}
+
+uint8_t Machine::FindLoopEntry(uint64_t period) const {
+	// A machine `period` instructions ahead of another first meets it at the
+	// start of the cycle.
+	NullScreen screen;
+	Machine lead = Fork(), trail = Fork();
+	lead.scr = trail.scr = &screen;
+	// Replayed instructions must not reach the devices.
+	Bus replay;
+	replay.Map(&screenDevice, 0x00, 0x00, Bus::STORE);
+	lead.bus = trail.bus = replay;
+	lead.Restore(m_Loops.start);
+	trail.Restore(m_Loops.start);
+	for (uint64_t i = 0; i < period; i++) {
+		lead.Step();
+	}
+	while (!SameState(lead, trail)) {
+		lead.Step();
+		trail.Step();
+	}
+	return trail.reg.pc;
+}
+
+const Machine::DecodedSlot &Machine::Decoded(uint8_t slot) {
+	DecodedSlot &decoded = m_Decoded[slot];
+	uint64_t generation = mem.SlotGeneration(slot);
+	if (decoded.generation != generation) {
+		decoded.ins = Instruction(mem.Read(2 * slot), mem.Read(2 * slot + 1));
+		decoded.handler = m_Handlers[decoded.ins.opcode];
+		decoded.generation = generation;
+	}
+	return decoded;
+}
+
+ShouldHalt Machine::ExecuteControlUnit(Machine *mac, const Instruction &ins) {
+	// `Step()` has already moved past the instruction.
+	std::unique_ptr<ControlUnit> cu(mac->controlUnitFactory[ins.opcode](mac, mac->reg.pc - 2));
+	return cu->Execute();
+}
+
+Memory::Memory() : m_Array(), m_Generation(1), m_Dirty(), m_Written() {
+	m_SlotGeneration.fill(m_Generation);
+	m_CellGeneration.fill(m_Generation);
+}
+
+void Memory::Reset() {
+	for (size_t word = 0; word < m_Written.size(); word++) {
+		for (uint64_t bits = m_Written[word]; bits != 0; bits &= bits - 1) {
+			uint8_t cell = word * 64 + CountTrailingZeros(bits);
+			m_Array[cell] = 0;
+			Touch(cell);
+		}
+	}
+	m_Written = {};
+}
+
+uint8_t &Memory::operator[](uint8_t idx) {
+	Touch(idx);
+	return m_Array[idx];
+}
 
 uint8_t Memory::operator[](uint8_t idx) const { return m_Array[idx]; }
 
-std::array<uint8_t, Memory::SIZE> *Memory::Array() { return &m_Array; }
+std::array<uint8_t, Memory::SIZE> *Memory::Array() {
+	TouchAll();
+	return &m_Array;
+}
+
+uint8_t Memory::Read(uint8_t idx) const { return m_Array[idx]; }
+
+void Memory::Write(uint8_t idx, uint8_t val) {
+	m_Array[idx] = val;
+	Touch(idx);
+}
+
+void Memory::Write(uint8_t at, const uint8_t *values, size_t count) {
+	if (count > SIZE) {
+		// Only the last SIZE values stay.
+		at += count - SIZE;
+		values += count - SIZE;
+		count = SIZE;
+	}
+	size_t first = std::min(count, SIZE - at);
+	std::memcpy(&m_Array[at], values, first);
+	std::memcpy(&m_Array[0], values + first, count - first);
+	// One generation for all: readers only compare generations.
+	uint64_t generation = ++m_Generation;
+	TouchRange(at, first, generation);
+	TouchRange(0, count - first, generation);
+}
+
+uint64_t Memory::SlotGeneration(uint8_t slot) const { return m_SlotGeneration[slot]; }
+
+uint64_t Memory::CellGeneration(uint8_t cell) const { return m_CellGeneration[cell]; }
+
+uint64_t Memory::Generation() const { return m_Generation; }
+
+const CellMask &Memory::Dirty() const { return m_Dirty; }
+
+bool Memory::IsDirty(uint8_t cell) const { return (m_Dirty[cell / 64] >> (cell % 64)) & 1; }
+
+void Memory::ClearDirty() { m_Dirty = {}; }
+
+void Memory::Touch(uint8_t idx) {
+	uint64_t generation = ++m_Generation;
+	m_CellGeneration[idx] = generation;
+	m_SlotGeneration[idx >> 1] = generation;
+	m_Dirty[idx / 64] |= uint64_t(1) << (idx % 64);
+	m_Written[idx / 64] |= uint64_t(1) << (idx % 64);
+}
+
+void Memory::TouchRange(size_t from, size_t count, uint64_t generation) {
+	if (count == 0) {
+		return;
+	}
+	size_t to = from + count;
+	std::fill(m_CellGeneration.begin() + from, m_CellGeneration.begin() + to, generation);
+	std::fill(m_SlotGeneration.begin() + from / 2, m_SlotGeneration.begin() + (to + 1) / 2, generation);
+	for (size_t word = from / 64; word * 64 < to; word++) {
+		size_t low = std::max(from, word * 64) % 64, high = std::min(to, word * 64 + 64) - word * 64;
+		uint64_t bits = (high - low == 64 ? ~uint64_t(0) : (uint64_t(1) << (high - low)) - 1) << low;
+		m_Dirty[word] |= bits;
+		m_Written[word] |= bits;
+	}
+}
+
+void Memory::TouchAll() {
+	uint64_t generation = ++m_Generation;
+	m_CellGeneration.fill(generation);
+	m_SlotGeneration.fill(generation);
+	m_Dirty.fill(~uint64_t(0));
+	m_Written.fill(~uint64_t(0));
+}
 
-Registers::Registers() : pc(0), m_Array() {}
+Registers::Registers() : pc(0), m_Array(), m_Generation(1), m_Dirty(0) { m_Generations.fill(m_Generation); }
 
-void Registers::Reset() { m_Array.fill(0); }
+void Registers::Reset() {
+	m_Array.fill(0);
+	m_Generations.fill(++m_Generation);
+	m_Dirty = 0xFFFF;
+}
 
-uint8_t &Registers::operator[](uint8_t i) { return m_Array[i]; }
+uint8_t &Registers::operator[](uint8_t i) {
+	m_Generations[i] = ++m_Generation;
+	m_Dirty |= 1 << i;
+	return m_Array[i];
+}
 
 uint8_t Registers::operator[](uint8_t i) const { return m_Array[i]; }
 
+uint8_t Registers::Read(uint8_t i) const { return m_Array[i]; }
+
+void Registers::Write(uint8_t i, uint8_t val) {
+	m_Array[i] = val;
+	m_Generations[i] = ++m_Generation;
+	m_Dirty |= 1 << i;
+}
+
+uint64_t Registers::Generation(uint8_t i) const { return m_Generations[i]; }
+
+uint64_t Registers::Generation() const { return m_Generation; }
+
+uint16_t Registers::Dirty() const { return m_Dirty; }
+
+void Registers::ClearDirty() { m_Dirty = 0; }
+
+Instruction::Instruction(uint16_t inst)
+	: inst(inst), opcode(inst >> 12), operand1((inst >> 8) & 0x0F), operand2((inst >> 4) & 0x0F), operand3(inst & 0x0F),
+	  operandXY(inst & 0xFF) {}
+
+Instruction::Instruction(uint8_t high, uint8_t low) : Instruction(static_cast<uint16_t>((high << 8) | low)) {}
+
 ControlUnit::ControlUnit(Machine *machine) : ControlUnit(machine, machine->reg.pc) {}
 
 ControlUnit::ControlUnit(Machine *machine, uint8_t at) : mac(machine) {
-	inst = mac->mem[at];
-	inst = (inst << 8) | mac->mem[at + 1];
+	inst = mac->mem.Read(at);
+	inst = (inst << 8) | mac->mem.Read(at + 1);
 	opcode = inst >> 12;
 	operand1 = (inst >> 8) & 0x0F;
 	operand2 = (inst >> 4) & 0x00F;
@@ -94,201 +832,455 @@ ControlUnit *ControlUnit::Decode(Machine *mac) {
 }
 
 ControlUnit *ControlUnit::Decode(Machine *mac, uint8_t at) {
-	uint8_t opcode = mac->mem[at] >> 4;
-	auto controlUnitBuilder = mac->controlUnitFactory[opcode];
+	uint8_t opcode = mac->mem.Read(at) >> 4;
+	const ControlUnitBuilder &controlUnitBuilder = mac->controlUnitFactory[opcode];
 	auto cu = controlUnitBuilder(mac, at);
 	return cu;
 }
 
-ShouldHalt Nothing::Execute() { return ShouldHalt::NO; }
-
-std::string Nothing::Humanize() {
-	std::ostringstream os;
-	return os.str();
+/// English note of a builtin control unit's instruction.
+static std::string Note(const Disassembly &dis) {
+	char note[80];
+	size_t length = Disassembler::FormatNote(dis, note, sizeof note);
+	return std::string(note, std::min(length, sizeof note - 1));
 }
 
-ShouldHalt Load1::Execute() {
-	uint8_t r = operand1;
-	uint16_t xy = operandXY;
-	mac->reg[r] = mac->mem[xy];
+ShouldHalt Nothing::Apply(Machine *, const Instruction &) { return ShouldHalt::NO; }
+
+ShouldHalt Nothing::Execute() { return Apply(mac, Instruction(inst)); }
+
+std::string Nothing::Humanize() { return Note(Disassembler::Decode(Instruction(inst), Mnemonic::NOTHING)); }
+
+// Device accesses are tail calls out of Load1 and Store, which then need no
+// stack frame for ordinary cells.
+#if defined(__GNUC__) || defined(__clang__)
+#define DEVICE_ACCESS __attribute__((noinline, cold))
+#else
+#define DEVICE_ACCESS
+#endif
+
+DEVICE_ACCESS static ShouldHalt LoadFromDevice(Machine *mac, uint8_t r, uint8_t xy) {
+	mac->reg.Write(r, mac->bus.Load(*mac, xy));
 	return ShouldHalt::NO;
 }
 
-std::string Load1::Humanize() {
-	std::ostringstream os;
-	os << "Copy bits at cell " << OS_HEX2 << operandXY << " to register " << OS_HEX1 << operand1;
-	return os.str();
+DEVICE_ACCESS static ShouldHalt StoreToDevice(Machine *mac, uint8_t xy, uint8_t val) {
+	mac->bus.Store(*mac, xy, val);
+	return ShouldHalt::NO;
 }
 
-ShouldHalt Load2::Execute() {
-	uint8_t r = operand1;
-	uint16_t xy = operandXY;
-	mac->reg[r] = xy;
+ShouldHalt Load1::Apply(Machine *mac, const Instruction &ins) {
+	uint8_t r = ins.operand1;
+	uint16_t xy = ins.operandXY;
+	if (mac->bus.Attribute(xy) & Bus::LOAD) {
+		return LoadFromDevice(mac, r, xy);
+	}
+	mac->reg.Write(r, mac->mem.Read(xy));
 	return ShouldHalt::NO;
 }
 
-std::string Load2::Humanize() {
-	std::ostringstream os;
-	os << "Copy bit-string " << OS_HEX2 << operandXY << " to register " << OS_HEX1 << operand1;
-	return os.str();
+ShouldHalt Load1::Execute() { return Apply(mac, Instruction(inst)); }
+
+std::string Load1::Humanize() { return Note(Disassembler::Decode(Instruction(inst), Mnemonic::LOAD1)); }
+
+ShouldHalt Load2::Apply(Machine *mac, const Instruction &ins) {
+	uint8_t r = ins.operand1;
+	uint16_t xy = ins.operandXY;
+	mac->reg.Write(r, xy);
+	return ShouldHalt::NO;
 }
 
-ShouldHalt Store::Execute() {
-	uint8_t r = operand1;
-	uint16_t xy = operandXY;
-	uint8_t val = mac->reg[r];
-	mac->mem[xy] = val;
-	if (xy == 0x00) {
-		if (val != 0) {
-			mac->scr->write(val);
-		} else {
-			mac->scr->clear();
-		}
+ShouldHalt Load2::Execute() { return Apply(mac, Instruction(inst)); }
+
+std::string Load2::Humanize() { return Note(Disassembler::Decode(Instruction(inst), Mnemonic::LOAD2)); }
+
+ShouldHalt Store::Apply(Machine *mac, const Instruction &ins) {
+	uint8_t r = ins.operand1;
+	uint16_t xy = ins.operandXY;
+	uint8_t val = mac->reg.Read(r);
+	mac->mem.Write(xy, val);
+	if (mac->bus.Attribute(xy) & Bus::STORE) {
+		return StoreToDevice(mac, xy, val);
 	}
 	return ShouldHalt::NO;
 }
 
-std::string Store::Humanize() {
-	std::ostringstream os;
-	os << "Copy bits in register " << OS_HEX1 << operand1 << " to cell " << OS_HEX2 << operandXY;
-	return os.str();
+ShouldHalt Store::Execute() { return Apply(mac, Instruction(inst)); }
+
+std::string Store::Humanize() { return Note(Disassembler::Decode(Instruction(inst), Mnemonic::STORE)); }
+
+ShouldHalt Move::Apply(Machine *mac, const Instruction &ins) {
+	uint8_t r = ins.operand2;
+	uint8_t s = ins.operand3;
+	mac->reg.Write(s, mac->reg.Read(r));
+	return ShouldHalt::NO;
 }
 
-ShouldHalt Move::Execute() {
-	uint8_t r = operand2;
-	uint8_t s = operand3;
-	mac->reg[s] = mac->reg[r];
+ShouldHalt Move::Execute() { return Apply(mac, Instruction(inst)); }
+
+std::string Move::Humanize() { return Note(Disassembler::Decode(Instruction(inst), Mnemonic::MOVE)); }
+
+ShouldHalt Add1::Apply(Machine *mac, const Instruction &ins) {
+	uint8_t r = ins.operand1;
+	uint8_t s = ins.operand2;
+	uint8_t t = ins.operand3;
+	mac->reg.Write(r, mac->reg.Read(s) + mac->reg.Read(t));
 	return ShouldHalt::NO;
 }
 
-std::string Move::Humanize() {
-	std::ostringstream os;
-	os << "Copy bits in register " << OS_HEX1 << operand2 << " to register " << OS_HEX1 << operand3;
-	return os.str();
+ShouldHalt Add1::Execute() { return Apply(mac, Instruction(inst)); }
+
+std::string Add1::Humanize() { return Note(Disassembler::Decode(Instruction(inst), Mnemonic::ADD1)); }
+
+ShouldHalt Add2::Apply(Machine *mac, const Instruction &ins) {
+	uint8_t r = ins.operand1;
+	uint8_t s = ins.operand2;
+	uint8_t t = ins.operand3;
+	mac->reg.Write(r, Float::Add(mac->reg.Read(s), mac->reg.Read(t)));
+	return ShouldHalt::NO;
 }
 
-ShouldHalt Add1::Execute() {
-	uint8_t r = operand1;
-	uint8_t s = operand2;
-	uint8_t t = operand3;
-	mac->reg[r] = mac->reg[s] + mac->reg[t];
+ShouldHalt Add2::Execute() { return Apply(mac, Instruction(inst)); }
+
+std::string Add2::Humanize() { return Note(Disassembler::Decode(Instruction(inst), Mnemonic::ADD2)); }
+
+ShouldHalt Or::Apply(Machine *mac, const Instruction &ins) {
+	uint8_t r = ins.operand1;
+	uint8_t s = ins.operand2;
+	uint8_t t = ins.operand3;
+	mac->reg.Write(r, mac->reg.Read(s) | mac->reg.Read(t));
 	return ShouldHalt::NO;
 }
 
-std::string Add1::Humanize() {
-	std::ostringstream os;
-	os << "Add bits in registers " << OS_HEX1 << operand2 << " and " << OS_HEX1 << operand3
-	   << " (two's-complement), put in " << OS_HEX1 << operand1;
-	return os.str();
+ShouldHalt Or::Execute() { return Apply(mac, Instruction(inst)); }
+
+std::string Or::Humanize() { return Note(Disassembler::Decode(Instruction(inst), Mnemonic::OR)); }
+
+ShouldHalt And::Apply(Machine *mac, const Instruction &ins) {
+	uint8_t r = ins.operand1;
+	uint8_t s = ins.operand2;
+	uint8_t t = ins.operand3;
+	mac->reg.Write(r, mac->reg.Read(s) & mac->reg.Read(t));
+	return ShouldHalt::NO;
 }
 
-ShouldHalt Add2::Execute() {
-	uint8_t r = operand1;
-	uint8_t s = operand2;
-	uint8_t t = operand3;
-	mac->reg[r] = Float::Encode(Float::Decode(mac->reg[s]) + Float::Decode(mac->reg[t]));
+ShouldHalt And::Execute() { return Apply(mac, Instruction(inst)); }
+
+std::string And::Humanize() { return Note(Disassembler::Decode(Instruction(inst), Mnemonic::AND)); }
+
+ShouldHalt Xor::Apply(Machine *mac, const Instruction &ins) {
+	uint8_t r = ins.operand1;
+	uint8_t s = ins.operand2;
+	uint8_t t = ins.operand3;
+	mac->reg.Write(r, mac->reg.Read(s) ^ mac->reg.Read(t));
 	return ShouldHalt::NO;
 }
 
-std::string Add2::Humanize() {
-	std::ostringstream os;
-	os << "Add bits in register " << OS_HEX1 << operand2 << " and " << OS_HEX1 << operand3 << " (float), put in "
-	   << OS_HEX1 << operand1;
-	return os.str();
+ShouldHalt Xor::Execute() { return Apply(mac, Instruction(inst)); }
+
+std::string Xor::Humanize() { return Note(Disassembler::Decode(Instruction(inst), Mnemonic::XOR)); }
+
+ShouldHalt Rotate::Apply(Machine *mac, const Instruction &ins) {
+	uint8_t r = ins.operand1;
+	uint8_t t = ins.operand3 % 8;
+	mac->reg.Write(r, (mac->reg.Read(r) >> t) | (mac->reg.Read(r) << (8 - t)));
+	return ShouldHalt::NO;
 }
 
-ShouldHalt Or::Execute() {
-	uint8_t r = operand1;
-	uint8_t s = operand2;
-	uint8_t t = operand3;
-	mac->reg[r] = mac->reg[s] | mac->reg[t];
+ShouldHalt Rotate::Execute() { return Apply(mac, Instruction(inst)); }
+
+std::string Rotate::Humanize() { return Note(Disassembler::Decode(Instruction(inst), Mnemonic::ROTATE)); }
+
+ShouldHalt Jump::Apply(Machine *mac, const Instruction &ins) {
+	uint8_t r = ins.operand1;
+	uint16_t xy = ins.operandXY;
+	if (xy % 2 != 0) // Not a full instruction at `xy`.
+		xy--;
+	if (mac->reg.Read(r) == mac->reg.Read(0))
+		mac->reg.pc = xy;
 	return ShouldHalt::NO;
 }
 
-std::string Or::Humanize() {
-	std::ostringstream os;
-	os << "Bitwise OR bits in register " << OS_HEX1 << operand2 << " and " << OS_HEX1 << operand3 << ", put in "
-	   << OS_HEX1 << operand1;
-	return os.str();
+ShouldHalt Jump::Execute() { return Apply(mac, Instruction(inst)); }
+
+std::string Jump::Humanize() { return Note(Disassembler::Decode(Instruction(inst), Mnemonic::JUMP)); }
+
+ShouldHalt Halt::Apply(Machine *, const Instruction &) { return ShouldHalt::YES; }
+
+ShouldHalt Halt::Execute() { return Apply(mac, Instruction(inst)); }
+
+std::string Halt::Humanize() { return Note(Disassembler::Decode(Instruction(inst), Mnemonic::HALT)); }
+
+ShouldHalt Unused::Apply(Machine *, const Instruction &) { return ShouldHalt::YES; }
+
+ShouldHalt Unused::Execute() { return Apply(mac, Instruction(inst)); }
+
+std::string Unused::Humanize() { return Note(Disassembler::Decode(Instruction(inst), Mnemonic::UNUSED)); }
+
+Disassembly Disassembler::Decode(uint8_t high, uint8_t low) {
+	static const Mnemonic DEFAULT[16] = {
+		Mnemonic::NOTHING, Mnemonic::LOAD1, Mnemonic::LOAD2, Mnemonic::STORE,  Mnemonic::MOVE,	 Mnemonic::ADD1,
+		Mnemonic::ADD2,	   Mnemonic::OR,	Mnemonic::AND,	 Mnemonic::XOR,	   Mnemonic::ROTATE, Mnemonic::JUMP,
+		Mnemonic::HALT,	   Mnemonic::UNUSED, Mnemonic::UNUSED, Mnemonic::UNUSED,
+	};
+	Instruction ins(high, low);
+	return Decode(ins, DEFAULT[ins.opcode]);
 }
 
-ShouldHalt And::Execute() {
-	uint8_t r = operand1;
-	uint8_t s = operand2;
-	uint8_t t = operand3;
-	mac->reg[r] = mac->reg[s] & mac->reg[t];
-	return ShouldHalt::NO;
+Disassembly Disassembler::Decode(const Instruction &ins, Mnemonic mnemonic) {
+	Disassembly dis;
+	dis.mnemonic = mnemonic;
+	dis.opcode = ins.opcode;
+	dis.r = ins.operand1;
+	dis.s = ins.operand2;
+	dis.t = ins.operand3;
+	dis.xy = ins.operandXY;
+	switch (mnemonic) {
+	case Mnemonic::NOTHING:
+		dis.note = NoteTemplate::NONE;
+		break;
+	case Mnemonic::LOAD1:
+		dis.note = NoteTemplate::COPY_CELL_TO_REGISTER;
+		break;
+	case Mnemonic::LOAD2:
+		dis.note = NoteTemplate::COPY_VALUE_TO_REGISTER;
+		break;
+	case Mnemonic::STORE:
+		dis.note = dis.xy == 0x00 ? NoteTemplate::PRINT_REGISTER : NoteTemplate::COPY_REGISTER_TO_CELL;
+		break;
+	case Mnemonic::MOVE:
+		dis.note = NoteTemplate::COPY_REGISTER_TO_REGISTER;
+		break;
+	case Mnemonic::ADD1:
+		dis.note = NoteTemplate::ADD_INTEGERS;
+		break;
+	case Mnemonic::ADD2:
+		dis.note = NoteTemplate::ADD_FLOATS;
+		break;
+	case Mnemonic::OR:
+		dis.note = NoteTemplate::OR;
+		break;
+	case Mnemonic::AND:
+		dis.note = NoteTemplate::AND;
+		break;
+	case Mnemonic::XOR:
+		dis.note = NoteTemplate::XOR;
+		break;
+	case Mnemonic::ROTATE:
+		dis.note = NoteTemplate::ROTATE;
+		break;
+	case Mnemonic::JUMP:
+		dis.note = dis.r == 0 ? NoteTemplate::JUMP : NoteTemplate::JUMP_IF_EQUAL;
+		break;
+	case Mnemonic::HALT:
+		dis.note = NoteTemplate::HALT;
+		break;
+	case Mnemonic::UNUSED:
+		dis.note = NoteTemplate::UNUSED;
+		break;
+	case Mnemonic::CUSTOM:
+		dis.note = NoteTemplate::CUSTOM;
+		break;
+	}
+	return dis;
 }
 
-std::string And::Humanize() {
-	std::ostringstream os;
-	os << "Bitwise AND bits in register " << OS_HEX1 << operand2 << " and " << OS_HEX1 << operand3 << ", put in "
-	   << OS_HEX1 << operand1;
-	return os.str();
+void Disassembler::DecodeAll(const uint8_t *cells, Disassembly *out) {
+	for (size_t slot = 0; slot < SLOTS; slot++) {
+		out[slot] = Decode(cells[2 * slot], cells[2 * slot + 1]);
+	}
 }
 
-ShouldHalt Xor::Execute() {
-	uint8_t r = operand1;
-	uint8_t s = operand2;
-	uint8_t t = operand3;
-	mac->reg[r] = mac->reg[s] ^ mac->reg[t];
-	return ShouldHalt::NO;
+const char *Disassembler::Name(Mnemonic mnemonic) {
+	switch (mnemonic) {
+	case Mnemonic::NOTHING:
+		return "NOP";
+	case Mnemonic::LOAD1:
+	case Mnemonic::LOAD2:
+		return "LOAD";
+	case Mnemonic::STORE:
+		return "STORE";
+	case Mnemonic::MOVE:
+		return "MOVE";
+	case Mnemonic::ADD1:
+		return "ADDI";
+	case Mnemonic::ADD2:
+		return "ADDF";
+	case Mnemonic::OR:
+		return "OR";
+	case Mnemonic::AND:
+		return "AND";
+	case Mnemonic::XOR:
+		return "XOR";
+	case Mnemonic::ROTATE:
+		return "ROT";
+	case Mnemonic::JUMP:
+		return "JMPEQ";
+	case Mnemonic::HALT:
+		return "HALT";
+	case Mnemonic::UNUSED:
+		return "UNUSED";
+	case Mnemonic::CUSTOM:
+		return "CUSTOM";
+	}
+	return "";
 }
 
-std::string Xor::Humanize() {
-	std::ostringstream os;
-	os << "Bitwise XOR bits in register " << OS_HEX1 << operand1 << " and " << OS_HEX1 << operand2 << ", put in "
-	   << OS_HEX1 << operand3;
-	return os.str();
+/// snprintf() returning the length as size_t; formats are all ours.
+template <typename... Args>
+static size_t Format(char *buffer, size_t size, const char *format, Args... args) {
+	int length = std::snprintf(buffer, size, format, args...);
+	return length < 0 ? 0 : length;
 }
 
-ShouldHalt Rotate::Execute() {
-	uint8_t r = operand1;
-	uint8_t t = operand3 % 8;
-	mac->reg[r] = ((mac->reg[r] >> t) | (mac->reg[r] << (8 - t)));
-	return ShouldHalt::NO;
+size_t Disassembler::FormatInstruction(const Disassembly &dis, char *buffer, size_t size) {
+	const char *name = Name(dis.mnemonic);
+	switch (dis.mnemonic) {
+	case Mnemonic::NOTHING:
+	case Mnemonic::HALT:
+		return Format(buffer, size, "%s", name);
+	case Mnemonic::LOAD1:
+		return Format(buffer, size, "%s R%X, [%02X]", name, dis.r, dis.xy);
+	case Mnemonic::LOAD2:
+		return Format(buffer, size, "%s R%X, %02X", name, dis.r, dis.xy);
+	case Mnemonic::STORE:
+		return Format(buffer, size, "%s R%X, [%02X]", name, dis.r, dis.xy);
+	case Mnemonic::MOVE:
+		return Format(buffer, size, "%s R%X, R%X", name, dis.t, dis.s);
+	case Mnemonic::ADD1:
+	case Mnemonic::ADD2:
+	case Mnemonic::OR:
+	case Mnemonic::AND:
+	case Mnemonic::XOR:
+		return Format(buffer, size, "%s R%X, R%X, R%X", name, dis.r, dis.s, dis.t);
+	case Mnemonic::ROTATE:
+		return Format(buffer, size, "%s R%X, %X", name, dis.r, dis.t);
+	case Mnemonic::JUMP:
+		if (dis.r == 0) {
+			return Format(buffer, size, "JMP %02X", dis.xy);
+		}
+		return Format(buffer, size, "%s %02X, R%X", name, dis.xy, dis.r);
+	case Mnemonic::UNUSED:
+	case Mnemonic::CUSTOM:
+		return Format(buffer, size, "%s %X%X%02X", name, dis.opcode, dis.r, dis.xy);
+	}
+	return Format(buffer, size, "%s", "");
 }
 
-std::string Rotate::Humanize() {
-	std::ostringstream os;
-	os << "Rotate bits in register " << OS_HEX1 << operand1 << " cyclically right " << OS_HEX1 << operand3 << " steps";
-	return os.str();
+size_t Disassembler::FormatNote(const Disassembly &dis, char *buffer, size_t size) {
+	switch (dis.note) {
+	case NoteTemplate::NONE:
+	case NoteTemplate::CUSTOM:
+		return Format(buffer, size, "%s", "");
+	case NoteTemplate::COPY_CELL_TO_REGISTER:
+		return Format(buffer, size, "Copy bits at cell %02X to register %X", dis.xy, dis.r);
+	case NoteTemplate::COPY_VALUE_TO_REGISTER:
+		return Format(buffer, size, "Copy bit-string %02X to register %X", dis.xy, dis.r);
+	case NoteTemplate::COPY_REGISTER_TO_CELL:
+		return Format(buffer, size, "Copy bits in register %X to cell %02X", dis.r, dis.xy);
+	case NoteTemplate::PRINT_REGISTER:
+		return Format(buffer, size, "Print bits in register %X to the screen", dis.r);
+	case NoteTemplate::COPY_REGISTER_TO_REGISTER:
+		return Format(buffer, size, "Copy bits in register %X to register %X", dis.s, dis.t);
+	case NoteTemplate::ADD_INTEGERS:
+		return Format(buffer, size, "Add bits in registers %X and %X (two's-complement), put in %X", dis.s, dis.t,
+					  dis.r);
+	case NoteTemplate::ADD_FLOATS:
+		return Format(buffer, size, "Add bits in register %X and %X (float), put in %X", dis.s, dis.t, dis.r);
+	case NoteTemplate::OR:
+		return Format(buffer, size, "Bitwise OR bits in register %X and %X, put in %X", dis.s, dis.t, dis.r);
+	case NoteTemplate::AND:
+		return Format(buffer, size, "Bitwise AND bits in register %X and %X, put in %X", dis.s, dis.t, dis.r);
+	case NoteTemplate::XOR:
+		return Format(buffer, size, "Bitwise XOR bits in register %X and %X, put in %X", dis.s, dis.t, dis.r);
+	case NoteTemplate::ROTATE:
+		return Format(buffer, size, "Rotate bits in register %X cyclically right %X steps", dis.r, dis.t);
+	case NoteTemplate::JUMP_IF_EQUAL:
+		return Format(buffer, size, "Jump to cell %02X if register %X equals register 0", dis.xy, dis.r);
+	case NoteTemplate::JUMP:
+		return Format(buffer, size, "Jump to cell %02X", dis.xy);
+	case NoteTemplate::HALT:
+		return Format(buffer, size, "%s", "Halt");
+	case NoteTemplate::UNUSED:
+		return Format(buffer, size, "Unspecified op-code %X", dis.opcode);
+	}
+	return Format(buffer, size, "%s", "");
 }
 
-ShouldHalt Jump::Execute() {
+Disassembly Machine::Disassemble(uint8_t slot) const {
+	Instruction ins(mem.Read(2 * slot), mem.Read(2 * slot + 1));
+	return Disassembler::Decode(ins, m_Mnemonics[ins.opcode]);
+}
 
-	uint8_t r = operand1;
-	uint16_t xy = operandXY;
-	if (xy % 2 != 0) // Not a full instruction at `xy`.
-		xy--;
-	if (mac->reg[r] == mac->reg[0])
-		mac->reg.pc = xy;
-	return ShouldHalt::NO;
+void Machine::DisassembleAll(Disassembly *out) const {
+	for (size_t slot = 0; slot < Disassembler::SLOTS; slot++) {
+		out[slot] = Disassemble(slot);
+	}
 }
 
-std::string Jump::Humanize() {
-	std::ostringstream os;
-	os << "Jump to cell " << OS_HEX2 << operandXY << " if register " << OS_HEX1 << operand1 << " equals register 0";
-	return os.str();
+Device::~Device() = default;
+
+uint8_t Device::Load(Machine &mac, uint8_t at) { return mac.mem.Read(at); }
+
+void Device::Store(Machine &, uint8_t, uint8_t) {}
+
+Bus::Bus() : m_Attributes(), m_Devices(), m_Version(0), m_Loads(false) {}
+
+bool Bus::Map(Device *device, uint8_t from, uint8_t to, uint8_t access) {
+	size_t number = std::find(m_Devices.begin(), m_Devices.end(), device) - m_Devices.begin();
+	if (number == MAX_DEVICES) {
+		number = std::find(m_Devices.begin(), m_Devices.end(), nullptr) - m_Devices.begin();
+		if (number == MAX_DEVICES) {
+			return false;
+		}
+		m_Devices[number] = device;
+	}
+	uint8_t attribute = (access & (LOAD | STORE)) == 0 ? 0 : (access & (LOAD | STORE)) | (number + 1);
+	for (size_t at = from; at <= to; at++) {
+		m_Attributes[at] = attribute;
+	}
+	Collect();
+	return true;
 }
 
-ShouldHalt Halt::Execute() { return ShouldHalt::YES; }
+void Bus::Unmap(uint8_t from, uint8_t to) {
+	for (size_t at = from; at <= to; at++) {
+		m_Attributes[at] = 0;
+	}
+	Collect();
+}
 
-std::string Halt::Humanize() {
-	std::ostringstream os;
-	os << "Halt";
-	return os.str();
+Device *Bus::At(uint8_t at) const {
+	uint8_t number = m_Attributes[at] & DEVICE;
+	return number == 0 ? nullptr : m_Devices[number - 1];
 }
 
-ShouldHalt Unused::Execute() { return ShouldHalt::YES; }
+uint64_t Bus::Version() const { return m_Version; }
+
+bool Bus::HasLoads() const { return m_Loads; }
 
-std::string Unused::Humanize() {
-	std::ostringstream os;
-	os << "Unspecified op-code " << OS_HEX1 << opcode;
-	return os.str();
+void Bus::Collect() {
+	std::bitset<MAX_DEVICES + 1> mapped;
+	m_Loads = false;
+	for (uint8_t attribute : m_Attributes) {
+		mapped[attribute & DEVICE] = true;
+		m_Loads |= (attribute & LOAD) != 0;
+	}
+	for (size_t number = 1; number <= MAX_DEVICES; number++) {
+		if (!mapped[number]) {
+			m_Devices[number - 1] = nullptr;
+		}
+	}
+	m_Version++;
 }
 
+Screen::Screen() : m_Next(nullptr), m_End(nullptr), m_FlushAfter(-1), m_FlushOnStop(false) {}
+
 Screen::~Screen() = default;
+
+void Screen::Overflow(uint8_t c) { write(c); }
+
+void Screen::Sync() {}
 ControlUnit::~ControlUnit() = default;
 Nothing::~Nothing() = default;
 Load1::~Load1() = default;
@@ -305,19 +1297,17 @@ Jump::~Jump() = default;
 Halt::~Halt() = default;
 Unused::~Unused() = default;
 
-float Float::Decode(uint8_t byte) {
-	int sig = (byte & (1 << 7)) ? -1 : 1;
-	int exp = ((byte >> 4) & 0x7) - 4;
-	int man = (byte & 0xF) | 0x10;
-	return (std::exp2f(exp) * ((man & 16) != 0) + std::exp2f(exp - 1) * ((man & 8) != 0) +
-			std::exp2f(exp - 2) * ((man & 4) != 0) + std::exp2f(exp - 3) * ((man & 2) != 0) +
-			std::exp2f(exp - 4) * ((man & 1) != 0)) *
-		   sig;
+namespace {
+/// Sign bit, 3-bit excess-4 exponent and 4-bit mantissa with an implied
+/// leading one: the value is the 5-bit mantissa times 2^(exponent - 8).
+constexpr float DecodeFloat(uint8_t byte) {
+	float magnitude = static_cast<float>((byte & 0xF) | 0x10) / static_cast<float>(1 << (8 - ((byte >> 4) & 0x7)));
+	return (byte & (1 << 7)) ? -magnitude : magnitude;
 }
 
-uint8_t Float::Encode(float number) {
+constexpr uint8_t EncodeFloat(float number) {
 	uint8_t sig = (number < 0) ? 1 : 0;
-	number = std::fabs(number);
+	number = (number < 0) ? -number : number;
 
 	int exponent = 0;
 	while (number >= 2.0f) {
@@ -329,8 +1319,44 @@ uint8_t Float::Encode(float number) {
 		exponent--;
 	}
 
+	// Out of range exponents wrap around, and zero, which has no normalized
+	// form, comes out with an all-ones mantissa.
 	uint8_t exp = exponent + 4;
-	uint8_t man = static_cast<uint8_t>((number * 16) - 16);
+	uint8_t man = static_cast<int>((number * 16) - 16);
 
 	return (sig << 7) | (exp << 4) | man;
 }
+
+template <size_t... Byte> constexpr std::array<float, 256> DecodeTable(std::index_sequence<Byte...>) {
+	return {{DecodeFloat(Byte)...}};
+}
+
+constexpr std::array<float, 256> DECODED = DecodeTable(std::make_index_sequence<256>());
+
+constexpr std::array<uint8_t, 256> SumRow(uint8_t a) {
+	std::array<uint8_t, 256> row = {};
+	for (size_t b = 0; b < row.size(); b++) {
+		row[b] = EncodeFloat(DECODED[a] + DECODED[b]);
+	}
+	return row;
+}
+
+// One constant per row keeps each evaluation well inside the compilers'
+// constexpr step limits.
+template <size_t A> constexpr std::array<uint8_t, 256> SUM_ROW = SumRow(A);
+
+template <size_t... A> constexpr std::array<std::array<uint8_t, 256>, 256> SumTable(std::index_sequence<A...>) {
+	return {{SUM_ROW<A>...}};
+}
+
+constexpr std::array<std::array<uint8_t, 256>, 256> SUMS = SumTable(std::make_index_sequence<256>());
+static_assert(sizeof(SUMS) == 256 * 256, "Float::AddTable() is indexed as one flat array");
+} // namespace
+
+float Float::Decode(uint8_t byte) { return DECODED[byte]; }
+
+uint8_t Float::Encode(float number) { return EncodeFloat(number); }
+
+uint8_t Float::Add(uint8_t a, uint8_t b) { return SUMS[a][b]; }
+
+const uint8_t *Float::AddTable() { return SUMS[0].data(); }
@@ -1,24 +1,98 @@
 #pragma once
 
 #include <array>
+#include <bitset>
 #include <cstdint>
 #include <functional>
 #include <iostream>
+#include <memory>
 
 #include "error.h"
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 namespace vole {
+class History;
+class Jit;
+class Profiler;
+struct ProgramImage;
+class Tracer;
+
+/// @brief Cells as a bitmask, bit `cell % 64` of word `cell / 64`.
+typedef std::array<uint64_t, 4> CellMask;
+
+/// @brief Index of the lowest set bit of `bits`, which is not 0. Walks the
+/// bitmasks above a set bit at a time.
+inline unsigned CountTrailingZeros(uint64_t bits) {
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctzll(bits);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long index;
+	_BitScanForward64(&index, bits);
+	return index;
+#else
+	unsigned count = 0;
+	for (; (bits & 1) == 0; bits >>= 1) {
+		count++;
+	}
+	return count;
+#endif
+}
+
+/// Every write to memory or a register is tracked: it gets a generation, a
+/// number taken from a counter that only grows, and sets the cell's bit in a
+/// dirty mask kept until ClearDirty(). Readers remember the generations they
+/// saw, or the single owner of a machine uses the dirty mask, to redo work
+/// for changed cells only.
 class Memory {
 public:
 	const static size_t SIZE = 256;
 	Memory();
+	/// @brief Zero all cells. Only the cells written since the last Reset()
+	/// are cleared, and count as written.
 	void Reset();
+	/// @brief Writable reference to a cell, counted as a write to it.
 	uint8_t &operator[](uint8_t);
 	uint8_t operator[](uint8_t) const;
+	/// @brief Writable access to all cells, counted as a write to every cell.
 	std::array<uint8_t, Memory::SIZE> *Array();
+	uint8_t Read(uint8_t) const;
+	void Write(uint8_t, uint8_t);
+	/// @brief Write `count` cells from `at` on (wrapping around after FF), in
+	/// one copy and one generation.
+	void Write(uint8_t at, const uint8_t *values, size_t count);
+
+	/// @brief Generation of the last write to either cell of the instruction
+	/// word `slot` (cells `2 * slot` and `2 * slot + 1`). Generations only
+	/// grow, so an unchanged value means the word was not written since.
+	uint64_t SlotGeneration(uint8_t slot) const;
+	/// @brief Generation of the last write to `cell`.
+	uint64_t CellGeneration(uint8_t cell) const;
+	/// @brief Generation of the last write to any cell.
+	uint64_t Generation() const;
+
+	/// @brief Cells written since the last ClearDirty().
+	const CellMask &Dirty() const;
+	bool IsDirty(uint8_t cell) const;
+	void ClearDirty();
 
 private:
+	friend class Jit;
+
 	std::array<uint8_t, SIZE> m_Array;
+	uint64_t m_Generation;
+	std::array<uint64_t, SIZE / 2> m_SlotGeneration;
+	std::array<uint64_t, SIZE> m_CellGeneration;
+	CellMask m_Dirty;
+	/// Cells written since the last Reset(), the only ones that may not be 0.
+	CellMask m_Written;
+
+	void Touch(uint8_t);
+	/// Cells `from` to `from + count`, not wrapping around.
+	void TouchRange(size_t from, size_t count, uint64_t generation);
+	void TouchAll();
 };
 
 class Registers {
@@ -26,17 +100,58 @@ public:
 	uint8_t pc;
 	Registers();
 	void Reset();
+	/// @brief Writable reference to a register, counted as a write to it.
 	uint8_t &operator[](uint8_t);
 	uint8_t operator[](uint8_t) const;
+	uint8_t Read(uint8_t) const;
+	void Write(uint8_t, uint8_t);
+
+	/// @brief Generation of the last write to register `r`, from the same
+	/// kind of counter as Memory's.
+	uint64_t Generation(uint8_t r) const;
+	/// @brief Generation of the last write to any register.
+	uint64_t Generation() const;
+	/// @brief Registers written since the last ClearDirty(), bit `r` for
+	/// register `r`. The PC is not tracked.
+	uint16_t Dirty() const;
+	void ClearDirty();
 
 private:
 	std::array<uint8_t, 16> m_Array;
+	uint64_t m_Generation;
+	std::array<uint64_t, 16> m_Generations;
+	uint16_t m_Dirty;
 };
 
 class Machine;
 
 enum class ShouldHalt : bool { NO, YES };
 
+/// @brief An instruction split into its fields. Plain data, cheap to copy and
+/// never heap-allocated.
+struct Instruction {
+	/// Full instruction (16 bits wide).
+	uint16_t inst;
+	/// Operation code (4 bits wide). Bits [15:12]
+	uint8_t opcode;
+	/// First instruction operand (4 bits wide). Bits [11:8].
+	uint8_t operand1;
+	/// Second instruction operand (4 bits wide). Bits [7:4].
+	uint8_t operand2;
+	/// Third instruction operand (4 bits wide). Bits [3:0].
+	uint8_t operand3;
+	/// Half instruction (8 bits wide). Bits [7:0].
+	uint8_t operandXY;
+
+	Instruction() = default;
+	Instruction(uint16_t inst);
+	Instruction(uint8_t high, uint8_t low);
+};
+
+/// @brief Executes an already decoded instruction on a machine. Every builtin
+/// `ControlUnit` exposes one as its static `Apply`.
+typedef ShouldHalt (*InstructionHandler)(Machine *, const Instruction &);
+
 class ControlUnit {
 public:
 	ControlUnit(Machine *);
@@ -68,6 +183,7 @@ protected:
 class Nothing : public ControlUnit {
 public:
 	using ControlUnit::ControlUnit;
+	static ShouldHalt Apply(Machine *, const Instruction &);
 	ShouldHalt Execute() override;
 	std::string Humanize() override;
 	~Nothing();
@@ -76,6 +192,7 @@ public:
 class Load1 : public ControlUnit {
 public:
 	using ControlUnit::ControlUnit;
+	static ShouldHalt Apply(Machine *, const Instruction &);
 	ShouldHalt Execute() override;
 	std::string Humanize() override;
 	~Load1();
@@ -84,6 +201,7 @@ public:
 class Load2 : public ControlUnit {
 public:
 	using ControlUnit::ControlUnit;
+	static ShouldHalt Apply(Machine *, const Instruction &);
 	ShouldHalt Execute() override;
 	std::string Humanize() override;
 	~Load2();
@@ -92,6 +210,7 @@ public:
 class Store : public ControlUnit {
 public:
 	using ControlUnit::ControlUnit;
+	static ShouldHalt Apply(Machine *, const Instruction &);
 	ShouldHalt Execute() override;
 	std::string Humanize() override;
 	~Store();
@@ -100,6 +219,7 @@ public:
 class Move : public ControlUnit {
 public:
 	using ControlUnit::ControlUnit;
+	static ShouldHalt Apply(Machine *, const Instruction &);
 	ShouldHalt Execute() override;
 	std::string Humanize() override;
 	~Move();
@@ -108,6 +228,7 @@ public:
 class Add1 : public ControlUnit {
 public:
 	using ControlUnit::ControlUnit;
+	static ShouldHalt Apply(Machine *, const Instruction &);
 	ShouldHalt Execute() override;
 	std::string Humanize() override;
 	~Add1();
@@ -116,6 +237,7 @@ public:
 class Add2 : public ControlUnit {
 public:
 	using ControlUnit::ControlUnit;
+	static ShouldHalt Apply(Machine *, const Instruction &);
 	ShouldHalt Execute() override;
 	std::string Humanize() override;
 	~Add2();
@@ -124,6 +246,7 @@ public:
 class Or : public ControlUnit {
 public:
 	using ControlUnit::ControlUnit;
+	static ShouldHalt Apply(Machine *, const Instruction &);
 	ShouldHalt Execute() override;
 	std::string Humanize() override;
 	~Or();
@@ -132,6 +255,7 @@ public:
 class And : public ControlUnit {
 public:
 	using ControlUnit::ControlUnit;
+	static ShouldHalt Apply(Machine *, const Instruction &);
 	ShouldHalt Execute() override;
 	std::string Humanize() override;
 	~And();
@@ -140,6 +264,7 @@ public:
 class Xor : public ControlUnit {
 public:
 	using ControlUnit::ControlUnit;
+	static ShouldHalt Apply(Machine *, const Instruction &);
 	ShouldHalt Execute() override;
 	std::string Humanize() override;
 	~Xor();
@@ -148,6 +273,7 @@ public:
 class Rotate : public ControlUnit {
 public:
 	using ControlUnit::ControlUnit;
+	static ShouldHalt Apply(Machine *, const Instruction &);
 	ShouldHalt Execute() override;
 	std::string Humanize() override;
 	~Rotate();
@@ -156,6 +282,7 @@ public:
 class Jump : public ControlUnit {
 public:
 	using ControlUnit::ControlUnit;
+	static ShouldHalt Apply(Machine *, const Instruction &);
 	ShouldHalt Execute() override;
 	std::string Humanize() override;
 	~Jump();
@@ -164,6 +291,7 @@ public:
 class Halt : public ControlUnit {
 public:
 	using ControlUnit::ControlUnit;
+	static ShouldHalt Apply(Machine *, const Instruction &);
 	ShouldHalt Execute() override;
 	std::string Humanize() override;
 	~Halt();
@@ -172,6 +300,7 @@ public:
 class Unused : public ControlUnit {
 public:
 	using ControlUnit::ControlUnit;
+	static ShouldHalt Apply(Machine *, const Instruction &);
 	ShouldHalt Execute() override;
 	std::string Humanize() override;
 	~Unused();
@@ -200,52 +329,441 @@ inline const std::array<ControlUnitBuilder, 16> DefaultControlUnitFactory = {
 	UnusedBuilder,
 };
 
+/// @brief The control unit builders of a machine, one per opcode. Copies
+/// share the builders, so copying a Machine copies no `std::function`.
+class ControlUnitFactory {
+public:
+	ControlUnitFactory(const std::array<ControlUnitBuilder, 16> &builders);
+	/// @brief `DefaultControlUnitFactory`, built once.
+	static const ControlUnitFactory &Default();
+
+	const ControlUnitBuilder &operator[](uint8_t opcode) const;
+
+private:
+	std::shared_ptr<const std::array<ControlUnitBuilder, 16>> m_Builders;
+};
+
+/// @brief Which builtin control unit an instruction runs.
+enum class Mnemonic : uint8_t {
+	NOTHING,
+	LOAD1,
+	LOAD2,
+	STORE,
+	MOVE,
+	ADD1,
+	ADD2,
+	OR,
+	AND,
+	XOR,
+	ROTATE,
+	JUMP,
+	HALT,
+	UNUSED,
+	/// Not a builtin control unit; only its `Humanize()` can describe it.
+	CUSTOM,
+};
+
+/// @brief Which English note describes an instruction, see
+/// `Disassembler::FormatNote()`.
+enum class NoteTemplate : uint8_t {
+	NONE,
+	COPY_CELL_TO_REGISTER,
+	COPY_VALUE_TO_REGISTER,
+	COPY_REGISTER_TO_CELL,
+	/// A store to cell 00, which goes to the screen.
+	PRINT_REGISTER,
+	COPY_REGISTER_TO_REGISTER,
+	ADD_INTEGERS,
+	ADD_FLOATS,
+	OR,
+	AND,
+	XOR,
+	ROTATE,
+	JUMP_IF_EQUAL,
+	/// A jump on register 0, which always equals itself.
+	JUMP,
+	HALT,
+	UNUSED,
+	CUSTOM,
+};
+
+/// @brief A disassembled instruction word. Plain data, formatted only when
+/// the caller asks `Disassembler` to.
+struct Disassembly {
+	Mnemonic mnemonic;
+	NoteTemplate note;
+	uint8_t opcode;
+	/// Register operands, bits [11:8], [7:4] and [3:0].
+	uint8_t r, s, t;
+	/// Cell or value operand, bits [7:0].
+	uint8_t xy;
+};
+
+/// @brief Disassembles instruction words without allocating.
+struct Disassembler {
+	/// Instruction words in memory.
+	static const size_t SLOTS = Memory::SIZE / 2;
+
+	/// @brief Disassemble with the default control units.
+	static Disassembly Decode(uint8_t high, uint8_t low);
+	/// @brief Disassemble `ins`, run by the control unit `mnemonic`.
+	static Disassembly Decode(const Instruction &ins, Mnemonic mnemonic);
+	/// @brief Disassemble the `SLOTS` instruction words of `cells` (a memory
+	/// image of `Memory::SIZE` cells) into `out` with the default control
+	/// units.
+	static void DecodeAll(const uint8_t *cells, Disassembly *out);
+
+	static const char *Name(Mnemonic);
+	/// @brief Write the assembly form, such as `LOAD R1, [80]`, like
+	/// `snprintf()`: at most `size` bytes including the terminating NUL.
+	/// @return Length of the whole text.
+	static size_t FormatInstruction(const Disassembly &, char *buffer, size_t size);
+	/// @brief Write the English note, such as `Copy bits at cell 80 to
+	/// register 1`, like FormatInstruction(). Empty for Mnemonic::CUSTOM.
+	static size_t FormatNote(const Disassembly &, char *buffer, size_t size);
+};
+
+/// @brief Why `Machine::RunFor()` returned.
+enum class StopReason {
+	/// A Halt instruction, or a custom control unit asking to halt, ran.
+	HALTED,
+	/// The instruction budget ran out.
+	BUDGET_EXHAUSTED,
+	/// The next instruction is at a breakpoint.
+	BREAKPOINT,
+	/// An instruction with an unused opcode ran.
+	UNUSED_OPCODE,
+	/// The loop detector found the machine back in an earlier state, so it
+	/// will never halt. See `Machine::DetectLoops()`.
+	LOOP_DETECTED,
+};
+
+struct RunResult {
+	StopReason reason;
+	/// Instructions executed, including the one that halted.
+	uint64_t retired;
+};
+
+/// @brief A cycle of machine states found by the loop detector.
+struct Loop {
+	/// PC of the first state on the cycle, where the program enters the loop.
+	uint8_t entry;
+	/// Instructions in one turn of the loop.
+	uint64_t period;
+};
+
+/// @brief Where a Store to cell 00 goes: the machine maps a device there that
+/// passes the value to `Machine::scr`, `Put()` if not 0 and `clear()` if 0.
+///
+/// Subclasses implement `clear()` and `write()`. Those keeping a buffer
+/// (see BufferedScreen in screen.h) point `m_Next` and `m_End` at it, and
+/// `Put()` then stores bytes there without a virtual call until it is full.
 class Screen {
 public:
+	Screen();
 	virtual void clear() = 0;
 	virtual void write(uint8_t) = 0;
 	virtual ~Screen();
+
+	/// @brief Output `c`, into the buffer while there is room for it.
+	void Put(uint8_t c) {
+		if (m_Next != m_End && c != m_FlushAfter) {
+			*m_Next++ = c;
+		} else {
+			Overflow(c);
+		}
+	}
+
+	/// @brief A run of the machine stopped, so output held back should be
+	/// shown now.
+	void Stopped() {
+		if (m_FlushOnStop) {
+			Sync();
+		}
+	}
+
+protected:
+	/// Free part of the buffer, `[m_Next, m_End)`. Empty when there is none.
+	uint8_t *m_Next, *m_End;
+	/// Byte Put() always passes to Overflow(), or -1.
+	int m_FlushAfter;
+	/// Whether Stopped() calls Sync().
+	bool m_FlushOnStop;
+
+	/// @brief Output a byte Put() could not buffer. Calls `write()`.
+	virtual void Overflow(uint8_t c);
+	/// @brief Show the output held back. Does nothing.
+	virtual void Sync();
+};
+
+/// @brief Something on a machine's Bus, answering Load1 and Store
+/// instructions on the cells it is mapped to.
+class Device {
+public:
+	virtual ~Device();
+	/// @brief A Load1 from cell `at`, mapped for loads.
+	/// @return What the register gets. The cell's value by default.
+	virtual uint8_t Load(Machine &, uint8_t at);
+	/// @brief A Store of `value` to cell `at`, mapped for stores, after memory
+	/// took the value. Does nothing by default.
+	virtual void Store(Machine &, uint8_t at, uint8_t value);
+};
+
+/// @brief Devices mapped over memory cells.
+///
+/// An attribute byte per cell tells whether a device answers loads or stores
+/// there, and which one, so instructions on other cells pay one lookup. Only
+/// Load1 and Store instructions go through the bus; fetching, loading
+/// programs, Restore() and the debugging tools see memory as it is.
+///
+/// What a device loads is not part of the machine's state, so loop detection
+/// is suspended while a device is mapped for loads. Finding where a detected
+/// loop starts replays it on forks whose bus only has the screen, so devices
+/// never see those instructions.
+class Bus {
+public:
+	/// Bits of an attribute: loads and stores go to the device numbered by the
+	/// `DEVICE` bits, counting from 1.
+	static const uint8_t LOAD = 0x80, STORE = 0x40, DEVICE = 0x3F;
+	/// Devices mapped at the same time at most.
+	static const size_t MAX_DEVICES = DEVICE;
+
+	Bus();
+
+	/// @brief Have `device` answer `access` (LOAD, STORE or both) on cells
+	/// `from` to `to`, instead of what was mapped there. It is not owned.
+	/// @return `false`, mapping nothing, if `MAX_DEVICES` others are mapped.
+	bool Map(Device *device, uint8_t from, uint8_t to, uint8_t access);
+	/// @brief Give cells `from` to `to` back to memory.
+	void Unmap(uint8_t from, uint8_t to);
+	/// @brief The device mapped on cell `at`, or `nullptr`.
+	Device *At(uint8_t at) const;
+	/// @brief Changes with every Map() and Unmap(), for code translated with
+	/// the map as it was.
+	uint64_t Version() const;
+	/// @brief Whether a device is mapped for loads on any cell.
+	bool HasLoads() const;
+
+	uint8_t Attribute(uint8_t at) const { return m_Attributes[at]; }
+	/// @brief Pass a Load1 or Store on cell `at` to its device.
+	uint8_t Load(Machine &mac, uint8_t at) const {
+		return m_Devices[(m_Attributes[at] & DEVICE) - 1]->Load(mac, at);
+	}
+	void Store(Machine &mac, uint8_t at, uint8_t value) const {
+		m_Devices[(m_Attributes[at] & DEVICE) - 1]->Store(mac, at, value);
+	}
+
+private:
+	std::array<uint8_t, Memory::SIZE> m_Attributes;
+	/// Device numbered `n` at `n - 1`, `nullptr` for free numbers.
+	std::array<Device *, MAX_DEVICES> m_Devices;
+	uint64_t m_Version;
+	bool m_Loads;
+
+	/// Free the numbers of devices no longer mapped on any cell.
+	void Collect();
 };
 
 class Machine {
 public:
 	Memory mem;
 	Registers reg;
-	const std::array<ControlUnitBuilder, 16> controlUnitFactory;
+	const ControlUnitFactory controlUnitFactory;
 	Screen *scr;
+	/// Devices on the machine, `scr` on cell 00 for stores to begin with.
+	Bus bus;
 
-	Machine(Screen *, std::array<ControlUnitBuilder, 16> controlUnitFactory = DefaultControlUnitFactory);
+	/// @brief Everything the next instruction depends on.
+	struct State {
+		std::array<uint8_t, Memory::SIZE> mem;
+		std::array<uint8_t, 16> reg;
+		uint8_t pc;
+	};
+
+	Machine(Screen *, const ControlUnitFactory &controlUnitFactory = ControlUnitFactory::Default());
 
 	/// @brief Reset all registers and memory cells.
 	void Reset();
 
-	/// @brief Load program from `from` and put it in memory starting at cell
-	/// `at`
-	/// @param fromPath The input file path to load the program from (in
-	/// hexadecimal).
-	/// @param at The starting memory address to put the program at.
-	/// @return `true` if `from.fail()` never returned `true` after a read,
-	/// otherwise `false`.
-	error::LoadProgramError LoadProgram(const std::string &fromPath, uint8_t at = 0);
-
-	/// @brief Load program from `from` and put it in memory starting at cell
-	/// `at`
-	/// @param from The input stream to load the program from (in hexadecimal).
-	/// @param at The starting memory address to put the program at.
-	/// @return `true` if `from.fail()` never returned `true` after a read,
-	/// otherwise `false`.
-	error::LoadProgramError LoadProgram(std::istream &from, uint8_t at = 0);
+	/// @brief Load the program in file `fromPath`: program text (see
+	/// ParseProgram()) put in memory starting at cell `at`, or a `.voleb`
+	/// image (told apart by its header), mapped and copied to memory where its
+	/// segments say. Registers and the PC are set where the program gives
+	/// them.
+	/// @param where If not null, where in the file loading failed.
+	/// @return NOT_AN_ERROR, or why nothing was loaded.
+	error::LoadProgramError LoadProgram(const std::string &fromPath, uint8_t at = 0, error::Location *where = nullptr);
+
+	/// @brief Load program text from `from`, read once to its end, and put it
+	/// in memory starting at cell `at`.
+	/// @param where If not null, where in the stream loading failed.
+	/// @return NOT_AN_ERROR, or why nothing was loaded.
+	error::LoadProgramError LoadProgram(std::istream &from, uint8_t at = 0, error::Location *where = nullptr);
+
+	/// @brief Same as LoadProgram(from, at, where), from the `size` bytes of
+	/// text at `text`.
+	error::LoadProgramError LoadProgram(const char *text, size_t size, uint8_t at = 0,
+										error::Location *where = nullptr);
+
+	/// @brief Put a parsed program in the machine.
+	void LoadProgram(const ProgramImage &);
+
+	/// @brief Load the `.voleb` image in the `size` bytes at `data`.
+	error::LoadProgramError LoadImage(const uint8_t *data, size_t size, error::Location *where = nullptr);
+
+	/// @brief Write all memory, the registers and the PC to `path` as a
+	/// `.voleb` image.
+	/// @return `false` if the file could not be written.
+	bool SaveImage(const std::string &path) const;
 
 	/// @brief Run instructions indefinitely. Only returns on Step() ==
 	/// ShouldHalt::YES.
 	void Run();
 
+	/// @brief Same as Run(), but dispatches with threaded code (computed goto)
+	/// where the compiler supports it, one indirect jump per opcode handler
+	/// instead of a single shared one.
+	void RunThreaded();
+
+	/// @brief Run at most `maxInstructions` instructions with the dispatch
+	/// loop of RunThreaded(), then tell the screen it `Stopped()`.
+	/// @return Why it stopped and how many instructions were executed. The
+	/// instruction at a breakpoint is not executed, unless it is the first
+	/// one, so calling RunFor() again resumes past it.
+	RunResult RunFor(uint64_t maxInstructions);
+
+	/// @brief Stop RunFor() before executing the instruction at `at`.
+	void SetBreakpoint(uint8_t at, bool enabled = true);
+	bool HasBreakpoint(uint8_t at) const;
+
+	/// @brief Have RunFor() stop with `StopReason::LOOP_DETECTED` once the
+	/// machine (memory, registers and PC) repeats a state it was in during
+	/// the same run.
+	///
+	/// The state is hashed as it changes and checked with Brent's cycle
+	/// detection, which keeps a single earlier state to compare against. Off
+	/// by default: it makes RunFor() take its per-instruction path. Custom
+	/// control units must only depend on the machine's state. Suspended
+	/// while a device is mapped for loads, see Bus.
+	void DetectLoops(bool enabled = true);
+	bool DetectsLoops() const;
+
+	/// @brief The loop the last `StopReason::LOOP_DETECTED` stop was on.
+	const Loop &DetectedLoop() const;
+
 	/// @brief Only execute the next instruction.
 	ShouldHalt Step();
+
+	/// @brief Memory, registers and PC as they are now.
+	State Snapshot() const;
+	/// @brief Go back to a Snapshot(). Only the cells and registers that
+	/// differ from it are written, so decoded and translated instructions
+	/// elsewhere stay valid.
+	void Restore(const State &);
+
+	/// @brief A copy to explore from, independent of this machine from then
+	/// on. It shares the screen, the control units and the devices (not
+	/// copied), mapped on the same cells, and keeps the breakpoints and the
+	/// loop detection setting. It does not record to this machine's History,
+	/// Tracer or Profiler.
+	Machine Fork() const;
+
+	/// @brief Disassemble instruction word `slot` (cells `2 * slot` and
+	/// `2 * slot + 1`) with this machine's control units.
+	Disassembly Disassemble(uint8_t slot) const;
+	/// @brief Disassemble all `Disassembler::SLOTS` instruction words into
+	/// `out`.
+	void DisassembleAll(Disassembly *out) const;
+
+private:
+	friend class History;
+	friend class Jit;
+	friend class Profiler;
+	friend class Tracer;
+
+	/// Brent's cycle detection over the states RunFor() goes through.
+	struct LoopDetector {
+		bool enabled;
+		/// Zobrist hash of the machine's current state.
+		uint64_t hash;
+		/// State detection started in, replayed to find a loop's entry.
+		State start;
+		/// Saved state every power of two steps, and its hash.
+		State tortoise;
+		uint64_t tortoiseHash;
+		uint64_t power, lambda;
+		Loop found;
+	};
+
+	/// A predecoded instruction word.
+	struct DecodedSlot {
+		Instruction ins;
+		InstructionHandler handler;
+		/// `mem.SlotGeneration()` when decoded, 0 if never decoded.
+		uint64_t generation;
+	};
+
+	/// One slot per instruction word, redecoded only after the word is written.
+	std::array<DecodedSlot, Memory::SIZE / 2> m_Decoded;
+
+	/// Handler per opcode. Opcodes whose `controlUnitFactory` entry builds one
+	/// of the builtin control units run its `Apply` directly; any other
+	/// (custom) control unit goes through `ExecuteControlUnit`.
+	std::array<InstructionHandler, 16> m_Handlers;
+	/// What each opcode's control unit is, Mnemonic::CUSTOM for custom ones.
+	std::array<Mnemonic, 16> m_Mnemonics;
+
+	std::bitset<Memory::SIZE> m_Breakpoints;
+
+	LoopDetector m_Loops;
+	/// Where executed instructions are recorded, if anywhere.
+	History *m_History;
+	/// Where executed instructions are traced to, if anywhere.
+	Tracer *m_Tracer;
+	/// Where executed instructions are counted, if anywhere.
+	Profiler *m_Profiler;
+
+	/// RunFor() without telling the screen.
+	RunResult Advance(uint64_t maxInstructions);
+	/// Decode the instruction at the PC and move past it.
+	const Instruction &Fetch(Instruction &unaligned, InstructionHandler &handler);
+	const DecodedSlot &Decoded(uint8_t slot);
+	/// Run until the machine halts, or until at least `limit` (and at most
+	/// `limit + 128`) instructions ran.
+	ShouldHalt RunThreadedUntil(uint64_t limit, RunResult &result);
+	static StopReason HaltReason(InstructionHandler);
+	/// What a builtin instruction writes besides the PC: a cell, `Memory::SIZE`
+	/// plus a register, or -1 for nothing.
+	static int Written(InstructionHandler, const Instruction &);
+	/// Tell m_History how to undo `ins`, which was just fetched.
+	void Record(InstructionHandler, const Instruction &);
+	/// Tell m_Tracer that `ins`, fetched from `pc`, was executed.
+	void Trace(uint8_t pc, InstructionHandler, const Instruction &);
+	/// Whether executed instructions are recorded, traced or counted, which
+	/// takes the per-instruction paths.
+	bool Observed() const { return m_History != nullptr || m_Tracer != nullptr || m_Profiler != nullptr; }
+	/// Step() while Observed().
+	ShouldHalt StepObserved();
+	static ShouldHalt ExecuteControlUnit(Machine *, const Instruction &);
+
+	uint64_t StateHash() const;
+	void StartLoopDetection();
+	/// Execute `ins` like `handler(this, ins)`, updating the state hash, and
+	/// tell whether the machine is now in a loop.
+	ShouldHalt ExecuteDetectingLoops(InstructionHandler handler, const Instruction &ins, bool &looping);
+	/// Replay from `m_Loops.start` to find where the loop of `m_Loops.found`
+	/// is entered.
+	uint8_t FindLoopEntry(uint64_t period) const;
 };
 
+/// @brief The machine's 8-bit floating-point format. Decoding and adding are
+/// table lookups; the tables are generated at compile time.
 struct Float {
 	static float Decode(uint8_t);
 	static uint8_t Encode(float);
+	/// @brief `Encode(Decode(a) + Decode(b))`, what Add2 (op-code 6) stores.
+	static uint8_t Add(uint8_t a, uint8_t b);
+	/// @brief All 64 KiB of `Add()`, `Add(a, b)` at index `a << 8 | b`.
+	static const uint8_t *AddTable();
 };
 } // namespace vole